@@ -0,0 +1,140 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/*
+ * Attribute cache
+ *
+ * Keeps the attributes getattr reports for every inode: its type, size
+ * and the number of blocks it occupies. Type and size come from the
+ * in-memory inode table, but counting the blocks of a file with an
+ * indirect block means decoding that block, which for a tree walk
+ * would go through the few block maps and the block cache for every
+ * file visited.
+ *
+ * There is one entry per inode, a single 64-bit word so that it is
+ * read and replaced atomically without a lock:
+ *
+ *   bits 57-63  generation, bumped by every invalidation
+ *   bit  56     valid
+ *   bits 48-55  inode type
+ *   bits 32-47  number of blocks, including the indirect block
+ *   bits  0-31  size
+ *
+ * An entry is filled in with a compare-and-swap against the word read
+ * before the inode was looked at, so attributes computed while the
+ * inode was being changed are dropped if that change invalidated the
+ * entry in the meantime. The routines that change an inode or its
+ * block map call edfs_attr_invalidate() once they are done.
+ */
+
+#include "edfs-common.h"
+
+#include <stdlib.h>
+#include <errno.h>
+
+#define EDFS_ATTR_VALID         ((uint64_t)1 << 56)
+#define EDFS_ATTR_GEN_SHIFT     57
+#define EDFS_ATTR_GEN_MASK      (~(uint64_t)0 << EDFS_ATTR_GEN_SHIFT)
+
+struct edfs_attr_cache
+{
+    uint32_t n_entries;
+    uint64_t entries[];
+};
+
+bool
+edfs_attr_init(edfs_image_t *img)
+{
+    uint32_t n = img->sb.inode_table_n_inodes;
+
+    img->attrs = calloc(1, sizeof(edfs_attr_cache_t) + n * sizeof(uint64_t));
+    if (!img->attrs)
+        return false;
+
+    img->attrs->n_entries = n;
+
+    return true;
+}
+
+void
+edfs_attr_free(edfs_image_t *img)
+{
+    free(img->attrs);
+    img->attrs = NULL;
+}
+
+static inline void
+edfs_attr_unpack(uint64_t word, edfs_attr_t *attr)
+{
+    attr->type = (word >> 48) & 0xff;
+    attr->n_blocks = (word >> 32) & 0xffff;
+    attr->size = (uint32_t)word;
+}
+
+/* Gets the attributes of inode @inumber. Returns -ENOENT if the inode
+ * is not in use.
+ */
+int
+edfs_attr_get(edfs_image_t *img, edfs_inumber_t inumber, edfs_attr_t *attr)
+{
+    edfs_attr_cache_t *attrs = img->attrs;
+    uint64_t word = 0;
+
+    if (attrs && inumber < attrs->n_entries)
+    {
+        word = __atomic_load_n(&attrs->entries[inumber], __ATOMIC_ACQUIRE);
+        if (word & EDFS_ATTR_VALID)
+        {
+            edfs_stats_count(img, EDFS_STAT_ATTR_HIT);
+            edfs_attr_unpack(word, attr);
+            return 0;
+        }
+        edfs_stats_count(img, EDFS_STAT_ATTR_MISS);
+    }
+
+    edfs_inode_t inode = { .inumber = inumber };
+    int ret = edfs_read_inode(img, &inode);
+    if (ret < 0)
+        return ret;
+    else if (inode.inode.type == EDFS_INODE_TYPE_FREE)
+        return -ENOENT;
+
+    ret = edfs_inode_count_blocks(img, &inode);
+    if (ret < 0)
+        return ret;
+
+    attr->type = inode.inode.type;
+    attr->size = inode.inode.size;
+    attr->n_blocks = ret;
+
+    if (attrs && inumber < attrs->n_entries)
+    {
+        uint64_t valid = (word & EDFS_ATTR_GEN_MASK) | EDFS_ATTR_VALID |
+            (uint64_t)attr->type << 48 | (uint64_t)attr->n_blocks << 32 |
+            attr->size;
+
+        __atomic_compare_exchange_n(&attrs->entries[inumber], &word, valid,
+                                    false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+}
+
+void
+edfs_attr_invalidate(edfs_image_t *img, edfs_inumber_t inumber)
+{
+    edfs_attr_cache_t *attrs = img->attrs;
+    if (!attrs || inumber >= attrs->n_entries)
+        return;
+
+    uint64_t word = __atomic_load_n(&attrs->entries[inumber], __ATOMIC_RELAXED);
+    uint64_t gen;
+
+    do
+        gen = ((word >> EDFS_ATTR_GEN_SHIFT) + 1) << EDFS_ATTR_GEN_SHIFT;
+    while (!__atomic_compare_exchange_n(&attrs->entries[inumber], &word, gen,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED));
+}
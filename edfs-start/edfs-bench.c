@@ -0,0 +1,833 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/*
+ * Microbenchmarks of the routines in edfs-common.c, without FUSE
+ *
+ * Every benchmark runs on a fresh copy of one of the images in the
+ * image directory, so that runs are repeatable. Random offsets and sizes
+ * come from a generator with a fixed seed (-s to change it). For each
+ * kind of operation the number of operations per second, the median
+ * and 99th percentile latency and the number of image I/O calls per
+ * operation (as counted by edfs-stats.c) are reported. Benchmarks that
+ * need a geometry none of the images has make a fresh image with
+ * mkfs.edfs instead (--mkfs to give its path).
+ */
+
+#include "edfs-common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/* Deepest directory nesting walked by the lookup benchmark. */
+#define EDFS_BENCH_MAX_DEPTH 16
+
+/* Size of the file used by the read/write benchmarks; must stay below
+ * the maximum file size of the images.
+ */
+#define EDFS_BENCH_FILE_SIZE (128 * 1024)
+#define EDFS_BENCH_CHUNK_SIZE 4096
+
+/* Files kept alive at a time by the create/delete churn. */
+#define EDFS_BENCH_CHURN_FILES 64
+
+/* Files rewritten and truncated by the allocator stress. */
+#define EDFS_BENCH_ALLOC_FILES 16
+
+/* Geometry of the image made for the hashed directory fill: with the
+ * largest blocks a hashed directory has the most buckets.
+ */
+#define EDFS_BENCH_HASHED_BLOCK_SIZE "8192"
+#define EDFS_BENCH_HASHED_IMAGE_SIZE "64M"
+
+typedef struct
+{
+    const char *image_dir;
+    const char *mkfs;
+    edfs_io_mode_t io_mode;
+    bool journal;
+    uint32_t n_iter;
+} edfs_bench_config_t;
+
+/* Latencies of one kind of operation. */
+typedef struct
+{
+    const char *name;
+    uint64_t *lat;
+    uint32_t n;
+    uint32_t cap;
+    uint64_t elapsed;
+    uint64_t io_calls;
+} edfs_bench_t;
+
+static uint64_t edfs_bench_rand_state = 0x2545f4914f6cdd1dULL;
+
+/* xorshift64*, so that the sequence is the same on every platform. */
+static uint64_t
+edfs_bench_rand(void)
+{
+    uint64_t x = edfs_bench_rand_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    edfs_bench_rand_state = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static bool
+edfs_bench_init(edfs_bench_t *bench, const char *name, uint32_t cap)
+{
+    memset(bench, 0, sizeof(edfs_bench_t));
+    bench->name = name;
+    bench->cap = cap;
+    bench->lat = malloc(cap * sizeof(uint64_t));
+
+    return bench->lat != NULL;
+}
+
+static inline uint64_t
+edfs_bench_start(edfs_bench_t *bench, edfs_image_t *img)
+{
+    bench->io_calls -= edfs_stats_io_calls(img);
+
+    return edfs_stats_now();
+}
+
+static inline void
+edfs_bench_stop(edfs_bench_t *bench, edfs_image_t *img, uint64_t start)
+{
+    uint64_t ns = edfs_stats_now() - start;
+
+    bench->io_calls += edfs_stats_io_calls(img);
+    bench->elapsed += ns;
+    if (bench->n < bench->cap)
+        bench->lat[bench->n++] = ns;
+}
+
+static int
+edfs_bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+edfs_bench_report(edfs_bench_t *bench)
+{
+    if (bench->n == 0)
+    {
+        printf("%-24s %8s\n", bench->name, "-");
+        free(bench->lat);
+        return;
+    }
+
+    qsort(bench->lat, bench->n, sizeof(uint64_t), edfs_bench_compare);
+
+    printf("%-24s %8u %12.0f %10.2f %10.2f %12.2f\n", bench->name, bench->n,
+           bench->n / (bench->elapsed / 1e9),
+           bench->lat[bench->n / 2] / 1e3,
+           bench->lat[(uint64_t)bench->n * 99 / 100] / 1e3,
+           (double)bench->io_calls / bench->n);
+
+    free(bench->lat);
+}
+
+/* Opens the image at @path, adding a journal if asked for. The image is
+ * removed on failure.
+ */
+static edfs_image_t *
+edfs_bench_open_image(const edfs_bench_config_t *config, const char *path)
+{
+    edfs_image_t *img = edfs_image_open(path, true, config->io_mode);
+    if (!img)
+    {
+        unlink(path);
+        return NULL;
+    }
+
+    if (config->journal)
+    {
+        int ret = edfs_journal_create(img);
+        if (ret < 0)
+        {
+            fprintf(stderr, "error: could not create journal: %s\n",
+                    strerror(-ret));
+            edfs_image_close(img);
+            unlink(path);
+            return NULL;
+        }
+    }
+
+    return img;
+}
+
+/* Copies @name from the image directory to a temporary file and opens
+ * the copy, which is removed again by edfs_bench_close().
+ */
+static edfs_image_t *
+edfs_bench_open(const edfs_bench_config_t *config, const char *name,
+                char *path, size_t path_size)
+{
+    char src_path[PATH_MAX];
+    snprintf(src_path, sizeof(src_path), "%s/%s", config->image_dir, name);
+    snprintf(path, path_size, "/tmp/edfs-bench-XXXXXX");
+
+    int src = open(src_path, O_RDONLY);
+    if (src < 0)
+    {
+        fprintf(stderr, "error: could not open file '%s': %s\n",
+                src_path, strerror(errno));
+        return NULL;
+    }
+
+    int dst = mkstemp(path);
+    if (dst < 0)
+    {
+        fprintf(stderr, "error: could not create temporary file: %s\n",
+                strerror(errno));
+        close(src);
+        return NULL;
+    }
+
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(src, buf, sizeof(buf))) > 0)
+        if (write(dst, buf, n) != n)
+        {
+            n = -1;
+            break;
+        }
+
+    close(src);
+    close(dst);
+
+    if (n < 0)
+    {
+        fprintf(stderr, "error: could not copy '%s'.\n", src_path);
+        unlink(path);
+        return NULL;
+    }
+
+    return edfs_bench_open_image(config, path);
+}
+
+/* Makes a new image with mkfs.edfs, called with the options @block_size
+ * and @size for -b and -s, and opens it like edfs_bench_open().
+ */
+static edfs_image_t *
+edfs_bench_open_new(const edfs_bench_config_t *config, const char *block_size,
+                    const char *size, char *path, size_t path_size)
+{
+    snprintf(path, path_size, "/tmp/edfs-bench-XXXXXX");
+
+    int fd = mkstemp(path);
+    if (fd < 0)
+    {
+        fprintf(stderr, "error: could not create temporary file: %s\n",
+                strerror(errno));
+        return NULL;
+    }
+    close(fd);
+
+    int status = -1;
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, STDOUT_FILENO);
+        execl(config->mkfs, config->mkfs, "-b", block_size, "-s", size,
+              path, (char *)NULL);
+        _exit(127);
+    }
+    else if (pid > 0)
+        waitpid(pid, &status, 0);
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "error: could not make an image with '%s'.\n",
+                config->mkfs);
+        unlink(path);
+        return NULL;
+    }
+
+    return edfs_bench_open_image(config, path);
+}
+
+static void
+edfs_bench_close(edfs_image_t *img, const char *path)
+{
+    edfs_image_close(img);
+    unlink(path);
+}
+
+/* Creates @name in @parent, of @type; the new inode is left in @inode. */
+static int
+edfs_bench_create(edfs_image_t *img, edfs_inode_t *parent, const char *name,
+                  edfs_inode_type_t type, edfs_inode_t *inode)
+{
+    edfs_journal_start(img);
+
+    int ret = edfs_dir_create(img, parent, name, type, inode);
+
+    edfs_journal_stop(img);
+
+    return ret;
+}
+
+/* Removes @name, referring to @inode, from @parent and releases it. */
+static int
+edfs_bench_delete(edfs_image_t *img, edfs_inode_t *parent, const char *name,
+                  edfs_inode_t *inode)
+{
+    const bool is_dir = edfs_disk_inode_is_directory(&inode->inode);
+
+    edfs_journal_start(img);
+
+    int ret = edfs_remove_dir_entry(img, parent, name);
+    if (ret == 0)
+        ret = edfs_inode_free_blocks(img, inode, 0);
+
+    /* The inumber may be reused, drop whatever was cached below it. */
+    if (ret >= 0 && is_dir)
+        edfs_dcache_forget_dir(img, inode->inumber);
+    if (ret >= 0)
+        ret = edfs_clear_inode(img, inode) <= 0 ? -EIO : 0;
+
+    edfs_journal_stop(img);
+
+    return ret;
+}
+
+static int
+edfs_bench_write(edfs_image_t *img, edfs_inode_t *inode, const void *buf,
+                 uint32_t size, uint32_t off)
+{
+    edfs_journal_start(img);
+    int ret = edfs_write_inode_data(img, inode, buf, size, off, NULL);
+    edfs_journal_stop(img);
+
+    return ret;
+}
+
+static int
+edfs_bench_truncate(edfs_image_t *img, edfs_inode_t *inode, uint32_t size)
+{
+    edfs_journal_start(img);
+    int ret = edfs_truncate_inode_data(img, inode, size);
+    edfs_journal_stop(img);
+
+    return ret;
+}
+
+/* Resolves paths of increasing depth, once with a warm and once with an
+ * empty directory entry cache.
+ */
+static int
+edfs_bench_lookup(const edfs_bench_config_t *config)
+{
+    char image[PATH_MAX];
+    edfs_image_t *img = edfs_bench_open(config, "empty.img", image, sizeof(image));
+    if (!img)
+        return -1;
+
+    char path[EDFS_BENCH_MAX_DEPTH * 3 + 1] = "";
+    edfs_inode_t dir;
+    edfs_read_root_inode(img, &dir);
+
+    int ret = 0;
+    for (int depth = 1; depth <= EDFS_BENCH_MAX_DEPTH && ret == 0; depth++)
+    {
+        edfs_inode_t child;
+        ret = edfs_bench_create(img, &dir, "d", EDFS_INODE_TYPE_DIRECTORY,
+                                &child);
+        dir = child;
+    }
+
+    for (int depth = 1; depth <= EDFS_BENCH_MAX_DEPTH && ret == 0; depth *= 2)
+    {
+        path[0] = 0;
+        for (int i = 0; i < depth; i++)
+            strcat(path, "/d");
+
+        for (int cold = 0; cold <= 1 && ret == 0; cold++)
+        {
+            char name[64];
+            snprintf(name, sizeof(name), "lookup depth %d%s", depth,
+                     cold ? " cold" : "");
+
+            edfs_bench_t bench;
+            if (!edfs_bench_init(&bench, name, config->n_iter))
+            {
+                ret = -ENOMEM;
+                break;
+            }
+
+            for (uint32_t i = 0; i < config->n_iter; i++)
+            {
+                if (cold)
+                {
+                    edfs_dcache_free(img);
+                    edfs_dcache_init(img);
+                }
+
+                edfs_inode_t inode;
+                uint64_t start = edfs_bench_start(&bench, img);
+                bool found = edfs_find_inode(img, path, &inode);
+                edfs_bench_stop(&bench, img, start);
+
+                if (!found)
+                {
+                    ret = -ENOENT;
+                    break;
+                }
+            }
+
+            edfs_bench_report(&bench);
+        }
+    }
+
+    edfs_bench_close(img, image);
+
+    return ret;
+}
+
+/* Fills directories with EDFS_MAX_DIR_ENTRIES files each. */
+static int
+edfs_bench_dir_fill(const edfs_bench_config_t *config)
+{
+    char image[PATH_MAX];
+    edfs_image_t *img = edfs_bench_open(config, "empty.img", image, sizeof(image));
+    if (!img)
+        return -1;
+
+    edfs_inode_t root;
+    edfs_read_root_inode(img, &root);
+
+    uint32_t n_rounds = (config->n_iter + EDFS_MAX_DIR_ENTRIES - 1) /
+        EDFS_MAX_DIR_ENTRIES;
+
+    edfs_bench_t fill = { 0, }, remove = { 0, };
+    int ret = 0;
+    if (!edfs_bench_init(&fill, "dir fill", n_rounds * EDFS_MAX_DIR_ENTRIES) ||
+        !edfs_bench_init(&remove, "dir remove", n_rounds * EDFS_MAX_DIR_ENTRIES))
+        ret = -ENOMEM;
+
+    edfs_inode_t *files = calloc(EDFS_MAX_DIR_ENTRIES, sizeof(edfs_inode_t));
+    if (!files)
+        ret = -ENOMEM;
+
+    for (uint32_t round = 0; round < n_rounds && ret == 0; round++)
+    {
+        edfs_inode_t dir;
+        ret = edfs_bench_create(img, &root, "fill", EDFS_INODE_TYPE_DIRECTORY,
+                                &dir);
+
+        for (uint32_t i = 0; i < EDFS_MAX_DIR_ENTRIES && ret == 0; i++)
+        {
+            char name[EDFS_FILENAME_SIZE];
+            snprintf(name, sizeof(name), "file%u", i);
+
+            uint64_t start = edfs_bench_start(&fill, img);
+            ret = edfs_bench_create(img, &dir, name, EDFS_INODE_TYPE_FILE,
+                                    &files[i]);
+            edfs_bench_stop(&fill, img, start);
+        }
+
+        for (uint32_t i = 0; i < EDFS_MAX_DIR_ENTRIES && ret == 0; i++)
+        {
+            char name[EDFS_FILENAME_SIZE];
+            snprintf(name, sizeof(name), "file%u", i);
+
+            uint64_t start = edfs_bench_start(&remove, img);
+            ret = edfs_bench_delete(img, &dir, name, &files[i]);
+            edfs_bench_stop(&remove, img, start);
+        }
+
+        if (ret == 0)
+            ret = edfs_bench_delete(img, &root, "fill", &dir);
+    }
+
+    if (fill.lat)
+        edfs_bench_report(&fill);
+    if (remove.lat)
+        edfs_bench_report(&remove);
+
+    free(files);
+    edfs_bench_close(img, image);
+
+    return ret;
+}
+
+/* Fills a single directory with -n files, past the capacity of the
+ * classic format so that it is converted to the hashed one, on an image
+ * with 8 KB blocks.
+ */
+static int
+edfs_bench_dir_fill_hashed(const edfs_bench_config_t *config)
+{
+    char image[PATH_MAX];
+    edfs_image_t *img = edfs_bench_open_new(config,
+                                            EDFS_BENCH_HASHED_BLOCK_SIZE,
+                                            EDFS_BENCH_HASHED_IMAGE_SIZE,
+                                            image, sizeof(image));
+    if (!img)
+        return -1;
+
+    edfs_inode_t root;
+    edfs_read_root_inode(img, &root);
+
+    edfs_bench_t fill = { 0, }, lookup = { 0, };
+    int ret = 0;
+    if (!edfs_bench_init(&fill, "hashed dir fill", config->n_iter) ||
+        !edfs_bench_init(&lookup, "hashed dir lookup", config->n_iter))
+        ret = -ENOMEM;
+
+    edfs_inode_t dir;
+    if (ret == 0)
+        ret = edfs_bench_create(img, &root, "fill", EDFS_INODE_TYPE_DIRECTORY,
+                                &dir);
+
+    for (uint32_t i = 0; i < config->n_iter && ret == 0; i++)
+    {
+        char name[EDFS_FILENAME_SIZE];
+        snprintf(name, sizeof(name), "file%u", i);
+
+        edfs_inode_t file;
+        uint64_t start = edfs_bench_start(&fill, img);
+        ret = edfs_bench_create(img, &dir, name, EDFS_INODE_TYPE_FILE, &file);
+        edfs_bench_stop(&fill, img, start);
+    }
+
+    for (uint32_t i = 0; i < config->n_iter && ret == 0; i++)
+    {
+        char path[EDFS_FILENAME_SIZE + 8];
+        snprintf(path, sizeof(path), "/fill/file%u", i);
+
+        edfs_inode_t file;
+        uint64_t start = edfs_bench_start(&lookup, img);
+        if (!edfs_find_inode(img, path, &file))
+            ret = -ENOENT;
+        edfs_bench_stop(&lookup, img, start);
+    }
+
+    if (fill.lat)
+        edfs_bench_report(&fill);
+    if (lookup.lat)
+        edfs_bench_report(&lookup);
+
+    edfs_bench_close(img, image);
+
+    return ret;
+}
+
+/* Sequential and random reads and writes of a new file. */
+static int
+edfs_bench_rw(const edfs_bench_config_t *config)
+{
+    char image[PATH_MAX];
+    edfs_image_t *img = edfs_bench_open(config, "populated.img", image,
+                                        sizeof(image));
+    if (!img)
+        return -1;
+
+    const uint32_t n_chunks = EDFS_BENCH_FILE_SIZE / EDFS_BENCH_CHUNK_SIZE;
+    const uint16_t BLK_SIZE = img->sb.block_size;
+
+    static char buf[EDFS_BENCH_CHUNK_SIZE];
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (char)edfs_bench_rand();
+
+    edfs_inode_t root, file;
+    edfs_read_root_inode(img, &root);
+
+    int ret = edfs_bench_create(img, &root, "bench", EDFS_INODE_TYPE_FILE,
+                                &file);
+
+    edfs_bench_t seq_write, seq_read, rnd_write, rnd_read;
+    edfs_bench_t *all[] = { &seq_write, &seq_read, &rnd_write, &rnd_read };
+    const char *names[] = { "write seq 4k", "read seq 4k",
+                            "write random block", "read random block" };
+
+    for (int i = 0; i < 4; i++)
+        if (!edfs_bench_init(all[i], names[i], config->n_iter) && ret == 0)
+            ret = -ENOMEM;
+
+    /* Sequential writes start over on an empty file every n_chunks, so
+     * that block allocation is included.
+     */
+    for (uint32_t i = 0; i < config->n_iter && ret >= 0; i++)
+    {
+        uint32_t chunk = i % n_chunks;
+        if (chunk == 0 && i > 0)
+            ret = edfs_bench_truncate(img, &file, 0);
+
+        uint64_t start = edfs_bench_start(&seq_write, img);
+        if (ret >= 0)
+            ret = edfs_bench_write(img, &file, buf, EDFS_BENCH_CHUNK_SIZE,
+                                   chunk * EDFS_BENCH_CHUNK_SIZE);
+        edfs_bench_stop(&seq_write, img, start);
+    }
+
+    /* Make sure the file has its full size for the reads. */
+    if (ret >= 0 && file.inode.size < EDFS_BENCH_FILE_SIZE)
+        ret = edfs_bench_write(img, &file, buf, 1, EDFS_BENCH_FILE_SIZE - 1);
+
+    for (uint32_t i = 0; i < config->n_iter && ret >= 0; i++)
+    {
+        uint32_t chunk = i % n_chunks;
+        char data[EDFS_BENCH_CHUNK_SIZE];
+
+        uint64_t start = edfs_bench_start(&seq_read, img);
+        ret = edfs_read_inode_data(img, &file, data, EDFS_BENCH_CHUNK_SIZE,
+                                   chunk * EDFS_BENCH_CHUNK_SIZE);
+        edfs_bench_stop(&seq_read, img, start);
+    }
+
+    const uint32_t n_blocks = EDFS_BENCH_FILE_SIZE / BLK_SIZE;
+
+    for (uint32_t i = 0; i < config->n_iter && ret >= 0; i++)
+    {
+        uint32_t off = (edfs_bench_rand() % n_blocks) * BLK_SIZE;
+
+        uint64_t start = edfs_bench_start(&rnd_write, img);
+        ret = edfs_bench_write(img, &file, buf, BLK_SIZE, off);
+        edfs_bench_stop(&rnd_write, img, start);
+    }
+
+    for (uint32_t i = 0; i < config->n_iter && ret >= 0; i++)
+    {
+        uint32_t off = (edfs_bench_rand() % n_blocks) * BLK_SIZE;
+        char data[EDFS_MAX_BLOCK_SIZE];
+
+        uint64_t start = edfs_bench_start(&rnd_read, img);
+        ret = edfs_read_inode_data(img, &file, data, BLK_SIZE, off);
+        edfs_bench_stop(&rnd_read, img, start);
+    }
+
+    for (int i = 0; i < 4; i++)
+        if (all[i]->lat)
+            edfs_bench_report(all[i]);
+
+    edfs_bench_close(img, image);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Grows and shrinks files to random sizes on an image of which the free
+ * space is fragmented.
+ */
+static int
+edfs_bench_alloc(const edfs_bench_config_t *config)
+{
+    char image[PATH_MAX];
+    edfs_image_t *img = edfs_bench_open(config, "empty-randomized.img", image,
+                                        sizeof(image));
+    if (!img)
+        return -1;
+
+    static char buf[EDFS_BENCH_FILE_SIZE / 2];
+    memset(buf, 0xa5, sizeof(buf));
+
+    edfs_inode_t root;
+    edfs_inode_t files[EDFS_BENCH_ALLOC_FILES];
+    edfs_read_root_inode(img, &root);
+
+    edfs_bench_t grow = { 0, }, shrink = { 0, };
+    int ret = 0;
+    if (!edfs_bench_init(&grow, "alloc grow", config->n_iter) ||
+        !edfs_bench_init(&shrink, "alloc shrink", config->n_iter))
+        ret = -ENOMEM;
+
+    for (int i = 0; i < EDFS_BENCH_ALLOC_FILES && ret == 0; i++)
+    {
+        char name[EDFS_FILENAME_SIZE];
+        snprintf(name, sizeof(name), "alloc%d", i);
+        ret = edfs_bench_create(img, &root, name, EDFS_INODE_TYPE_FILE,
+                                &files[i]);
+    }
+
+    for (uint32_t i = 0; i < config->n_iter && ret >= 0; i++)
+    {
+        edfs_inode_t *file = &files[i % EDFS_BENCH_ALLOC_FILES];
+        uint32_t size = 1 + edfs_bench_rand() % sizeof(buf);
+
+        uint64_t start = edfs_bench_start(&grow, img);
+        ret = edfs_bench_write(img, file, buf, size, 0);
+        edfs_bench_stop(&grow, img, start);
+
+        if (ret == -ENOSPC)
+            ret = 0;
+
+        start = edfs_bench_start(&shrink, img);
+        if (ret >= 0)
+            ret = edfs_bench_truncate(img, file,
+                                      edfs_bench_rand() % (size / 2 + 1));
+        edfs_bench_stop(&shrink, img, start);
+    }
+
+    if (grow.lat)
+        edfs_bench_report(&grow);
+    if (shrink.lat)
+        edfs_bench_report(&shrink);
+
+    edfs_bench_close(img, image);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Creates, writes and deletes small files in the root directory. */
+static int
+edfs_bench_churn(const edfs_bench_config_t *config)
+{
+    char image[PATH_MAX];
+    edfs_image_t *img = edfs_bench_open(config, "empty.img", image, sizeof(image));
+    if (!img)
+        return -1;
+
+    static char buf[1024];
+    memset(buf, 0x5a, sizeof(buf));
+
+    edfs_inode_t root;
+    edfs_inode_t files[EDFS_BENCH_CHURN_FILES];
+    edfs_read_root_inode(img, &root);
+
+    edfs_bench_t create = { 0, }, delete = { 0, };
+    int ret = 0;
+    if (!edfs_bench_init(&create, "churn create+write", config->n_iter) ||
+        !edfs_bench_init(&delete, "churn delete", config->n_iter))
+        ret = -ENOMEM;
+
+    for (uint32_t done = 0; done < config->n_iter && ret == 0; )
+    {
+        uint32_t n = config->n_iter - done;
+        if (n > EDFS_BENCH_CHURN_FILES)
+            n = EDFS_BENCH_CHURN_FILES;
+
+        for (uint32_t i = 0; i < n && ret == 0; i++)
+        {
+            char name[EDFS_FILENAME_SIZE];
+            snprintf(name, sizeof(name), "churn%u", i);
+
+            uint64_t start = edfs_bench_start(&create, img);
+            ret = edfs_bench_create(img, &root, name, EDFS_INODE_TYPE_FILE,
+                                    &files[i]);
+            if (ret == 0)
+                ret = edfs_bench_write(img, &files[i], buf, sizeof(buf), 0);
+            edfs_bench_stop(&create, img, start);
+
+            if (ret > 0)
+                ret = 0;
+        }
+
+        for (uint32_t i = 0; i < n && ret == 0; i++)
+        {
+            char name[EDFS_FILENAME_SIZE];
+            snprintf(name, sizeof(name), "churn%u", i);
+
+            uint64_t start = edfs_bench_start(&delete, img);
+            ret = edfs_bench_delete(img, &root, name, &files[i]);
+            edfs_bench_stop(&delete, img, start);
+        }
+
+        done += n;
+    }
+
+    if (create.lat)
+        edfs_bench_report(&create);
+    if (delete.lat)
+        edfs_bench_report(&delete);
+
+    edfs_bench_close(img, image);
+
+    return ret;
+}
+
+static void
+edfs_bench_usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [--mmap | --io-uring] [--journal] [-n iterations] "
+            "[-s seed] [--mkfs path] [image directory]\n", argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    edfs_bench_config_t config =
+    {
+        .image_dir = "../images",
+        .mkfs = "./mkfs.edfs",
+        .io_mode = EDFS_IO_PREAD,
+        .journal = false,
+        .n_iter = 1000,
+    };
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--mmap") == 0)
+            config.io_mode = EDFS_IO_MMAP;
+        else if (strcmp(argv[i], "--io-uring") == 0)
+            config.io_mode = EDFS_IO_URING;
+        else if (strcmp(argv[i], "--journal") == 0)
+            config.journal = true;
+        else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            config.n_iter = strtoul(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            edfs_bench_rand_state = strtoull(argv[++i], NULL, 0) | 1;
+        else if (strcmp(argv[i], "--mkfs") == 0 && i + 1 < argc)
+            config.mkfs = argv[++i];
+        else if (argv[i][0] != '-')
+            config.image_dir = argv[i];
+        else
+        {
+            edfs_bench_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.n_iter == 0)
+    {
+        edfs_bench_usage(argv[0]);
+        return 1;
+    }
+
+    printf("%-24s %8s %12s %10s %10s %12s\n", "benchmark", "ops", "ops/s",
+           "p50 us", "p99 us", "syscalls/op");
+
+    int (*benchmarks[])(const edfs_bench_config_t *) =
+    {
+        edfs_bench_lookup,
+        edfs_bench_dir_fill,
+        edfs_bench_dir_fill_hashed,
+        edfs_bench_rw,
+        edfs_bench_alloc,
+        edfs_bench_churn,
+    };
+
+    int res = 0;
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+    {
+        int ret = benchmarks[i](&config);
+        if (ret != 0)
+        {
+            fprintf(stderr, "error: benchmark failed: %s\n",
+                    ret < 0 ? strerror(-ret) : "setup");
+            res = 1;
+        }
+    }
+
+    return res;
+}
@@ -0,0 +1,861 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/*
+ * Write-back block cache
+ *
+ * A fixed number of block-sized slots, looked up through a table indexed
+ * by block number and recycled with the CLOCK algorithm. Writes only
+ * modify the cached copy and mark the slot dirty; dirty slots are written
+ * back when they are evicted or when edfs_cache_flush() is called.
+ *
+ * edfs_cache_flush() writes the dirty blocks in block order, one call
+ * per run of adjacent blocks, without holding the cache lock during the
+ * I/O. Slots under writeback are marked busy. They are not evicted, and
+ * routines that modify or drop a block wait until its writeback
+ * finished. Once started, a writeback thread calls edfs_cache_flush()
+ * on the age and size thresholds set in edfs-common.h, so that the
+ * threads serving requests rarely have to write back a block
+ * themselves.
+ *
+ * Blocks holding metadata are marked with edfs_cache_set_meta() when the
+ * image has a journal. Their dirty copies are pinned: eviction and
+ * edfs_cache_flush() skip them, the journal writes them back once their
+ * contents are committed. Should the operations in flight pin every
+ * slot, a miss commits the journal to unpin them rather than fail.
+ *
+ * When the image is mapped (EDFS_IO_MMAP) there is no cache: the routines
+ * below then copy directly from and to the mapping.
+ *
+ * All public routines take cache->lock, the static helpers expect it to
+ * be held by the caller.
+ */
+
+#include "edfs-common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+
+typedef struct
+{
+    edfs_block_t block;
+    bool valid;
+    bool dirty;
+    bool referenced;
+    bool busy;                  /* being written back, unlocked */
+    uint64_t busy_gen;          /* flush_gen of the writeback, if busy */
+    edfs_io_site_t site;        /* what the block holds, for statistics */
+    uint64_t dirtied;           /* when it became dirty, edfs_stats_now() */
+    uint64_t seq;               /* cache->n_writes at its last change */
+    uint8_t *data;
+} edfs_cache_slot_t;
+
+struct edfs_cache
+{
+    pthread_mutex_t lock;
+
+    uint32_t n_slots;
+    uint32_t clock_hand;
+
+    /* Number of dirty and of busy slots. Once n_dirty reaches
+     * wb_threshold the writeback thread is woken up. idle is signalled
+     * whenever slots stop being busy. Each edfs_cache_flush() call
+     * takes the next flush_gen, which tags the slots it writes back.
+     */
+    uint32_t n_dirty;
+    uint32_t n_busy;
+    uint64_t flush_gen;
+    uint32_t wb_threshold;
+    pthread_cond_t idle;
+
+    /* Writeback thread, see edfs_cache_writeback_start(). */
+    pthread_t wb_thread;
+    pthread_cond_t wb_wakeup;
+    bool wb_running;
+    bool wb_stop;
+    bool wb_kick;
+
+    /* Slot index caching each block, or -1. Has sb.n_blocks entries. */
+    int32_t *slot_of;
+
+    /* Whether each block holds journaled metadata, sb.n_blocks entries.
+     * n_writes counts the modifications of cached blocks, so that the
+     * journal can tell whether a block changed after it was copied.
+     */
+    bool *meta;
+    uint64_t n_writes;
+
+    edfs_cache_slot_t *slots;
+    uint8_t *data;
+};
+
+bool
+edfs_cache_init(edfs_image_t *img)
+{
+    edfs_cache_t *cache = calloc(1, sizeof(edfs_cache_t));
+    if (!cache)
+        return false;
+
+    cache->n_slots = EDFS_CACHE_N_SLOTS;
+    if (cache->n_slots > img->sb.n_blocks)
+        cache->n_slots = img->sb.n_blocks;
+
+    cache->slot_of = malloc(img->sb.n_blocks * sizeof(int32_t));
+    cache->meta = calloc(img->sb.n_blocks, sizeof(bool));
+    cache->slots = calloc(cache->n_slots, sizeof(edfs_cache_slot_t));
+    cache->data = malloc((size_t)cache->n_slots * img->sb.block_size);
+    if (!cache->slot_of || !cache->meta || !cache->slots || !cache->data)
+    {
+        free(cache->slot_of);
+        free(cache->meta);
+        free(cache->slots);
+        free(cache->data);
+        free(cache);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < img->sb.n_blocks; i++)
+        cache->slot_of[i] = -1;
+
+    for (uint32_t i = 0; i < cache->n_slots; i++)
+        cache->slots[i].data = cache->data + (size_t)i * img->sb.block_size;
+
+    cache->wb_threshold = cache->n_slots / 4 > 0 ? cache->n_slots / 4 : 1;
+
+    /* Deadlines of the writeback thread are taken from edfs_stats_now(). */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cache->wb_wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_cond_init(&cache->idle, NULL);
+    pthread_mutex_init(&cache->lock, NULL);
+    img->cache = cache;
+
+    return true;
+}
+
+/* Releases the cache, dirty blocks are NOT written back. */
+void
+edfs_cache_free(edfs_image_t *img)
+{
+    edfs_cache_t *cache = img->cache;
+    if (!cache)
+        return;
+
+    edfs_cache_writeback_stop(img);
+
+    pthread_cond_destroy(&cache->wb_wakeup);
+    pthread_cond_destroy(&cache->idle);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->slot_of);
+    free(cache->meta);
+    free(cache->slots);
+    free(cache->data);
+    free(cache);
+    img->cache = NULL;
+}
+
+static inline void
+edfs_cache_mark_dirty(edfs_cache_t *cache, edfs_cache_slot_t *slot)
+{
+    slot->seq = ++cache->n_writes;
+    if (slot->dirty)
+        return;
+
+    slot->dirty = true;
+    slot->dirtied = edfs_stats_now();
+
+    if (++cache->n_dirty == cache->wb_threshold && cache->wb_running)
+    {
+        cache->wb_kick = true;
+        pthread_cond_signal(&cache->wb_wakeup);
+    }
+}
+
+static inline void
+edfs_cache_mark_clean(edfs_cache_t *cache, edfs_cache_slot_t *slot)
+{
+    if (!slot->dirty)
+        return;
+
+    slot->dirty = false;
+    cache->n_dirty--;
+}
+
+static int
+edfs_cache_writeback(edfs_image_t *img, edfs_cache_slot_t *slot)
+{
+    const uint16_t BLK_SIZE = img->sb.block_size;
+
+    off_t off = edfs_get_block_offset(&img->sb, slot->block);
+    ssize_t ret = edfs_image_pwrite(img, slot->data, BLK_SIZE, off);
+    edfs_stats_io(img, slot->site, true, ret);
+    if (ret < 0)
+        return -errno;
+    else if (ret != BLK_SIZE)
+        return -EIO;
+
+    edfs_cache_mark_clean(img->cache, slot);
+
+    return 0;
+}
+
+/* Returns true if @slot holds metadata that is not committed yet. */
+static inline bool
+edfs_cache_pinned(edfs_cache_t *cache, edfs_cache_slot_t *slot)
+{
+    return slot->valid && slot->dirty && cache->meta[slot->block];
+}
+
+/* Picks a slot to (re)use with the CLOCK algorithm, writing back its
+ * current contents if dirty. The returned slot is no longer valid.
+ * Returns -EAGAIN if all slots are pinned or busy and some are busy,
+ * -EBUSY if all slots are pinned.
+ */
+static int
+edfs_cache_evict(edfs_image_t *img, edfs_cache_slot_t **victim)
+{
+    edfs_cache_t *cache = img->cache;
+
+    /* Two rounds clear all referenced bits, so a third one that finds
+     * nothing means every slot is pinned or busy.
+     */
+    for (uint32_t i = 0; i < 3 * cache->n_slots; i++)
+    {
+        edfs_cache_slot_t *slot = &cache->slots[cache->clock_hand];
+        cache->clock_hand = (cache->clock_hand + 1) % cache->n_slots;
+
+        if (slot->busy || edfs_cache_pinned(cache, slot))
+            continue;
+
+        if (slot->valid && slot->referenced)
+        {
+            slot->referenced = false;
+            continue;
+        }
+
+        if (slot->valid)
+        {
+            edfs_stats_count(img, EDFS_STAT_CACHE_EVICT);
+
+            if (slot->dirty)
+            {
+                int ret = edfs_cache_writeback(img, slot);
+                if (ret < 0)
+                    return ret;
+            }
+
+            cache->slot_of[slot->block] = -1;
+            slot->valid = false;
+        }
+
+        *victim = slot;
+        return 0;
+    }
+
+    return cache->n_busy > 0 ? -EAGAIN : -EBUSY;
+}
+
+/* Returns the slot holding @block. On a miss the block is read from the
+ * image, unless @fill is false, in which case the slot content is left
+ * for the caller to initialize. @site is what the block holds, recorded
+ * on a miss for the statistics.
+ */
+static int
+edfs_cache_get(edfs_image_t *img, edfs_block_t block, bool fill,
+               edfs_io_site_t site, edfs_cache_slot_t **result)
+{
+    edfs_cache_t *cache = img->cache;
+
+    if (block == EDFS_BLOCK_INVALID || block >= img->sb.n_blocks)
+        return -EINVAL;
+
+    edfs_cache_slot_t *slot = NULL;
+    int ret;
+
+    /* Waiting for a writeback releases the lock, after which the block
+     * may have been loaded by another thread.
+     */
+    do
+    {
+        int32_t idx = cache->slot_of[block];
+        if (idx >= 0)
+        {
+            edfs_stats_count(img, EDFS_STAT_CACHE_HIT);
+            cache->slots[idx].referenced = true;
+            *result = &cache->slots[idx];
+            return 0;
+        }
+
+        ret = edfs_cache_evict(img, &slot);
+        if (ret == -EAGAIN)
+            pthread_cond_wait(&cache->idle, &cache->lock);
+        else if (ret == -EBUSY && img->journal)
+        {
+            /* The blocks pinned by the operations in flight fill the
+             * cache, commit them to make room.
+             */
+            pthread_mutex_unlock(&cache->lock);
+            int n = edfs_journal_commit_pinned(img);
+            pthread_mutex_lock(&cache->lock);
+            if (n > 0)
+                ret = -EAGAIN;
+            else if (n < 0)
+                ret = n;
+        }
+    }
+    while (ret == -EAGAIN);
+
+    edfs_stats_count(img, EDFS_STAT_CACHE_MISS);
+    if (ret < 0)
+        return ret;
+
+    if (fill)
+    {
+        const uint16_t BLK_SIZE = img->sb.block_size;
+
+        off_t off = edfs_get_block_offset(&img->sb, block);
+        ssize_t n = edfs_image_pread(img, slot->data, BLK_SIZE, off);
+        edfs_stats_io(img, site, false, n);
+        if (n < 0)
+            return -errno;
+        else if (n != BLK_SIZE)
+            return -EIO;
+    }
+
+    slot->block = block;
+    slot->valid = true;
+    slot->dirty = false;
+    slot->referenced = true;
+    slot->site = site;
+    cache->slot_of[block] = slot - cache->slots;
+
+    *result = slot;
+    return 0;
+}
+
+/* Like edfs_cache_get(), for a slot that is about to be modified: waits
+ * until a writeback of the block in progress has finished.
+ */
+static int
+edfs_cache_get_idle(edfs_image_t *img, edfs_block_t block, bool fill,
+                    edfs_io_site_t site, edfs_cache_slot_t **result)
+{
+    for (;;)
+    {
+        int ret = edfs_cache_get(img, block, fill, site, result);
+        if (ret < 0 || !(*result)->busy)
+            return ret;
+
+        pthread_cond_wait(&img->cache->idle, &img->cache->lock);
+    }
+}
+
+/* Waits until @block is not being written back. */
+static void
+edfs_cache_wait_idle(edfs_cache_t *cache, edfs_block_t block)
+{
+    while (cache->slot_of[block] >= 0 &&
+           cache->slots[cache->slot_of[block]].busy)
+        pthread_cond_wait(&cache->idle, &cache->lock);
+}
+
+/* Returns the location of @block within the mapped image. */
+static inline uint8_t *
+edfs_cache_map_block(edfs_image_t *img, edfs_block_t block)
+{
+    if (block == EDFS_BLOCK_INVALID || block >= img->sb.n_blocks)
+        return NULL;
+
+    return img->map + edfs_get_block_offset(&img->sb, block);
+}
+
+/* Returns true if @block currently has a copy in the cache. */
+bool
+edfs_cache_contains(edfs_image_t *img, edfs_block_t block)
+{
+    edfs_cache_t *cache = img->cache;
+
+    if (!cache || block >= img->sb.n_blocks)
+        return false;
+
+    pthread_mutex_lock(&cache->lock);
+    bool cached = cache->slot_of[block] >= 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    return cached;
+}
+
+/* Copies @size bytes at offset @off within @block into @buf. Returns
+ * @size on success, negative error code otherwise.
+ */
+int
+edfs_cache_read(edfs_image_t *img, edfs_block_t block,
+                void *buf, uint32_t off, uint32_t size, edfs_io_site_t site)
+{
+    if (off + size > img->sb.block_size)
+        return -EINVAL;
+
+    if (img->map)
+    {
+        uint8_t *data = edfs_cache_map_block(img, block);
+        if (!data)
+            return -EINVAL;
+
+        memcpy(buf, data + off, size);
+        edfs_stats_io(img, site, false, size);
+        return size;
+    }
+
+    edfs_cache_slot_t *slot;
+    pthread_mutex_lock(&img->cache->lock);
+    int ret = edfs_cache_get(img, block, true, site, &slot);
+    if (ret >= 0)
+        memcpy(buf, slot->data + off, size);
+    pthread_mutex_unlock(&img->cache->lock);
+
+    return ret < 0 ? ret : (int)size;
+}
+
+/* Copies @size bytes from @buf to offset @off within @block. The block
+ * is only read from the image if it is not cached and the write does
+ * not cover it entirely. Returns @size on success.
+ */
+int
+edfs_cache_write(edfs_image_t *img, edfs_block_t block,
+                 const void *buf, uint32_t off, uint32_t size,
+                 edfs_io_site_t site)
+{
+    if (off + size > img->sb.block_size)
+        return -EINVAL;
+
+    if (img->map)
+    {
+        uint8_t *data = edfs_cache_map_block(img, block);
+        if (!data)
+            return -EINVAL;
+
+        memcpy(data + off, buf, size);
+        edfs_stats_io(img, site, true, size);
+        return size;
+    }
+
+    bool full = off == 0 && size == img->sb.block_size;
+
+    edfs_cache_slot_t *slot;
+    pthread_mutex_lock(&img->cache->lock);
+    int ret = edfs_cache_get_idle(img, block, !full, site, &slot);
+    if (ret >= 0)
+    {
+        memcpy(slot->data + off, buf, size);
+        edfs_cache_mark_dirty(img->cache, slot);
+    }
+    pthread_mutex_unlock(&img->cache->lock);
+
+    return ret < 0 ? ret : (int)size;
+}
+
+/* Installs a zero-filled, dirty copy of a newly allocated @block without
+ * reading its (stale) on-disk contents.
+ */
+int
+edfs_cache_zero(edfs_image_t *img, edfs_block_t block, edfs_io_site_t site)
+{
+    if (img->map)
+    {
+        uint8_t *data = edfs_cache_map_block(img, block);
+        if (!data)
+            return -EINVAL;
+
+        memset(data, 0, img->sb.block_size);
+        edfs_stats_io(img, site, true, img->sb.block_size);
+        return 0;
+    }
+
+    edfs_cache_slot_t *slot;
+    pthread_mutex_lock(&img->cache->lock);
+    int ret = edfs_cache_get_idle(img, block, false, site, &slot);
+    if (ret >= 0)
+    {
+        memset(slot->data, 0, img->sb.block_size);
+        edfs_cache_mark_dirty(img->cache, slot);
+    }
+    pthread_mutex_unlock(&img->cache->lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Drops @block from the cache without writing it back, to be called
+ * when the block is released.
+ */
+void
+edfs_cache_forget(edfs_image_t *img, edfs_block_t block)
+{
+    edfs_cache_t *cache = img->cache;
+
+    if (!cache || block >= img->sb.n_blocks)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+
+    /* The block may be written directly afterwards, which an ongoing
+     * writeback of the old contents must not overtake.
+     */
+    edfs_cache_wait_idle(cache, block);
+
+    int32_t idx = cache->slot_of[block];
+    if (idx >= 0)
+    {
+        edfs_cache_mark_clean(cache, &cache->slots[idx]);
+        cache->slots[idx].valid = false;
+        cache->slot_of[block] = -1;
+    }
+    cache->meta[block] = false;
+
+    pthread_mutex_unlock(&cache->lock);
+}
+
+static int
+edfs_cache_slot_cmp(const void *a, const void *b)
+{
+    const edfs_cache_slot_t *x = *(edfs_cache_slot_t * const *)a;
+    const edfs_cache_slot_t *y = *(edfs_cache_slot_t * const *)b;
+
+    return (x->block > y->block) - (x->block < y->block);
+}
+
+/* Writes the @n busy slots in @slots, which hold adjacent blocks, with
+ * a single call. This is done synchronously also in EDFS_IO_URING mode;
+ * it is the writeback thread that takes the latency.
+ */
+static int
+edfs_cache_write_run(edfs_image_t *img, edfs_cache_slot_t **slots, int n)
+{
+    const uint16_t BLK_SIZE = img->sb.block_size;
+    struct iovec iov[EDFS_WRITEBACK_MAX_RUN];
+
+    for (int i = 0; i < n; i++)
+    {
+        iov[i].iov_base = slots[i]->data;
+        iov[i].iov_len = BLK_SIZE;
+    }
+
+    off_t off = edfs_get_block_offset(&img->sb, slots[0]->block);
+    ssize_t ret = edfs_image_pwritev(img, iov, n, off);
+    if (ret < 0)
+    {
+        edfs_stats_io(img, slots[0]->site, true, ret);
+        return -errno;
+    }
+
+    /* The bytes are accounted to the site of each block; a run that
+     * holds blocks of several sites counts as a call for each of them.
+     */
+    ssize_t left = ret;
+    for (int i = 0; i < n; )
+    {
+        int j = i + 1;
+        while (j < n && slots[j]->site == slots[i]->site)
+            j++;
+
+        ssize_t bytes = (ssize_t)(j - i) * BLK_SIZE;
+        if (bytes > left)
+            bytes = left;
+        edfs_stats_io(img, slots[i]->site, true, bytes);
+        left -= bytes;
+        i = j;
+    }
+
+    if (ret != (ssize_t)n * BLK_SIZE)
+        return -EIO;
+
+    return 0;
+}
+
+/* Returns whether a slot is still being written back by a flush that
+ * started before flush generation @gen. Must be called with the cache
+ * lock held.
+ */
+static bool
+edfs_cache_busy_before(edfs_cache_t *cache, uint64_t gen)
+{
+    if (cache->n_busy == 0)
+        return false;
+
+    for (uint32_t i = 0; i < cache->n_slots; i++)
+        if (cache->slots[i].busy && cache->slots[i].busy_gen < gen)
+            return true;
+
+    return false;
+}
+
+/* Writes back all dirty blocks that are not pinned, sorted by block
+ * number and merged into runs of adjacent blocks. Blocks that an earlier
+ * call is writing back at the same time are waited for, so all blocks
+ * dirty on entry have been written when this returns. Blocks that later
+ * calls take up are not. Returns 0 on
+ * success, or the first error encountered; remaining blocks are still
+ * attempted and failed ones stay dirty.
+ */
+int
+edfs_cache_flush(edfs_image_t *img)
+{
+    edfs_cache_t *cache = img->cache;
+    int res = 0;
+
+    if (!cache)
+        return 0;
+
+    edfs_cache_slot_t *order[EDFS_CACHE_N_SLOTS];
+    bool written[EDFS_CACHE_N_SLOTS];
+    uint32_t n = 0;
+
+    pthread_mutex_lock(&cache->lock);
+    const uint64_t gen = ++cache->flush_gen;
+    for (uint32_t i = 0; i < cache->n_slots; i++)
+    {
+        edfs_cache_slot_t *slot = &cache->slots[i];
+        if (!slot->valid || !slot->dirty || slot->busy ||
+            cache->meta[slot->block])
+            continue;
+
+        slot->busy = true;
+        slot->busy_gen = gen;
+        order[n++] = slot;
+    }
+    cache->n_busy += n;
+    pthread_mutex_unlock(&cache->lock);
+
+    qsort(order, n, sizeof(order[0]), edfs_cache_slot_cmp);
+
+    for (uint32_t i = 0; i < n; )
+    {
+        uint32_t run = 1;
+        while (i + run < n && run < EDFS_WRITEBACK_MAX_RUN &&
+               order[i + run]->block == order[i]->block + run)
+            run++;
+
+        int ret = edfs_cache_write_run(img, order + i, run);
+        if (ret < 0 && res == 0)
+            res = ret;
+
+        for (uint32_t j = i; j < i + run; j++)
+            written[j] = ret == 0;
+        i += run;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        order[i]->busy = false;
+        if (written[i])
+            edfs_cache_mark_clean(cache, order[i]);
+    }
+    cache->n_busy -= n;
+    pthread_cond_broadcast(&cache->idle);
+
+    while (edfs_cache_busy_before(cache, gen))
+        pthread_cond_wait(&cache->idle, &cache->lock);
+    pthread_mutex_unlock(&cache->lock);
+
+    return res;
+}
+
+static void *
+edfs_cache_writeback_main(void *arg)
+{
+    edfs_image_t *img = (edfs_image_t *)arg;
+    edfs_cache_t *cache = img->cache;
+    const uint64_t AGE = (uint64_t)EDFS_WRITEBACK_AGE_MS * 1000000;
+
+    pthread_mutex_lock(&cache->lock);
+    while (!cache->wb_stop)
+    {
+        uint64_t now = edfs_stats_now();
+        uint64_t oldest = now;
+
+        for (uint32_t i = 0; i < cache->n_slots; i++)
+        {
+            edfs_cache_slot_t *slot = &cache->slots[i];
+            if (slot->valid && slot->dirty && !slot->busy &&
+                !cache->meta[slot->block] && slot->dirtied < oldest)
+                oldest = slot->dirtied;
+        }
+
+        if (!cache->wb_kick && now - oldest < AGE)
+        {
+            uint64_t deadline = oldest + AGE;
+            struct timespec ts = { deadline / 1000000000,
+                                   deadline % 1000000000 };
+
+            pthread_cond_timedwait(&cache->wb_wakeup, &cache->lock, &ts);
+            continue;
+        }
+
+        cache->wb_kick = false;
+        pthread_mutex_unlock(&cache->lock);
+        int ret = edfs_cache_flush(img);
+        pthread_mutex_lock(&cache->lock);
+
+        /* Blocks that failed stay dirty, they are retried a period
+         * later rather than right away.
+         */
+        if (ret < 0 && !cache->wb_stop)
+        {
+            uint64_t deadline = edfs_stats_now() + AGE;
+            struct timespec ts = { deadline / 1000000000,
+                                   deadline % 1000000000 };
+
+            pthread_cond_timedwait(&cache->wb_wakeup, &cache->lock, &ts);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return NULL;
+}
+
+/* Starts the thread writing back dirty blocks in the background. It
+ * must be started after a daemonizing fork(), as threads do not survive
+ * one. Has no effect if the image has no cache.
+ */
+bool
+edfs_cache_writeback_start(edfs_image_t *img)
+{
+    edfs_cache_t *cache = img->cache;
+
+    if (!cache || cache->wb_running)
+        return true;
+
+    cache->wb_stop = false;
+    cache->wb_kick = cache->n_dirty >= cache->wb_threshold;
+    if (pthread_create(&cache->wb_thread, NULL, edfs_cache_writeback_main,
+                       img) != 0)
+        return false;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->wb_running = true;
+    pthread_mutex_unlock(&cache->lock);
+
+    return true;
+}
+
+/* Stops the writeback thread, waiting for a writeback in progress.
+ * Dirty blocks are left in the cache.
+ */
+void
+edfs_cache_writeback_stop(edfs_image_t *img)
+{
+    edfs_cache_t *cache = img->cache;
+
+    if (!cache || !cache->wb_running)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->wb_stop = true;
+    cache->wb_running = false;
+    pthread_cond_signal(&cache->wb_wakeup);
+    pthread_mutex_unlock(&cache->lock);
+
+    pthread_join(cache->wb_thread, NULL);
+}
+
+/* Marks @block as metadata, to be called before it is modified. Has no
+ * effect if the image has no journal.
+ */
+void
+edfs_cache_set_meta(edfs_image_t *img, edfs_block_t block)
+{
+    edfs_cache_t *cache = img->cache;
+
+    if (!cache || !img->journal || block >= img->sb.n_blocks)
+        return;
+
+    pthread_mutex_lock(&cache->lock);
+    edfs_cache_wait_idle(cache, block);
+    cache->meta[block] = true;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Stores up to @max pinned metadata blocks in @blocks, in slot order,
+ * and the sequence number of their last modification in @seqs. Returns
+ * the number stored.
+ */
+int
+edfs_cache_get_meta(edfs_image_t *img, edfs_block_t *blocks, uint64_t *seqs,
+                    int max)
+{
+    edfs_cache_t *cache = img->cache;
+    int n = 0;
+
+    if (!cache)
+        return 0;
+
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i < cache->n_slots && n < max; i++)
+        if (edfs_cache_pinned(cache, &cache->slots[i]))
+        {
+            blocks[n] = cache->slots[i].block;
+            seqs[n++] = cache->slots[i].seq;
+        }
+    pthread_mutex_unlock(&cache->lock);
+
+    return n;
+}
+
+/* Returns the number of pinned metadata blocks. */
+uint32_t
+edfs_cache_n_meta(edfs_image_t *img)
+{
+    edfs_cache_t *cache = img->cache;
+    uint32_t n = 0;
+
+    if (!cache)
+        return 0;
+
+    pthread_mutex_lock(&cache->lock);
+    for (uint32_t i = 0; i < cache->n_slots; i++)
+        if (edfs_cache_pinned(cache, &cache->slots[i]))
+            n++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return n;
+}
+
+/* Marks the copy of metadata @block clean and unpins it, once the
+ * journal has written its contents in place. A block modified after
+ * edfs_cache_get_meta() returned @seq for it stays pinned, those
+ * changes belong to the next transaction. Returns whether it was
+ * unpinned.
+ */
+bool
+edfs_cache_clean_meta(edfs_image_t *img, edfs_block_t block, uint64_t seq)
+{
+    edfs_cache_t *cache = img->cache;
+    bool cleaned = true;
+
+    if (!cache || block >= img->sb.n_blocks)
+        return false;
+
+    pthread_mutex_lock(&cache->lock);
+    int32_t idx = cache->slot_of[block];
+    if (idx >= 0 && cache->slots[idx].seq != seq)
+        cleaned = false;
+    else
+    {
+        if (idx >= 0)
+            edfs_cache_mark_clean(cache, &cache->slots[idx]);
+        cache->meta[block] = false;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return cleaned;
+}
@@ -6,14 +6,78 @@
 #include "edfs-common.h"
 
 #include <stdio.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* Maximum number of physical blocks resolved by a single
+ * edfs_inode_map_blocks() call in the data routines.
+ */
+#define EDFS_MAP_BATCH 64
+
+/* Decoded copy of the indirect block of an inode. Entries are matched
+ * on both inumber and indirect block number, so a map left behind by a
+ * released inode is never used for a new one.
+ */
+struct edfs_blkmap
+{
+    edfs_inumber_t inumber;     /* 0 if the entry is unused */
+    edfs_block_t indirect;
+    uint32_t last_use;
+    edfs_block_t blocks[EDFS_MAX_BLOCK_SIZE / sizeof(edfs_block_t)];
+};
+
+/* Extent hold of a thread, see edfs_extent_hold_set(). */
+struct edfs_extent_hold
+{
+    edfs_image_t *img;
+    edfs_extent_hold_t *next;
+    edfs_inumber_t inumber;
+    uint64_t epoch;             /* img->hold_epoch when it was set */
+    bool active;
+};
+
+/* Data blocks freed from an inode while a hold on it was set. */
+struct edfs_freed
+{
+    edfs_freed_t *next;
+    edfs_inumber_t inumber;
+    uint64_t epoch;             /* img->hold_epoch after the free */
+    uint32_t n_blocks;
+    edfs_block_t blocks[];
+};
+
+static uint32_t edfs_bitmap_find_clear(const uint8_t *bitmap,
+                                       const uint8_t *reserved,
+                                       uint32_t start, uint32_t end);
+static int edfs_bitmap_alloc(edfs_image_t *img, uint32_t want,
+                             uint32_t extra, edfs_block_t goal,
+                             edfs_block_t *block);
+static void edfs_bitmap_claim(edfs_image_t *img, edfs_block_t start,
+                              uint32_t n);
+static void edfs_bitmap_unreserve(edfs_image_t *img, edfs_block_t start,
+                                  uint32_t n);
+static void edfs_bitmap_release_blocks(edfs_image_t *img,
+                                       edfs_inumber_t inumber,
+                                       const edfs_block_t *blocks,
+                                       uint32_t n);
+static const edfs_data_ops_t *edfs_data_ops_get(uint16_t block_size);
+
 /*
  * EdFS image management
  */
@@ -24,9 +88,68 @@ edfs_image_close(edfs_image_t *img)
   if (!img)
     return;
 
+  /* Commits outstanding metadata, leaving only data blocks to flush. */
+  if (img->journal)
+    {
+      edfs_journal_commit(img);
+      edfs_journal_free(img);
+    }
+
+  if (img->cache)
+    {
+      edfs_cache_flush(img);
+      edfs_cache_free(img);
+    }
+
+  if (img->bitmap)
+    {
+      edfs_bitmap_flush(img);
+      if (!img->map)
+        free(img->bitmap);
+    }
+  free(img->bitmap_reserved);
+
+  while (img->freed)
+    {
+      edfs_freed_t *next = img->freed->next;
+      free(img->freed);
+      img->freed = next;
+    }
+
+  if (!img->map)
+    free(img->inodes);
+  free(img->inode_bitmap);
+  free(img->blkmaps);
+  edfs_dcache_free(img);
+  edfs_attr_free(img);
+  edfs_tail_free(img);
+#ifdef EDFS_WITH_IO_URING
+  edfs_uring_free(img);
+#endif
+
+  if (img->inode_rwlocks)
+    {
+      for (uint32_t i = 0; i < img->sb.inode_table_n_inodes; i++)
+        pthread_rwlock_destroy(&img->inode_rwlocks[i]);
+      free(img->inode_rwlocks);
+    }
+
+  pthread_mutex_destroy(&img->alloc_lock);
+  pthread_mutex_destroy(&img->inode_lock);
+  pthread_mutex_destroy(&img->blkmap_lock);
+  pthread_mutex_destroy(&img->hold_lock);
+  pthread_rwlock_destroy(&img->ns_lock);
+
+  if (img->map)
+    {
+      msync(img->map, img->map_size, MS_SYNC);
+      munmap(img->map, img->map_size);
+    }
+
   if (img->fd >= 0)
     close(img->fd);
 
+  edfs_stats_free(img);
   free(img);
 }
 
@@ -34,440 +157,3203 @@ edfs_image_close(edfs_image_t *img)
 static bool
 edfs_read_super(edfs_image_t *img)
 {
-  if (pread(img->fd, &img->sb, sizeof(edfs_super_block_t), EDFS_SUPER_BLOCK_OFFSET) < 0)
+  ssize_t ret = pread(img->fd, &img->sb, sizeof(edfs_super_block_t),
+                      EDFS_SUPER_BLOCK_OFFSET);
+  edfs_stats_io(img, EDFS_SITE_SUPER, false, ret);
+  if (ret < 0)
     {
       fprintf(stderr, "error: file '%s': %s\n",
               img->filename, strerror(errno));
       return false;
     }
 
-  if (img->sb.magic != EDFS_MAGIC)
+  if (img->sb.magic != EDFS_MAGIC)
+    {
+      fprintf(stderr, "error: file '%s': EdFS magic number mismatch.\n",
+              img->filename);
+      return false;
+    }
+
+  /* The data routines exist for each power of two in this range. */
+  if (img->sb.block_size < EDFS_MIN_BLOCK_SIZE ||
+      img->sb.block_size > EDFS_MAX_BLOCK_SIZE ||
+      (img->sb.block_size & (img->sb.block_size - 1)) != 0)
+    {
+      fprintf(stderr, "error: file '%s': unsupported block size %u.\n",
+              img->filename, img->sb.block_size);
+      return false;
+    }
+
+  /* Simple sanity check of size of file system image. */
+  struct stat buf;
+
+  if (fstat(img->fd, &buf) < 0)
+    {
+      fprintf(stderr, "error: file '%s': stat failed? (%s)\n",
+              img->filename, strerror(errno));
+      return false;
+    }
+
+  if (buf.st_size < edfs_get_size(&img->sb))
+    {
+      fprintf(stderr, "error: file '%s': file system size larger than image size.\n",
+              img->filename);
+      return false;
+    }
+
+  if ((uint64_t)img->sb.inode_table_n_inodes * sizeof(edfs_disk_inode_t) >
+      img->sb.inode_table_size)
+    {
+      fprintf(stderr, "error: file '%s': inode table too small for number of inodes.\n",
+              img->filename);
+      return false;
+    }
+
+  if ((uint64_t)img->sb.bitmap_size * 8 < img->sb.n_blocks)
+    {
+      fprintf(stderr, "error: file '%s': bitmap too small for number of blocks.\n",
+              img->filename);
+      return false;
+    }
+
+  if (img->sb.journal_magic != EDFS_JOURNAL_SB_MAGIC)
+    {
+      img->sb.journal_start = 0;
+      img->sb.journal_n_blocks = 0;
+    }
+  else if (img->sb.journal_n_blocks > 0 &&
+           (img->sb.journal_start < edfs_get_data_block_start(&img->sb) ||
+            (uint32_t)img->sb.journal_start + img->sb.journal_n_blocks > img->sb.n_blocks))
+    {
+      fprintf(stderr, "error: file '%s': journal lies outside the data area.\n",
+              img->filename);
+      return false;
+    }
+
+  /* FIXME: implement more sanity checks? */
+
+  return true;
+}
+
+/* Map the whole file system into memory for EDFS_IO_MMAP mode. */
+static bool
+edfs_map_image(edfs_image_t *img)
+{
+  img->map_size = edfs_get_size(&img->sb);
+
+  /* The bitmap is read a 64-bit word at a time, also in the mapping. */
+  if (img->sb.bitmap_start + ((img->sb.bitmap_size + 7) & ~(size_t)7) >
+      img->map_size)
+    {
+      fprintf(stderr, "error: file '%s': bitmap layout does not allow mmap mode.\n",
+              img->filename);
+      return false;
+    }
+
+  void *map = mmap(NULL, img->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   img->fd, 0);
+  if (map == MAP_FAILED)
+    {
+      fprintf(stderr, "error: file '%s': mmap failed (%s)\n",
+              img->filename, strerror(errno));
+      return false;
+    }
+
+  img->map = map;
+
+  return true;
+}
+
+/* Load the block allocation bitmap into memory. When the image is
+ * mapped, the bitmap in the mapping is used directly.
+ */
+static bool
+edfs_read_bitmap(edfs_image_t *img)
+{
+  img->bitmap_dirty_lo = UINT32_MAX;
+  img->bitmap_dirty_hi = 0;
+  img->bitmap_hint = edfs_get_data_block_start(&img->sb);
+
+  /* Round up to whole 64-bit words, the padding stays zero. */
+  size_t alloc_size = (img->sb.bitmap_size + 7) & ~(size_t)7;
+
+  img->bitmap_reserved = calloc(1, alloc_size);
+  if (!img->bitmap_reserved)
+    {
+      fprintf(stderr, "error: file '%s': out of memory loading bitmap.\n",
+              img->filename);
+      return false;
+    }
+
+  if (img->map)
+    {
+      img->bitmap = img->map + img->sb.bitmap_start;
+      return true;
+    }
+
+  img->bitmap = calloc(1, alloc_size);
+  if (!img->bitmap)
+    {
+      fprintf(stderr, "error: file '%s': out of memory loading bitmap.\n",
+              img->filename);
+      return false;
+    }
+
+  ssize_t ret = pread(img->fd, img->bitmap, img->sb.bitmap_size,
+                      img->sb.bitmap_start);
+  edfs_stats_io(img, EDFS_SITE_BITMAP, false, ret);
+  if (ret != img->sb.bitmap_size)
+    {
+      fprintf(stderr, "error: file '%s': could not read bitmap.\n",
+              img->filename);
+      return false;
+    }
+
+  return true;
+}
+
+static inline void
+edfs_inode_bitmap_update(edfs_image_t *img, edfs_inumber_t inumber,
+                         const edfs_disk_inode_t *inode)
+{
+  if (inode->type == EDFS_INODE_TYPE_FREE)
+    img->inode_bitmap[inumber / 8] &= ~((uint8_t)1 << (inumber % 8));
+  else
+    img->inode_bitmap[inumber / 8] |= (uint8_t)1 << (inumber % 8);
+}
+
+/* Load the inode table into memory and derive the free inode bitmap. */
+static bool
+edfs_read_inode_table(edfs_image_t *img)
+{
+  const uint32_t n_inodes = img->sb.inode_table_n_inodes;
+  const size_t size = n_inodes * sizeof(edfs_disk_inode_t);
+
+  if (img->map)
+    img->inodes = (edfs_disk_inode_t *)(img->map + img->sb.inode_table_start);
+  else
+    img->inodes = malloc(size);
+  img->inode_bitmap = calloc(1, ((n_inodes + 63) / 64) * 8);
+  if (!img->inodes || !img->inode_bitmap)
+    {
+      fprintf(stderr, "error: file '%s': out of memory loading inode table.\n",
+              img->filename);
+      return false;
+    }
+
+  if (!img->map)
+    {
+      ssize_t ret = pread(img->fd, img->inodes, size,
+                          img->sb.inode_table_start);
+      edfs_stats_io(img, EDFS_SITE_INODE, false, ret);
+      if (ret != (ssize_t)size)
+        {
+          fprintf(stderr, "error: file '%s': could not read inode table.\n",
+                  img->filename);
+          return false;
+        }
+    }
+
+  for (edfs_inumber_t i = 0; i < n_inodes; i++)
+    edfs_inode_bitmap_update(img, i, &img->inodes[i]);
+
+  /* Inode 0 is never handed out, it marks empty directory entries. */
+  img->inode_bitmap[0] |= 1;
+  img->inode_hint = 1;
+
+  return true;
+}
+
+static bool
+edfs_init_inode_locks(edfs_image_t *img)
+{
+  const uint32_t n_inodes = img->sb.inode_table_n_inodes;
+
+  img->inode_rwlocks = malloc(n_inodes * sizeof(pthread_rwlock_t));
+  if (!img->inode_rwlocks)
+    return false;
+
+  for (uint32_t i = 0; i < n_inodes; i++)
+    pthread_rwlock_init(&img->inode_rwlocks[i], NULL);
+
+  return true;
+}
+
+edfs_image_t *
+edfs_image_open(const char *filename, bool read_super, edfs_io_mode_t io_mode)
+{
+  edfs_image_t *img = calloc(1, sizeof(edfs_image_t));
+  if (!img)
+    return NULL;
+
+  pthread_mutex_init(&img->alloc_lock, NULL);
+  pthread_mutex_init(&img->inode_lock, NULL);
+  pthread_mutex_init(&img->blkmap_lock, NULL);
+  pthread_mutex_init(&img->hold_lock, NULL);
+  pthread_rwlock_init(&img->ns_lock, NULL);
+
+  if (!edfs_stats_init(img))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  img->filename = filename;
+  img->io_mode = io_mode;
+  img->fd = open(img->filename, O_RDWR);
+  if (img->fd < 0)
+    {
+      fprintf(stderr, "error: could not open file '%s': %s\n",
+              img->filename, strerror(errno));
+      edfs_image_close(img);
+      return NULL;
+    }
+
+#ifndef EDFS_WITH_IO_URING
+  if (io_mode == EDFS_IO_URING)
+    {
+      fprintf(stderr, "error: io_uring support was not enabled at build time.\n");
+      edfs_image_close(img);
+      return NULL;
+    }
+#else
+  if (io_mode == EDFS_IO_URING && !edfs_uring_init(img))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+#endif
+
+  if (io_mode == EDFS_IO_MMAP && !read_super)
+    {
+      fprintf(stderr, "error: file '%s': mmap mode requires the super block.\n",
+              img->filename);
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  /* Load super block into memory. A committed transaction left in the
+   * journal is applied before any metadata is loaded.
+   */
+  if (read_super && (!edfs_read_super(img) || !edfs_journal_replay(img)))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  if (io_mode == EDFS_IO_MMAP && !edfs_map_image(img))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  if (read_super && (!edfs_read_bitmap(img) || !edfs_read_inode_table(img)))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  /* A mapped image is accessed directly, without block cache. */
+  if (read_super && !img->map && !edfs_cache_init(img))
+    {
+      fprintf(stderr, "error: file '%s': out of memory allocating block cache.\n",
+              img->filename);
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  if (read_super)
+    {
+      img->data_ops = edfs_data_ops_get(img->sb.block_size);
+      img->blkmaps = calloc(EDFS_BLKMAP_N_ENTRIES, sizeof(edfs_blkmap_t));
+      if (!img->blkmaps || !edfs_dcache_init(img) || !edfs_attr_init(img) ||
+          !edfs_tail_init(img) || !edfs_init_inode_locks(img))
+        {
+          edfs_image_close(img);
+          return NULL;
+        }
+    }
+
+  /* A mapped image is modified in place, the journal is only used
+   * together with the block cache.
+   */
+  if (read_super && img->sb.journal_n_blocks > 0 && !img->map &&
+      !edfs_journal_init(img))
+    {
+      edfs_image_close(img);
+      return NULL;
+    }
+
+  return img;
+}
+
+/* Writes back all cached modifications and asks the OS to commit them
+ * to stable storage.
+ */
+int
+edfs_image_sync(edfs_image_t *img, bool datasync)
+{
+  int res = img->journal ? edfs_journal_commit(img) : 0;
+
+  int ret = edfs_cache_flush(img);
+  if (ret < 0 && res == 0)
+    res = ret;
+
+  ret = edfs_bitmap_flush(img);
+  if (ret < 0 && res == 0)
+    res = ret;
+
+  if (img->map)
+    {
+      if (msync(img->map, img->map_size, MS_SYNC) < 0 && res == 0)
+        res = -errno;
+    }
+  else if ((datasync ? fdatasync(img->fd) : fsync(img->fd)) < 0 && res == 0)
+    res = -errno;
+
+  return res;
+}
+
+void
+edfs_namespace_lock(edfs_image_t *img, bool write)
+{
+  if (write)
+    pthread_rwlock_wrlock(&img->ns_lock);
+  else
+    pthread_rwlock_rdlock(&img->ns_lock);
+}
+
+void
+edfs_namespace_unlock(edfs_image_t *img)
+{
+  pthread_rwlock_unlock(&img->ns_lock);
+}
+
+/* Checks that [off, off + size) lies within the mapping. */
+static inline bool
+edfs_image_map_range_ok(edfs_image_t *img, size_t size, off_t off)
+{
+  if (off < 0 || (size_t)off > img->map_size || size > img->map_size - off)
+    {
+      errno = EINVAL;
+      return false;
+    }
+
+  return true;
+}
+
+ssize_t
+edfs_image_pread(edfs_image_t *img, void *buf, size_t size, off_t off)
+{
+  if (img->map)
+    {
+      if (!edfs_image_map_range_ok(img, size, off))
+        return -1;
+
+      memcpy(buf, img->map + off, size);
+      return size;
+    }
+
+  return pread(img->fd, buf, size, off);
+}
+
+ssize_t
+edfs_image_pwrite(edfs_image_t *img, const void *buf, size_t size, off_t off)
+{
+  if (img->map)
+    {
+      if (!edfs_image_map_range_ok(img, size, off))
+        return -1;
+
+      memcpy(img->map + off, buf, size);
+      return size;
+    }
+
+  return pwrite(img->fd, buf, size, off);
+}
+
+ssize_t
+edfs_image_preadv(edfs_image_t *img, const struct iovec *iov, int n_iov,
+                  off_t off)
+{
+  if (img->map)
+    {
+      ssize_t total = 0;
+      for (int i = 0; i < n_iov; i++)
+        {
+          if (edfs_image_pread(img, iov[i].iov_base, iov[i].iov_len,
+                               off + total) < 0)
+            return -1;
+          total += iov[i].iov_len;
+        }
+
+      return total;
+    }
+
+  return preadv(img->fd, iov, n_iov, off);
+}
+
+ssize_t
+edfs_image_pwritev(edfs_image_t *img, const struct iovec *iov, int n_iov,
+                   off_t off)
+{
+  if (img->map)
+    {
+      ssize_t total = 0;
+      for (int i = 0; i < n_iov; i++)
+        {
+          if (edfs_image_pwrite(img, iov[i].iov_base, iov[i].iov_len,
+                                off + total) < 0)
+            return -1;
+          total += iov[i].iov_len;
+        }
+
+      return total;
+    }
+
+  return pwritev(img->fd, iov, n_iov, off);
+}
+
+/* Performs the @n_reqs requests in @reqs, in no particular order. With
+ * io_uring they are submitted as one batch, otherwise one vectored
+ * syscall is made per request. Returns 0 if all requests completed in
+ * full, the first error otherwise.
+ */
+int
+edfs_image_submit(edfs_image_t *img, edfs_io_req_t *reqs, int n_reqs)
+{
+  int res = 0;
+
+#ifdef EDFS_WITH_IO_URING
+  if (img->uring)
+    edfs_uring_submit(img, reqs, n_reqs);
+  else
+#endif
+  for (int i = 0; i < n_reqs; i++)
+    {
+      edfs_io_req_t *req = &reqs[i];
+
+      if (req->write)
+        req->res = edfs_image_pwritev(img, req->iov, req->n_iov, req->off);
+      else
+        req->res = edfs_image_preadv(img, req->iov, req->n_iov, req->off);
+      if (req->res < 0)
+        req->res = -errno;
+    }
+
+  for (int i = 0; i < n_reqs && res == 0; i++)
+    {
+      size_t expected = 0;
+      for (int j = 0; j < reqs[i].n_iov; j++)
+        expected += reqs[i].iov[j].iov_len;
+
+      if (reqs[i].res < 0)
+        res = reqs[i].res;
+      else if ((size_t)reqs[i].res != expected)
+        res = -EIO;
+    }
+
+  return res;
+}
+
+void
+edfs_image_prefetch(edfs_image_t *img, off_t off, size_t size)
+{
+  if (img->map)
+    {
+      if (!edfs_image_map_range_ok(img, size, off))
+        return;
+
+      /* madvise wants a page aligned address. */
+      size_t page = sysconf(_SC_PAGESIZE);
+      size_t start = (size_t)off & ~(page - 1);
+      posix_madvise(img->map + start, size + (off - start),
+                    POSIX_MADV_WILLNEED);
+      return;
+    }
+
+  posix_fadvise(img->fd, off, size, POSIX_FADV_WILLNEED);
+}
+
+/*
+ * Inode-related routine helper functions
+ */
+
+/* Returns the block map of @inode, decoding its indirect block on first
+ * use. *map is NULL if the inode has no indirect block. Must be called
+ * with blkmap_lock held.
+ */
+static int edfs_inode_get_map(edfs_image_t *img, edfs_inode_t *inode,
+                              edfs_blkmap_t **map)
+{
+    *map = NULL;
+    if (inode->inode.indirect == EDFS_BLOCK_INVALID)
+        return 0;
+
+    edfs_blkmap_t *victim = &img->blkmaps[0];
+    for (int i = 0; i < EDFS_BLKMAP_N_ENTRIES; i++)
+    {
+        edfs_blkmap_t *m = &img->blkmaps[i];
+        if (m->inumber == inode->inumber &&
+            m->indirect == inode->inode.indirect)
+        {
+            m->last_use = ++img->blkmap_clock;
+            *map = m;
+            return 0;
+        }
+
+        if (m->last_use < victim->last_use)
+            victim = m;
+    }
+
+    victim->inumber = 0;
+    int ret = edfs_cache_read(img, inode->inode.indirect, victim->blocks,
+                              0, img->sb.block_size, EDFS_SITE_INDIRECT);
+    if (ret < 0)
+        return ret;
+
+    victim->inumber = inode->inumber;
+    victim->indirect = inode->inode.indirect;
+    victim->last_use = ++img->blkmap_clock;
+    *map = victim;
+
+    return 0;
+}
+
+int
+edfs_inode_map_blocks(edfs_image_t *img, edfs_inode_t *inode,
+                      uint32_t first, uint32_t n, edfs_block_t *blocks)
+{
+    const uint32_t n_indirect = edfs_get_n_blocks_per_indirect_block(&img->sb);
+
+    edfs_blkmap_t *map = NULL;
+    bool locked = first + n > EDFS_INODE_N_DIRECT_BLOCKS;
+    if (locked)
+    {
+        pthread_mutex_lock(&img->blkmap_lock);
+        int ret = edfs_inode_get_map(img, inode, &map);
+        if (ret < 0)
+        {
+            pthread_mutex_unlock(&img->blkmap_lock);
+            return ret;
+        }
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint32_t id = first + i;
+
+        if (id < EDFS_INODE_N_DIRECT_BLOCKS)
+            blocks[i] = inode->inode.direct[id];
+        else if (map && id - EDFS_INODE_N_DIRECT_BLOCKS < n_indirect)
+            blocks[i] = map->blocks[id - EDFS_INODE_N_DIRECT_BLOCKS];
+        else
+            blocks[i] = EDFS_BLOCK_INVALID;
+    }
+
+    if (locked)
+        pthread_mutex_unlock(&img->blkmap_lock);
+
+    return 0;
+}
+
+/* Drops the decoded block map of @inumber, to be called when its
+ * indirect block is released or rewritten.
+ */
+void
+edfs_inode_forget_map(edfs_image_t *img, edfs_inumber_t inumber)
+{
+    edfs_attr_invalidate(img, inumber);
+
+    if (!img->blkmaps)
+        return;
+
+    pthread_mutex_lock(&img->blkmap_lock);
+    for (int i = 0; i < EDFS_BLKMAP_N_ENTRIES; i++)
+        if (img->blkmaps[i].inumber == inumber)
+            img->blkmaps[i].inumber = 0;
+    pthread_mutex_unlock(&img->blkmap_lock);
+}
+
+int
+edfs_inode_count_blocks(edfs_image_t *img, edfs_inode_t *inode)
+{
+    const uint32_t n_indirect = edfs_get_n_blocks_per_indirect_block(&img->sb);
+    int n = 0;
+
+    /* An inline file only takes part of a shared tail block. */
+    if (edfs_disk_inode_is_inline(&inode->inode))
+        return 0;
+
+    for (int i = 0; i < EDFS_INODE_N_DIRECT_BLOCKS; i++)
+        n += inode->inode.direct[i] != EDFS_BLOCK_INVALID;
+
+    if (inode->inode.indirect == EDFS_BLOCK_INVALID)
+        return n;
+
+    edfs_blkmap_t *map;
+    pthread_mutex_lock(&img->blkmap_lock);
+    int ret = edfs_inode_get_map(img, inode, &map);
+    if (ret == 0)
+        for (uint32_t i = 0; i < n_indirect; i++)
+            n += map->blocks[i] != EDFS_BLOCK_INVALID;
+    pthread_mutex_unlock(&img->blkmap_lock);
+
+    return ret < 0 ? ret : n + 1;
+}
+
+
+/* Allocates a zero-filled indirect block for @inode if it has none
+ * yet. The caller is responsible for writing the inode.
+ */
+static int edfs_inode_alloc_indirect(edfs_image_t *img, edfs_inode_t *inode)
+{
+    if (inode->inode.indirect != EDFS_BLOCK_INVALID)
+        return 0;
+
+    edfs_block_t block;
+    int ret = edfs_get_new_block(img, &block);
+    if (ret < 0)
+        return ret;
+
+    edfs_cache_set_meta(img, block);
+    ret = edfs_cache_zero(img, block, EDFS_SITE_INDIRECT);
+    if (ret < 0) {
+        edfs_bitmap_clear(img, block);
+        return ret;
+    }
+
+    inode->inode.indirect = block;
+    edfs_inode_forget_map(img, inode->inumber);
+
+    return 0;
+}
+
+/* Records that blocks [id, id + n) of @inode are backed by the physical
+ * run starting at @block. The range must lie entirely within either the
+ * direct or the indirect blocks.
+ */
+static int edfs_inode_set_blocks(edfs_image_t *img, edfs_inode_t *inode,
+                                 uint32_t id, uint32_t n, edfs_block_t block)
+{
+    if (id < EDFS_INODE_N_DIRECT_BLOCKS) {
+        for (uint32_t i = 0; i < n; i++)
+            inode->inode.direct[id + i] = block + i;
+        return 0;
+    }
+
+    uint32_t idx = id - EDFS_INODE_N_DIRECT_BLOCKS;
+    edfs_block_t entries[EDFS_MAP_BATCH];
+    for (uint32_t i = 0; i < n; i++)
+        entries[i] = block + i;
+
+    edfs_cache_set_meta(img, inode->inode.indirect);
+    int ret = edfs_cache_write(img, inode->inode.indirect, entries,
+                               idx * sizeof(edfs_block_t),
+                               n * sizeof(edfs_block_t), EDFS_SITE_INDIRECT);
+    if (ret < 0)
+        return ret;
+
+    /* Keep the decoded copy in sync with the indirect block. */
+    edfs_blkmap_t *map;
+    pthread_mutex_lock(&img->blkmap_lock);
+    if (edfs_inode_get_map(img, inode, &map) == 0 && map)
+        memcpy(&map->blocks[idx], entries, n * sizeof(edfs_block_t));
+    pthread_mutex_unlock(&img->blkmap_lock);
+
+    edfs_attr_invalidate(img, inode->inumber);
+
+    return 0;
+}
+
+/* Allocates up to @want contiguous blocks, preferably starting at @goal.
+ * If the preallocation window @pa continues at @goal, the blocks are
+ * taken from it. Otherwise the window is dropped and a new run is
+ * allocated, of which the blocks beyond @want become the new window.
+ * Returns the number of blocks allocated, starting at *block.
+ *
+ * The window is only reserved in memory. It is never set in the bitmap
+ * that is written out, so a window that is not released does not leak
+ * blocks on the image.
+ */
+static int edfs_inode_alloc_run(edfs_image_t *img, edfs_prealloc_t *pa,
+                                edfs_block_t goal, uint32_t want,
+                                edfs_block_t *block)
+{
+    if (pa && pa->n_blocks > 0 &&
+            goal != EDFS_BLOCK_INVALID && goal != pa->start)
+        edfs_prealloc_release(img, pa);
+
+    if (pa && pa->n_blocks > 0) {
+        uint32_t got = want < pa->n_blocks ? want : pa->n_blocks;
+
+        edfs_bitmap_claim(img, pa->start, got);
+
+        *block = pa->start;
+        pa->start += got;
+        pa->n_blocks -= got;
+
+        return got;
+    }
+
+    uint32_t extra = pa ? EDFS_PREALLOC_N_BLOCKS : 0;
+    int ret = edfs_bitmap_alloc(img, want, extra, goal, block);
+    if (ret <= 0 || (uint32_t)ret <= want)
+        return ret;
+
+    pa->start = *block + want;
+    pa->n_blocks = ret - want;
+
+    return want;
+}
+
+/* Allocates the holes among the @n blocks of @inode starting at block
+ * @first, whose current mapping is given in @blocks (at most
+ * EDFS_MAP_BATCH). Each run of missing blocks is placed right after the
+ * block preceding it in the file when possible, and is backed by as few
+ * physically contiguous runs as the bitmap allows. @fresh[i] is set for
+ * blocks allocated here, which still contain stale data. *dirty is set
+ * if the inode itself was modified and has to be written.
+ */
+static int edfs_inode_fill_holes(edfs_image_t *img, edfs_inode_t *inode,
+                                 uint32_t first, uint32_t n,
+                                 edfs_block_t *blocks, bool *fresh,
+                                 bool *dirty, edfs_prealloc_t *pa)
+{
+    const uint32_t n_indirect = edfs_get_n_blocks_per_indirect_block(&img->sb);
+
+    for (uint32_t i = 0; i < n; )
+    {
+        fresh[i] = false;
+        if (blocks[i] != EDFS_BLOCK_INVALID) {
+            i++;
+            continue;
+        }
+
+        uint32_t id = first + i;
+        if (id >= EDFS_INODE_N_DIRECT_BLOCKS + n_indirect)
+            return -EFBIG;
+
+        /* Length of the hole, not crossing the direct/indirect border. */
+        uint32_t limit = id < EDFS_INODE_N_DIRECT_BLOCKS ?
+            EDFS_INODE_N_DIRECT_BLOCKS - id : n;
+        uint32_t want = 1;
+        while (i + want < n && want < limit &&
+               blocks[i + want] == EDFS_BLOCK_INVALID &&
+               id + want < EDFS_INODE_N_DIRECT_BLOCKS + n_indirect)
+            want++;
+
+        int ret;
+        if (id >= EDFS_INODE_N_DIRECT_BLOCKS &&
+                inode->inode.indirect == EDFS_BLOCK_INVALID) {
+            ret = edfs_inode_alloc_indirect(img, inode);
+            if (ret < 0)
+                return ret;
+            *dirty = true;
+        }
+
+        edfs_block_t goal = EDFS_BLOCK_INVALID;
+        if (i > 0)
+            goal = blocks[i - 1] + 1;
+        else if (id > 0 &&
+                 edfs_inode_map_blocks(img, inode, id - 1, 1, &goal) == 0 &&
+                 goal != EDFS_BLOCK_INVALID)
+            goal++;
+
+        edfs_block_t block;
+        ret = edfs_inode_alloc_run(img, pa, goal, want, &block);
+        if (ret < 0)
+            return ret;
+
+        uint32_t got = ret;
+        ret = edfs_inode_set_blocks(img, inode, id, got, block);
+        if (ret < 0) {
+            for (uint32_t j = 0; j < got; j++)
+                edfs_bitmap_clear(img, block + j);
+            return ret;
+        }
+
+        if (id < EDFS_INODE_N_DIRECT_BLOCKS)
+            *dirty = true;
+
+        for (uint32_t j = 0; j < got; j++) {
+            blocks[i + j] = block + j;
+            fresh[i + j] = true;
+        }
+        i += got;
+    }
+
+    return 0;
+}
+
+/*
+ * Inode-related routines
+ */
+
+
+/* Read inode from the in-memory inode table, inode->inumber must be set
+ * to the inode number to be read.
+ */
+int
+edfs_read_inode(edfs_image_t *img,
+                edfs_inode_t *inode)
+{
+  if (inode->inumber >= img->sb.inode_table_n_inodes || !img->inodes)
+    return -ENOENT;
+
+  pthread_mutex_lock(&img->inode_lock);
+  inode->inode = img->inodes[inode->inumber];
+  pthread_mutex_unlock(&img->inode_lock);
+
+  return sizeof(edfs_disk_inode_t);
+}
+
+/* Reads the root inode from disk. @inode must point to a valid
+ * inode structure.
+ */
+int
+edfs_read_root_inode(edfs_image_t *img,
+                     edfs_inode_t *inode)
+{
+  inode->inumber = img->sb.root_inumber;
+  return edfs_read_inode(img, inode);
+}
+
+/* Stores @disk_inode at @inumber in the in-memory table and writes it
+ * through to the image. With a journal, the write is deferred to the
+ * commit of the current transaction.
+ */
+static int
+edfs_store_inode(edfs_image_t *img, edfs_inumber_t inumber,
+                 const edfs_disk_inode_t *disk_inode)
+{
+  if (inumber >= img->sb.inode_table_n_inodes || !img->inodes)
+    return -ENOENT;
+
+  pthread_mutex_lock(&img->inode_lock);
+
+  img->inodes[inumber] = *disk_inode;
+  edfs_inode_bitmap_update(img, inumber, disk_inode);
+
+  /* When mapped, the table above already is the on-disk copy. */
+  ssize_t ret = sizeof(edfs_disk_inode_t);
+  if (img->journal)
+    edfs_journal_mark_inode(img, inumber);
+  else if (!img->map)
+    {
+      off_t offset = edfs_get_inode_offset(&img->sb, inumber);
+      ret = pwrite(img->fd, disk_inode, sizeof(edfs_disk_inode_t), offset);
+      edfs_stats_io(img, EDFS_SITE_INODE, true, ret);
+      if (ret < 0)
+        ret = -errno;
+    }
+
+  pthread_mutex_unlock(&img->inode_lock);
+
+  edfs_attr_invalidate(img, inumber);
+
+  return ret;
+}
+
+/* Writes @inode to disk, inode->inumber must be set to a valid
+ * inode number to which the inode will be written.
+ */
+int
+edfs_write_inode(edfs_image_t *img, edfs_inode_t *inode)
+{
+  return edfs_store_inode(img, inode->inumber, &inode->inode);
+}
+
+/* Clears the specified inode on disk, based on inode->inumber.
+ */
+int
+edfs_clear_inode(edfs_image_t *img, edfs_inode_t *inode)
+{
+  if (inode->inumber >= img->sb.inode_table_n_inodes)
+    return -ENOENT;
+
+  edfs_inode_forget_map(img, inode->inumber);
+
+  edfs_disk_inode_t disk_inode;
+  memset(&disk_inode, 0, sizeof(edfs_disk_inode_t));
+
+  int ret = edfs_store_inode(img, inode->inumber, &disk_inode);
+
+  pthread_mutex_lock(&img->inode_lock);
+  if (ret > 0 && inode->inumber < img->inode_hint)
+    img->inode_hint = inode->inumber;
+  pthread_mutex_unlock(&img->inode_lock);
+
+  return ret;
+}
+
+/* Finds a free inode and returns the inumber. NOTE: this does NOT
+ * allocate the inode. Only after a valid inode has been written
+ * to this inumber, this inode is allocated in the table.
+ */
+edfs_inumber_t
+edfs_find_free_inode(edfs_image_t *img)
+{
+  const uint32_t n_inodes = img->sb.inode_table_n_inodes;
+
+  if (!img->inode_bitmap)
+    return 0;
+
+  pthread_mutex_lock(&img->inode_lock);
+
+  uint32_t hint = img->inode_hint;
+  if (hint < 1 || hint >= n_inodes)
+    hint = 1;
+
+  uint32_t found = edfs_bitmap_find_clear(img->inode_bitmap, NULL, hint, n_inodes);
+  if (found == n_inodes)
+    {
+      found = edfs_bitmap_find_clear(img->inode_bitmap, NULL, 1, hint);
+      if (found == hint)
+        found = 0;
+    }
+
+  if (found != 0)
+    img->inode_hint = found;
+
+  pthread_mutex_unlock(&img->inode_lock);
+
+  return found;
+}
+
+/* Create a new inode. Searches for a free inode in the inode table (returns
+ * -ENOSPC if the inode table is full). @inode is initialized accordingly.
+ */
+int
+edfs_new_inode(edfs_image_t *img,
+               edfs_inode_t *inode,
+               edfs_inode_type_t type)
+{
+  edfs_inumber_t inumber;
+
+  inumber = edfs_find_free_inode(img);
+  if (inumber == 0)
+    return -ENOSPC;
+
+  memset(inode, 0, sizeof(edfs_inode_t));
+  inode->inumber = inumber;
+  inode->inode.type = type;
+
+  return 0;
+}
+
+void
+edfs_inode_lock(edfs_image_t *img, edfs_inumber_t inumber, bool write)
+{
+  if (!img->inode_rwlocks || inumber >= img->sb.inode_table_n_inodes)
+    return;
+
+  if (write)
+    pthread_rwlock_wrlock(&img->inode_rwlocks[inumber]);
+  else
+    pthread_rwlock_rdlock(&img->inode_rwlocks[inumber]);
+}
+
+void
+edfs_inode_unlock(edfs_image_t *img, edfs_inumber_t inumber)
+{
+  if (!img->inode_rwlocks || inumber >= img->sb.inode_table_n_inodes)
+    return;
+
+  pthread_rwlock_unlock(&img->inode_rwlocks[inumber]);
+}
+
+/* Returns what the blocks of @inode hold, for the statistics. */
+static inline edfs_io_site_t
+edfs_inode_site(const edfs_inode_t *inode)
+{
+    return inode->inode.type == EDFS_INODE_TYPE_DIRECTORY ?
+        EDFS_SITE_DIR : EDFS_SITE_DATA;
+}
+
+/*
+ * Data routines specialized for each block size
+ *
+ * The routines below that walk the blocks of a range are written once,
+ * taking the block size as the shift BLK_SHIFT, and are instantiated by
+ * EDFS_DATA_KERNELS for every supported block size. In an instance the
+ * shift is a constant, so offsets are split with constant shifts and
+ * masks and the bounce buffers have exactly the size of one block. The
+ * instance for the block size of an image is selected once, in
+ * edfs_image_open().
+ */
+
+#define EDFS_ALWAYS_INLINE inline __attribute__((__always_inline__))
+
+struct edfs_data_ops
+{
+    int (*read)(edfs_image_t *img, edfs_inode_t *inode,
+                void *buf, uint32_t size, uint32_t off);
+    int (*write)(edfs_image_t *img, edfs_inode_t *inode,
+                 const void *buf, uint32_t size, uint32_t off,
+                 edfs_prealloc_t *pa);
+};
+
+/* Image reads issued by one edfs_read_inode_data() call, which are
+ * submitted together. Only the first and the last block of the range
+ * can be partial; these are read into a bounce buffer of one block and
+ * copied out once the batch completed.
+ */
+typedef struct
+{
+    edfs_io_req_t reqs[EDFS_MAP_BATCH];
+    int n_reqs;
+    edfs_io_site_t site;
+
+    char *head;
+    char *head_dst;             /* NULL if head is unused */
+    uint32_t head_skip;
+    uint32_t head_len;
+
+    char *tail;
+    char *tail_dst;             /* NULL if tail is unused */
+    uint32_t tail_len;
+} edfs_read_batch_t;
+
+/* Adds a read of @n_blocks physically contiguous blocks, starting at
+ * @block, to @batch as a single vectored request. The blocks back the
+ * range [blk_start, blk_start + n_blocks * BLK_SIZE) of the file, which
+ * is clipped to the requested range [off, end): whole blocks are read
+ * directly into @buf, the partial head and tail blocks go through a
+ * bounce buffer.
+ */
+static EDFS_ALWAYS_INLINE void
+edfs_read_run(edfs_read_batch_t *batch, edfs_block_t block,
+              uint32_t n_blocks, uint32_t blk_start, char *buf,
+              uint32_t off, uint32_t end, const unsigned BLK_SHIFT)
+{
+    const uint32_t BLK_SIZE = (uint32_t)1 << BLK_SHIFT;
+    const uint32_t run_end = blk_start + (n_blocks << BLK_SHIFT);
+
+    edfs_io_req_t *req = &batch->reqs[batch->n_reqs++];
+    struct iovec *iov = req->iov;
+    int n_iov = 0;
+
+    uint32_t head_skip = off > blk_start ? off - blk_start : 0;
+    uint32_t tail_len = end < run_end ? BLK_SIZE - (run_end - end) : 0;
+
+    uint32_t direct_start = blk_start;
+    uint32_t direct_end = run_end;
+
+    if (head_skip > 0 || (n_blocks == 1 && tail_len > 0))
+    {
+        iov[n_iov].iov_base = batch->head;
+        iov[n_iov].iov_len = BLK_SIZE;
+        n_iov++;
+        direct_start += BLK_SIZE;
+
+        batch->head_dst = buf + (blk_start + head_skip - off);
+        batch->head_skip = head_skip;
+        batch->head_len = (end < blk_start + BLK_SIZE ? end : blk_start + BLK_SIZE)
+            - (blk_start + head_skip);
+    }
+
+    if (tail_len > 0 && direct_start < direct_end)
+    {
+        direct_end -= BLK_SIZE;
+    }
+    else
+        tail_len = 0;
+
+    if (direct_start < direct_end)
+    {
+        iov[n_iov].iov_base = buf + (direct_start - off);
+        iov[n_iov].iov_len = direct_end - direct_start;
+        n_iov++;
+    }
+
+    if (tail_len > 0)
+    {
+        iov[n_iov].iov_base = batch->tail;
+        iov[n_iov].iov_len = BLK_SIZE;
+        n_iov++;
+
+        batch->tail_dst = buf + (direct_end - off);
+        batch->tail_len = tail_len;
+    }
+
+    req->n_iov = n_iov;
+    req->off = (off_t)block << BLK_SHIFT;
+    req->write = false;
+}
+
+/* Submits the reads collected in @batch and completes the partial
+ * blocks. The batch is empty afterwards.
+ */
+static int
+edfs_read_batch_submit(edfs_image_t *img, edfs_read_batch_t *batch)
+{
+    if (batch->n_reqs == 0)
+        return 0;
+
+    int ret = edfs_image_submit(img, batch->reqs, batch->n_reqs);
+    edfs_stats_io_reqs(img, batch->site, batch->reqs, batch->n_reqs);
+    if (ret == 0 && batch->head_dst)
+        memcpy(batch->head_dst, batch->head + batch->head_skip, batch->head_len);
+    if (ret == 0 && batch->tail_dst)
+        memcpy(batch->tail_dst, batch->tail, batch->tail_len);
+
+    batch->n_reqs = 0;
+    batch->head_dst = NULL;
+    batch->tail_dst = NULL;
+
+    return ret;
+}
+
+/* Reads the blocks backing [off, off + size) of @inode, using @head and
+ * @tail as bounce buffers; see edfs_read_inode_data().
+ */
+static EDFS_ALWAYS_INLINE int
+edfs_read_blocks(edfs_image_t *img, edfs_inode_t *inode,
+                 void *buf, uint32_t size, uint32_t off,
+                 const unsigned BLK_SHIFT, char *head, char *tail)
+{
+    const uint32_t BLK_SIZE = (uint32_t)1 << BLK_SHIFT;
+
+    if (size == 0)
+        return 0;
+    else if (edfs_disk_inode_is_inline(&inode->inode))
+        return edfs_tail_read(img, inode, buf, size, off);
+
+    const uint32_t end = off + size;
+    const uint32_t first = off >> BLK_SHIFT;
+    const uint32_t last = (end - 1) >> BLK_SHIFT;
+
+    /* Physical blocks are resolved a batch at a time, so the indirect
+     * block is consulted once per batch rather than once per block. The
+     * image reads for a batch are then submitted at once.
+     */
+    edfs_block_t blocks[EDFS_MAP_BATCH];
+    edfs_read_batch_t batch;
+
+    batch.n_reqs = 0;
+    batch.site = edfs_inode_site(inode);
+    batch.head = head;
+    batch.head_dst = NULL;
+    batch.tail = tail;
+    batch.tail_dst = NULL;
+
+    for (uint32_t base = first; base <= last; base += EDFS_MAP_BATCH)
+    {
+        if (base > EDFS_INODE_N_DIRECT_BLOCKS &&
+                base >= (inode->inode.size + BLK_SIZE - 1) >> BLK_SHIFT)
+            return -EINVAL;
+
+        uint32_t n = last - base + 1;
+        if (n > EDFS_MAP_BATCH)
+            n = EDFS_MAP_BATCH;
+
+        int ret = edfs_inode_map_blocks(img, inode, base, n, blocks);
+        if (ret < 0)
+            return ret;
+
+        for (uint32_t i = 0; i < n; )
+        {
+            uint32_t blk_start = (base + i) << BLK_SHIFT;
+            uint32_t blk_off = off > blk_start ? off - blk_start : 0;
+            uint32_t blk_size = (end < blk_start + BLK_SIZE ? end : blk_start + BLK_SIZE)
+                - (blk_start + blk_off);
+            char *dst = (char *)buf + (blk_start + blk_off - off);
+
+            /* Holes read as zeroes. */
+            if (blocks[i] == EDFS_BLOCK_INVALID)
+            {
+                memset(dst, 0, blk_size);
+                i++;
+                continue;
+            }
+
+            /* Collect the run of physically contiguous blocks that are
+             * not cached; cached blocks may be newer than the image.
+             */
+            uint32_t run = 0;
+            while (i + run < n &&
+                   blocks[i + run] != EDFS_BLOCK_INVALID &&
+                   blocks[i + run] == blocks[i] + run &&
+                   !edfs_cache_contains(img, blocks[i + run]))
+                run++;
+
+            /* Cached blocks and small reads within a single block are
+             * served by the block cache, which keeps e.g. directory
+             * blocks resident. Larger runs bypass it. A mapped image is
+             * always copied from directly.
+             */
+            if (run == 0 || img->map || (run == 1 && blk_size < BLK_SIZE))
+            {
+                ret = edfs_cache_read(img, blocks[i], dst, blk_off, blk_size,
+                                      batch.site);
+                if (ret < 0)
+                    return ret;
+                i++;
+                continue;
+            }
+
+            edfs_read_run(&batch, blocks[i], run, blk_start, buf, off, end,
+                          BLK_SHIFT);
+            i += run;
+        }
+
+        ret = edfs_read_batch_submit(img, &batch);
+        if (ret < 0)
+            return ret;
+    }
+
+    return size;
+}
+
+/* Writes @size bytes from @buf at offset @off of @inode. Missing blocks
+ * in the range are allocated, holes before @off are left alone and read
+ * back as zeroes. If @buf is NULL, newly allocated blocks are zeroed and
+ * existing blocks are left untouched. The size of a regular file is
+ * extended when the range ends beyond it; the inode is written at most
+ * once per call. Returns the number of bytes covered, which is only
+ * less than @size if the file system filled up halfway.
+ *
+ * Blocks of a regular file that are overwritten entirely bypass the
+ * cache: runs of them are written straight from @buf, one request per
+ * physically contiguous run, submitted once per batch.
+ */
+static EDFS_ALWAYS_INLINE int
+edfs_write_blocks(edfs_image_t *img, edfs_inode_t *inode,
+                  const void *buf, uint32_t size, uint32_t off,
+                  edfs_prealloc_t *pa, const unsigned BLK_SHIFT)
+{
+    const uint32_t BLK_SIZE = (uint32_t)1 << BLK_SHIFT;
+    const uint32_t end = off + size;
+
+    if (size == 0)
+        return 0;
+    if (end < off)
+        return -EFBIG;
+
+    uint32_t first = off >> BLK_SHIFT;
+    uint32_t last = (end - 1) >> BLK_SHIFT;
+
+    bool dirty = false;
+    uint32_t done = off;
+    int ret = 0;
+
+    edfs_block_t blocks[EDFS_MAP_BATCH];
+    bool fresh[EDFS_MAP_BATCH];
+    edfs_io_req_t reqs[EDFS_MAP_BATCH];
+    uint32_t req_start[EDFS_MAP_BATCH];
+
+    const bool direct = buf && inode->inode.type == EDFS_INODE_TYPE_FILE;
+
+    for (uint32_t base = first; base <= last && ret >= 0; base += EDFS_MAP_BATCH)
+    {
+        uint32_t n = last - base + 1;
+        if (n > EDFS_MAP_BATCH)
+            n = EDFS_MAP_BATCH;
+
+        ret = edfs_inode_map_blocks(img, inode, base, n, blocks);
+        if (ret >= 0)
+            ret = edfs_inode_fill_holes(img, inode, base, n, blocks,
+                                        fresh, &dirty, pa);
+        if (ret < 0)
+            break;
+
+        int n_reqs = 0;
+
+        for (uint32_t i = 0; i < n; i++)
+        {
+            uint32_t blk_start = (base + i) << BLK_SHIFT;
+            uint32_t lo = done > blk_start ? done - blk_start : 0;
+            uint32_t hi = end - blk_start < BLK_SIZE ? end - blk_start : BLK_SIZE;
+
+            if (direct && lo == 0 && hi == BLK_SIZE)
+            {
+                /* A cached copy would be stale after this. */
+                edfs_cache_forget(img, blocks[i]);
+
+                off_t pos = (off_t)blocks[i] << BLK_SHIFT;
+                edfs_io_req_t *prev = n_reqs > 0 ? &reqs[n_reqs - 1] : NULL;
+
+                if (prev && req_start[n_reqs - 1] + prev->iov[0].iov_len == blk_start &&
+                    prev->off + (off_t)prev->iov[0].iov_len == pos)
+                    prev->iov[0].iov_len += BLK_SIZE;
+                else
+                {
+                    edfs_io_req_t *req = &reqs[n_reqs];
+                    req->iov[0].iov_base = (char *)buf + (blk_start - off);
+                    req->iov[0].iov_len = BLK_SIZE;
+                    req->n_iov = 1;
+                    req->off = pos;
+                    req->write = true;
+                    req_start[n_reqs++] = blk_start;
+                }
+
+                done = blk_start + hi;
+                continue;
+            }
+
+            /* Directory entries are journaled, file contents are not. */
+            if (inode->inode.type == EDFS_INODE_TYPE_DIRECTORY)
+                edfs_cache_set_meta(img, blocks[i]);
+
+            /* A new block not completely overwritten would otherwise
+             * expose its previous contents.
+             */
+            if (fresh[i] && (!buf || lo > 0 || hi < BLK_SIZE))
+            {
+                ret = edfs_cache_zero(img, blocks[i], edfs_inode_site(inode));
+                if (ret < 0)
+                    break;
+            }
+
+            /* Only the touched range is copied into the cached block,
+             * so small writes such as a directory entry do not rewrite
+             * the whole block.
+             */
+            if (buf)
+            {
+                ret = edfs_cache_write(img, blocks[i],
+                                       (const char *)buf + (blk_start + lo - off),
+                                       lo, hi - lo, edfs_inode_site(inode));
+                if (ret < 0)
+                    break;
+            }
+
+            done = blk_start + hi;
+        }
+
+        int sub = n_reqs > 0 ? edfs_image_submit(img, reqs, n_reqs) : 0;
+        edfs_stats_io_reqs(img, EDFS_SITE_DATA, reqs, n_reqs);
+        if (sub < 0)
+        {
+            /* Only what precedes the first failed run was written. */
+            for (int i = 0; i < n_reqs; i++)
+                if (reqs[i].res != (ssize_t)reqs[i].iov[0].iov_len)
+                {
+                    ret = reqs[i].res < 0 ? reqs[i].res : -EIO;
+                    if (req_start[i] < done)
+                        done = req_start[i];
+                    break;
+                }
+        }
+    }
+
+    /* Directories keep a size of 0, their extent is given by the
+     * allocated blocks.
+     */
+    if (inode->inode.type == EDFS_INODE_TYPE_FILE && done > inode->inode.size)
+    {
+        inode->inode.size = done;
+        dirty = true;
+    }
+
+    int wret = dirty ? edfs_write_inode(img, inode) : 0;
+
+    /* Blocks allocated above are only marked in memory so far. */
+    int fret = edfs_bitmap_flush(img);
+
+    if (wret < 0)
+        return wret;
+    else if (fret < 0)
+        return fret;
+    else if (ret < 0 && done == off)
+        return ret;
+
+    return done - off;
+}
+
+/* Instantiates the data routines for blocks of 1 << @shift bytes. */
+#define EDFS_DATA_KERNELS(shift)                                        \
+    static int                                                          \
+    edfs_read_blocks_##shift(edfs_image_t *img, edfs_inode_t *inode,    \
+                             void *buf, uint32_t size, uint32_t off)    \
+    {                                                                   \
+        char head[1 << (shift)];                                        \
+        char tail[1 << (shift)];                                        \
+                                                                        \
+        return edfs_read_blocks(img, inode, buf, size, off, (shift),    \
+                                head, tail);                            \
+    }                                                                   \
+                                                                        \
+    static int                                                          \
+    edfs_write_blocks_##shift(edfs_image_t *img, edfs_inode_t *inode,   \
+                              const void *buf, uint32_t size,           \
+                              uint32_t off, edfs_prealloc_t *pa)        \
+    {                                                                   \
+        return edfs_write_blocks(img, inode, buf, size, off, pa,        \
+                                 (shift));                              \
+    }
+
+/* The shifts below must cover EDFS_MIN_BLOCK_SIZE to EDFS_MAX_BLOCK_SIZE. */
+#if EDFS_MIN_BLOCK_SIZE != (1 << 9) || EDFS_MAX_BLOCK_SIZE != (1 << 13)
+#error "EDFS_DATA_KERNELS must be instantiated for every block size"
+#endif
+
+EDFS_DATA_KERNELS(9)
+EDFS_DATA_KERNELS(10)
+EDFS_DATA_KERNELS(11)
+EDFS_DATA_KERNELS(12)
+EDFS_DATA_KERNELS(13)
+
+#define EDFS_DATA_OPS(shift) \
+    { edfs_read_blocks_##shift, edfs_write_blocks_##shift }
+
+/* Indexed by the block size shift minus that of EDFS_MIN_BLOCK_SIZE,
+ * one entry for every block size up to EDFS_MAX_BLOCK_SIZE.
+ */
+static const edfs_data_ops_t edfs_data_ops[] =
+{
+    EDFS_DATA_OPS(9),
+    EDFS_DATA_OPS(10),
+    EDFS_DATA_OPS(11),
+    EDFS_DATA_OPS(12),
+    EDFS_DATA_OPS(13),
+};
+
+/* Returns the data routines for blocks of @block_size bytes, which
+ * edfs_read_super() verified to be a supported power of two.
+ */
+static const edfs_data_ops_t *
+edfs_data_ops_get(uint16_t block_size)
+{
+    return &edfs_data_ops[__builtin_ctz(block_size) -
+                          __builtin_ctz(EDFS_MIN_BLOCK_SIZE)];
+}
+
+int
+edfs_read_inode_data(edfs_image_t *img,
+                     edfs_inode_t *inode,
+                     void *buf,
+                     uint32_t size,
+                     uint32_t off)
+{
+    // TODO dingen verifiereren 
+
+    return img->data_ops->read(img, inode, buf, size, off);
+}
+
+static inline int
+edfs_inode_write_range(edfs_image_t *img, edfs_inode_t *inode,
+                       const void *buf, uint32_t size, uint32_t off,
+                       edfs_prealloc_t *pa)
+{
+    return img->data_ops->write(img, inode, buf, size, off, pa);
+}
+
+/* Moves the data of inline file @inode into a block of its own, before
+ * it grows beyond the inline limit or gets blocks allocated. The tail
+ * units are only released once the inode refers to the new block; on
+ * failure @inode is left inline.
+ */
+static int
+edfs_inode_uninline(edfs_image_t *img, edfs_inode_t *inode,
+                    edfs_prealloc_t *pa)
+{
+    if (!edfs_disk_inode_is_inline(&inode->inode))
+        return 0;
+
+    uint8_t data[EDFS_MAX_BLOCK_SIZE];
+    uint32_t size = inode->inode.size;
+
+    int ret = edfs_tail_read(img, inode, data, size, 0);
+    if (ret < 0)
+        return ret;
+
+    edfs_inode_t inlined = *inode;
+    inode->inode.flags &= ~EDFS_INODE_FLAG_INLINE;
+    inode->inode.tail = 0;
+    inode->inode.tail_off = 0;
+
+    ret = edfs_inode_write_range(img, inode, data, size, 0, pa);
+    if (ret >= 0 && (uint32_t)ret < size)
+        ret = -ENOSPC;
+    if (ret >= 0)
+        ret = edfs_write_inode(img, inode);
+
+    if (ret < 0)
+    {
+        /* Drop what was allocated, the tail still holds the data. */
+        edfs_inode_free_blocks(img, inode, 0);
+        *inode = inlined;
+        edfs_write_inode(img, inode);
+        return ret;
+    }
+
+    edfs_tail_release(img, &inlined);
+
+    return edfs_bitmap_flush(img);
+}
+
+int
+edfs_write_inode_data(edfs_image_t *img,
+                     edfs_inode_t *inode,
+                     const void *buf,
+                     uint32_t size,
+                     uint32_t off,
+                     edfs_prealloc_t *pa)
+{
+    if (size == 0)
+        return 0;
+    else if (edfs_tail_fits(img, inode, size, off))
+        return edfs_tail_write(img, inode, buf, size, off);
+
+    int ret = edfs_inode_uninline(img, inode, pa);
+    if (ret < 0)
+        return ret;
+
+    return edfs_inode_write_range(img, inode, buf, size, off, pa);
+}
+
+int
+edfs_allocate_inode_data(edfs_image_t *img,
+                         edfs_inode_t *inode,
+                         uint32_t size,
+                         uint32_t off,
+                         edfs_prealloc_t *pa)
+{
+    int ret = edfs_inode_uninline(img, inode, pa);
+    if (ret < 0)
+        return ret;
+
+    return edfs_inode_write_range(img, inode, NULL, size, off, pa);
+}
+
+void
+edfs_prealloc_release(edfs_image_t *img, edfs_prealloc_t *pa)
+{
+    if (!pa || pa->n_blocks == 0)
+        return;
+
+    edfs_bitmap_unreserve(img, pa->start, pa->n_blocks);
+
+    pa->start = EDFS_BLOCK_INVALID;
+    pa->n_blocks = 0;
+}
+
+/* Tracks sequential access through @ra. While reads continue where the
+ * previous one ended, the window grows up to EDFS_READAHEAD_MAX blocks
+ * and the not yet prefetched blocks within it are announced to the OS,
+ * one hint per physically contiguous run, so that the device reads
+ * overlap with the FUSE round trips. Resolving the window also loads
+ * the indirect block into the block map.
+ */
+void
+edfs_readahead(edfs_image_t *img, edfs_inode_t *inode, edfs_readahead_t *ra,
+               uint32_t off, uint32_t size)
+{
+    const uint16_t BLK_SIZE = img->sb.block_size;
+
+    bool sequential = off == ra->next_off;
+    ra->next_off = off + size;
+
+    if (!sequential)
+    {
+        ra->window = 0;
+        ra->ra_end = 0;
+
+        /* A read from the start of the file begins a new stream. */
+        if (off != 0)
+            return;
+    }
+
+    if (ra->window == 0)
+        ra->window = EDFS_READAHEAD_MIN;
+    else if (ra->window < EDFS_READAHEAD_MAX)
+        ra->window *= 2;
+
+    uint32_t n_file = (inode->inode.size + BLK_SIZE - 1) / BLK_SIZE;
+    uint32_t first = (off + size + BLK_SIZE - 1) / BLK_SIZE;
+    uint32_t last = first + ra->window;
+
+    if (first < ra->ra_end)
+        first = ra->ra_end;
+    if (last > n_file)
+        last = n_file;
+    if (first >= last)
+        return;
+
+    edfs_block_t blocks[EDFS_READAHEAD_MAX];
+    uint32_t n = last - first;
+    if (edfs_inode_map_blocks(img, inode, first, n, blocks) < 0)
+        return;
+
+    for (uint32_t i = 0; i < n; )
+    {
+        if (blocks[i] == EDFS_BLOCK_INVALID || edfs_cache_contains(img, blocks[i]))
+        {
+            i++;
+            continue;
+        }
+
+        uint32_t run = 1;
+        while (i + run < n && blocks[i + run] == blocks[i] + run)
+            run++;
+
+        edfs_image_prefetch(img, edfs_get_block_offset(&img->sb, blocks[i]),
+                            (size_t)run * BLK_SIZE);
+        i += run;
+    }
+
+    ra->ra_end = last;
+}
+
+/* Releases all blocks of @inode from logical block @from onwards, along
+ * with the indirect block if no block referenced from it remains. The
+ * blocks are collected per batch and their bits cleared in one pass, the
+ * bitmap is written back once at the end. Data blocks of an inode with
+ * an extent hold set are not reused before it is cleared. The caller is responsible for
+ * writing the (modified) inode.
+ */
+int
+edfs_inode_free_blocks(edfs_image_t *img, edfs_inode_t *inode, uint32_t from)
+{
+    const uint32_t n_indirect = edfs_get_n_blocks_per_indirect_block(&img->sb);
+    const uint32_t n_total = EDFS_INODE_N_DIRECT_BLOCKS + n_indirect;
+
+    /* The data of an inline file lies within its first block. */
+    if (edfs_disk_inode_is_inline(&inode->inode))
+    {
+        if (from == 0)
+            edfs_tail_release(img, inode);
+        return edfs_bitmap_flush(img);
+    }
+
+    /* Without an indirect block, at most the direct blocks are in use. */
+    uint32_t end = inode->inode.indirect == EDFS_BLOCK_INVALID ?
+        EDFS_INODE_N_DIRECT_BLOCKS : n_total;
+
+    edfs_block_t blocks[EDFS_MAP_BATCH];
+    edfs_block_t freed[EDFS_MAP_BATCH];
+    int ret = 0;
+
+    for (uint32_t base = from; base < end; base += EDFS_MAP_BATCH)
+    {
+        uint32_t n = end - base;
+        if (n > EDFS_MAP_BATCH)
+            n = EDFS_MAP_BATCH;
+
+        ret = edfs_inode_map_blocks(img, inode, base, n, blocks);
+        if (ret < 0)
+            return ret;
+
+        uint32_t n_freed = 0;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            if (blocks[i] == EDFS_BLOCK_INVALID)
+                continue;
+
+            edfs_cache_forget(img, blocks[i]);
+            freed[n_freed++] = blocks[i];
+        }
+
+        edfs_bitmap_release_blocks(img, inode->inumber, freed, n_freed);
+    }
+
+    for (uint32_t id = from; id < EDFS_INODE_N_DIRECT_BLOCKS; id++)
+        inode->inode.direct[id] = EDFS_BLOCK_INVALID;
+
+    if (inode->inode.indirect != EDFS_BLOCK_INVALID)
+    {
+        if (from <= EDFS_INODE_N_DIRECT_BLOCKS)
+        {
+            edfs_block_t indirect = inode->inode.indirect;
+
+            edfs_cache_forget(img, indirect);
+            edfs_bitmap_clear_blocks(img, &indirect, 1);
+            inode->inode.indirect = EDFS_BLOCK_INVALID;
+        }
+        else
+        {
+            /* Clear the released entries of the indirect block. */
+            uint32_t idx = from - EDFS_INODE_N_DIRECT_BLOCKS;
+            uint8_t zero[EDFS_MAX_BLOCK_SIZE] = { 0, };
+
+            edfs_cache_set_meta(img, inode->inode.indirect);
+            ret = edfs_cache_write(img, inode->inode.indirect, zero,
+                                   idx * sizeof(edfs_block_t),
+                                   (n_indirect - idx) * sizeof(edfs_block_t),
+                                   EDFS_SITE_INDIRECT);
+        }
+
+        edfs_inode_forget_map(img, inode->inumber);
+    }
+
+    int fret = edfs_bitmap_flush(img);
+    if (ret < 0)
+        return ret;
+
+    return fret;
+}
+
+/* Sets the size of regular file @inode to @size. Blocks beyond the new
+ * size are released. Growing the file leaves a hole that reads back as
+ * zeroes; the part of the last block beyond the old size is cleared so
+ * that no stale data becomes visible.
+ */
+int
+edfs_truncate_inode_data(edfs_image_t *img, edfs_inode_t *inode, uint32_t size)
+{
+    const uint16_t BLK_SIZE = img->sb.block_size;
+    const uint32_t n_max = EDFS_INODE_N_DIRECT_BLOCKS +
+        edfs_get_n_blocks_per_indirect_block(&img->sb);
+
+    if (size > n_max * BLK_SIZE)
+        return -EFBIG;
+
+    if (edfs_disk_inode_is_inline(&inode->inode))
+    {
+        if (size <= edfs_get_inline_max_size(&img->sb))
+            return edfs_tail_truncate(img, inode, size);
+
+        int ret = edfs_inode_uninline(img, inode, NULL);
+        if (ret < 0)
+            return ret;
+    }
+
+    uint32_t old_size = inode->inode.size;
+    uint32_t from = size < old_size ? size : old_size;
+    uint32_t to = size < old_size ? old_size : size;
+    int ret = 0;
+
+    /* Clear the tail of the block that now holds the end of data. */
+    if (from % BLK_SIZE != 0)
+    {
+        uint32_t blk_end = (from / BLK_SIZE + 1) * BLK_SIZE;
+        uint32_t len = (to < blk_end ? to : blk_end) - from;
+
+        edfs_block_t block;
+        ret = edfs_inode_map_blocks(img, inode, from / BLK_SIZE, 1, &block);
+        if (ret >= 0 && block != EDFS_BLOCK_INVALID)
+        {
+            uint8_t zero[EDFS_MAX_BLOCK_SIZE] = { 0, };
+            ret = edfs_cache_write(img, block, zero, from % BLK_SIZE, len,
+                                   EDFS_SITE_DATA);
+        }
+        if (ret < 0)
+            return ret;
+    }
+
+    if (size < old_size)
+    {
+        ret = edfs_inode_free_blocks(img, inode, (size + BLK_SIZE - 1) / BLK_SIZE);
+        if (ret < 0)
+            return ret;
+    }
+
+    inode->inode.size = size;
+    ret = edfs_write_inode(img, inode);
+
+    return ret < 0 ? ret : 0;
+}
+
+
+/*
+ * Directory iteration
+ */
+
+void
+edfs_dir_iter_init(edfs_dir_iter_t *it, edfs_image_t *img, edfs_inode_t *dir)
+{
+    it->img = img;
+    it->dir = dir;
+    it->blk_id = 0;
+    it->blk_off = 0;
+    it->slot = 0;
+    it->n_slots = 0;
+}
+
+/* Reads bucket @bucket of hashed directory @dir into @entries. Returns
+ * 1, or 0 if the bucket is not allocated, in which case @entries is not
+ * touched.
+ */
+static int
+edfs_dir_read_bucket(edfs_image_t *img, edfs_inode_t *dir, uint32_t bucket,
+                     edfs_dir_entry_t *entries)
+{
+    edfs_block_t block;
+    int ret = edfs_inode_map_blocks(img, dir, bucket, 1, &block);
+    if (ret < 0)
+        return ret;
+    else if (block == EDFS_BLOCK_INVALID)
+        return 0;
+
+    ret = edfs_cache_read(img, block, entries, 0, img->sb.block_size,
+                          EDFS_SITE_DIR);
+
+    return ret < 0 ? ret : 1;
+}
+
+/* Loads the next directory block into it->entries and marks all of its
+ * slots as visited. Returns the number of slots, 0 when all blocks have
+ * been visited, or a negative error code.
+ */
+int
+edfs_dir_iter_next_block(edfs_dir_iter_t *it)
+{
+    const uint16_t BLK_SIZE = it->img->sb.block_size;
+    int ret = 0;
+
+    if (edfs_disk_inode_is_hashed(&it->dir->inode))
+    {
+        /* Buckets that were never used are skipped. */
+        const uint32_t n_buckets = edfs_get_n_dir_buckets(&it->img->sb);
+
+        while (ret == 0 && it->blk_id < n_buckets)
+        {
+            ret = edfs_dir_read_bucket(it->img, it->dir, it->blk_id, it->entries);
+            if (ret == 0)
+                it->blk_id++;
+        }
+
+        if (ret <= 0)
+            return ret;
+    }
+    else
+    {
+        /* Classic directories only use the direct blocks. */
+        if (it->blk_id >= EDFS_INODE_N_DIRECT_BLOCKS)
+            return 0;
+
+        ret = edfs_read_inode_data(it->img, it->dir, it->entries,
+                                   BLK_SIZE, it->blk_id * BLK_SIZE);
+        if (ret < 0)
+            return ret;
+    }
+
+    it->blk_off = it->blk_id * BLK_SIZE;
+    it->blk_id++;
+    it->n_slots = edfs_get_n_dir_entries_per_block(&it->img->sb);
+    it->slot = it->n_slots;
+
+    return it->n_slots;
+}
+
+/* Advances to the next entry slot. Returns 1 and sets *entry to the
+ * slot (and *off, if non-NULL, to its byte offset in the directory), 0
+ * when all slots have been visited, or a negative error code.
+ */
+int
+edfs_dir_iter_next(edfs_dir_iter_t *it, edfs_dir_entry_t **entry, uint32_t *off)
+{
+    if (it->slot == it->n_slots)
+    {
+        int ret = edfs_dir_iter_next_block(it);
+        if (ret <= 0)
+            return ret;
+
+        it->slot = 0;
+    }
+
+    if (off)
+        *off = it->blk_off + it->slot * sizeof(edfs_dir_entry_t);
+    *entry = &it->entries[it->slot++];
+
+    return 1;
+}
+
+/* Positions the iterator so that the next entry returned is the slot
+ * at byte offset @off in the directory, or the first slot after it
+ * when @off lies in an unallocated bucket. Returns 1, 0 if no slots
+ * remain, or a negative error code.
+ */
+int
+edfs_dir_iter_seek(edfs_dir_iter_t *it, uint32_t off)
+{
+    const uint16_t BLK_SIZE = it->img->sb.block_size;
+
+    it->blk_id = off / BLK_SIZE;
+    it->slot = 0;
+    it->n_slots = 0;
+
+    int ret = edfs_dir_iter_next_block(it);
+    if (ret <= 0)
+        return ret;
+
+    if (it->blk_off == off - off % BLK_SIZE)
+        it->slot = (off % BLK_SIZE) / sizeof(edfs_dir_entry_t);
+    else
+        it->slot = 0;
+
+    return 1;
+}
+
+/* The first EDFS_NAME_PREFIX bytes of every filename are compared with
+ * one vector compare; only entries that match on that prefix are
+ * compared in full. Bytes after the terminating null of the needle are
+ * masked out, as directory entries may contain junk there.
+ */
+#if defined(__AVX2__)
+#define EDFS_NAME_PREFIX 32
+#elif defined(__SSE2__)
+#define EDFS_NAME_PREFIX 16
+#else
+#define EDFS_NAME_PREFIX 1
+#endif
+
+int
+edfs_dir_entries_find(const edfs_dir_entry_t *entries, int n, const char *name)
+{
+    size_t len = strlen(name) + 1;
+    if (len > EDFS_FILENAME_SIZE)
+        return -1;
+
+    size_t prefix = len < EDFS_NAME_PREFIX ? len : EDFS_NAME_PREFIX;
+
+#if defined(__AVX2__) || defined(__SSE2__)
+    char needle_buf[EDFS_NAME_PREFIX] = { 0, };
+    memcpy(needle_buf, name, prefix);
+    const uint32_t mask = (uint32_t)(((uint64_t)1 << prefix) - 1);
+#endif
+
+#if defined(__AVX2__)
+    const __m256i needle = _mm256_loadu_si256((const __m256i *)needle_buf);
+#elif defined(__SSE2__)
+    const __m128i needle = _mm_loadu_si128((const __m128i *)needle_buf);
+#endif
+
+    for (int i = 0; i < n; i++)
+    {
+        const char *filename = entries[i].filename;
+
+#if defined(__AVX2__)
+        __m256i cand = _mm256_loadu_si256((const __m256i *)filename);
+        uint32_t eq = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(needle, cand));
+        if ((eq & mask) != mask)
+            continue;
+#elif defined(__SSE2__)
+        __m128i cand = _mm_loadu_si128((const __m128i *)filename);
+        uint32_t eq = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(needle, cand));
+        if ((eq & mask) != mask)
+            continue;
+#else
+        if (filename[0] != name[0])
+            continue;
+#endif
+
+        if (edfs_dir_entry_is_empty(&entries[i]))
+            continue;
+
+        if (memcmp(filename + prefix, name + prefix, len - prefix) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Looks up @name in @dir. Returns 1 and copies the entry to @entry, and
+ * its offset within the directory to *off if non-NULL, 0 if there is no
+ * such entry, or a negative error code. A hashed directory is searched
+ * from the home bucket of @name until a bucket that never overflowed.
+ */
+int
+edfs_dir_lookup(edfs_image_t *img, edfs_inode_t *dir, const char *name,
+                edfs_dir_entry_t *entry, uint32_t *off)
+{
+    const uint16_t BLK_SIZE = img->sb.block_size;
+    const int n_slots = edfs_get_n_dir_entries_per_block(&img->sb);
+    edfs_dir_entry_t entries[EDFS_MAX_BLOCK_SIZE / sizeof(edfs_dir_entry_t)];
+
+    if (!edfs_disk_inode_is_hashed(&dir->inode))
+    {
+        edfs_dir_iter_t it;
+        int n;
+
+        edfs_dir_iter_init(&it, img, dir);
+        while ((n = edfs_dir_iter_next_block(&it)) > 0)
+        {
+            int idx = edfs_dir_entries_find(it.entries, n, name);
+            if (idx >= 0)
+            {
+                *entry = it.entries[idx];
+                if (off)
+                    *off = it.blk_off + idx * sizeof(edfs_dir_entry_t);
+                return 1;
+            }
+        }
+
+        return n;
+    }
+
+    const uint32_t n_buckets = edfs_get_n_dir_buckets(&img->sb);
+    const uint32_t home = edfs_dir_hash(name) % n_buckets;
+
+    for (uint32_t i = 0; i < n_buckets; i++)
+    {
+        uint32_t bucket = (home + i) % n_buckets;
+
+        int ret = edfs_dir_read_bucket(img, dir, bucket, entries);
+        if (ret <= 0)
+            return ret;
+
+        int idx = edfs_dir_entries_find(entries, n_slots, name);
+        if (idx > 0)
+        {
+            *entry = entries[idx];
+            if (off)
+                *off = bucket * BLK_SIZE + idx * sizeof(edfs_dir_entry_t);
+            return 1;
+        }
+
+        if (!entries[0].filename[EDFS_DIR_BUCKET_OVERFLOW])
+            return 0;
+    }
+
+    return 0;
+}
+
+/* Finds a free slot of hashed directory @dir for @name. Full buckets
+ * passed on the way are marked as overflowed. If @absent, @name is
+ * known not to be in @dir and the first free slot is taken without
+ * looking at the rest of the chain.
+ */
+static int
+edfs_dir_hashed_find_free(edfs_image_t *img, edfs_inode_t *dir,
+                          const char *name, bool absent, uint32_t *off)
+{
+    const uint16_t BLK_SIZE = img->sb.block_size;
+    const int n_slots = edfs_get_n_dir_entries_per_block(&img->sb);
+    const uint32_t n_buckets = edfs_get_n_dir_buckets(&img->sb);
+    const uint32_t home = edfs_dir_hash(name) % n_buckets;
+    const uint32_t flag_off = offsetof(edfs_dir_entry_t, filename) +
+        EDFS_DIR_BUCKET_OVERFLOW;
+
+    edfs_dir_entry_t entries[EDFS_MAX_BLOCK_SIZE / sizeof(edfs_dir_entry_t)];
+    bool found = false;
+
+    for (uint32_t i = 0; i < n_buckets; i++)
+    {
+        uint32_t bucket = (home + i) % n_buckets;
+
+        int ret = edfs_dir_read_bucket(img, dir, bucket, entries);
+        if (ret < 0)
+            return ret;
+        else if (ret == 0)
+        {
+            /* An unused bucket ends the chain and has room. */
+            if (!found)
+                *off = bucket * BLK_SIZE + sizeof(edfs_dir_entry_t);
+            return 0;
+        }
+
+        if (!absent && edfs_dir_entries_find(entries, n_slots, name) > 0)
+            return -EEXIST;
+
+        for (int j = 1; j < n_slots && !found; j++)
+            if (edfs_dir_entry_is_empty(&entries[j]))
+            {
+                *off = bucket * BLK_SIZE + j * sizeof(edfs_dir_entry_t);
+                found = true;
+            }
+
+        if (found && absent)
+            return 0;
+        else if (entries[0].filename[EDFS_DIR_BUCKET_OVERFLOW])
+            continue;
+        else if (found)
+            return 0;
+
+        /* Full, @name goes into one of the next buckets. */
+        const uint8_t flag = 1;
+        ret = edfs_write_inode_data(img, dir, &flag, 1,
+                                    bucket * BLK_SIZE + flag_off, NULL);
+        if (ret < 0)
+            return ret;
+    }
+
+    return found ? 0 : -ENOMSG;
+}
+
+static int
+edfs_dir_find_free_slot(edfs_image_t *img, edfs_inode_t *dir,
+                        const char *name, bool absent, uint32_t *off)
+{
+    if (edfs_disk_inode_is_hashed(&dir->inode))
+        return edfs_dir_hashed_find_free(img, dir, name, absent, off);
+
+    uint32_t entry_off = UINT32_MAX;
+
+    edfs_dir_iter_t it;
+    int n;
+
+    edfs_dir_iter_init(&it, img, dir);
+    while ((n = edfs_dir_iter_next_block(&it)) > 0)
+    {
+        if (!absent && edfs_dir_entries_find(it.entries, n, name) >= 0)
+            return -EEXIST;
+
+        for (int i = 0; i < n && entry_off == UINT32_MAX; i++)
+            if (edfs_dir_entry_is_empty(&it.entries[i]))
+                entry_off = it.blk_off + i * sizeof(edfs_dir_entry_t);
+
+        if (absent && entry_off != UINT32_MAX)
+            break;
+    }
+
+    if (n < 0)
+        return n;
+    else if (entry_off == UINT32_MAX)
+        return -ENOMSG;
+
+    *off = entry_off;
+
+    return 0;
+}
+
+/* Finds the offset within @dir at which an entry for @name can be
+ * written. Returns 0, -EEXIST if @dir already contains @name, -ENOMSG if
+ * @dir is full, or another negative error code.
+ */
+int
+edfs_dir_find_free(edfs_image_t *img, edfs_inode_t *dir, const char *name,
+                   uint32_t *off)
+{
+    return edfs_dir_find_free_slot(img, dir, name, false, off);
+}
+
+/* Lays out @entries in the in-memory buckets @buckets the way inserting
+ * them one by one through edfs_dir_hashed_find_free() would, marking the
+ * buckets that get used in @used.
+ */
+static int
+edfs_dir_hash_entries(const edfs_super_block_t *sb,
+                      const edfs_dir_entry_t *entries, int n,
+                      edfs_dir_entry_t *buckets, bool *used)
+{
+    const int n_slots = edfs_get_n_dir_entries_per_block(sb);
+    const uint32_t n_buckets = edfs_get_n_dir_buckets(sb);
+
+    for (int i = 0; i < n; i++)
+    {
+        const uint32_t home = edfs_dir_hash(entries[i].filename) % n_buckets;
+        bool placed = false;
+
+        for (uint32_t k = 0; k < n_buckets && !placed; k++)
+        {
+            uint32_t b = (home + k) % n_buckets;
+            edfs_dir_entry_t *bucket = &buckets[b * n_slots];
+
+            /* An unused bucket takes the entry in its first slot. */
+            if (!used[b])
+            {
+                used[b] = true;
+                bucket[1] = entries[i];
+                placed = true;
+                continue;
+            }
+
+            for (int j = 1; j < n_slots && !placed; j++)
+                if (edfs_dir_entry_is_empty(&bucket[j]))
+                {
+                    bucket[j] = entries[i];
+                    placed = true;
+                }
+
+            if (!placed)
+                bucket[0].filename[EDFS_DIR_BUCKET_OVERFLOW] = 1;
+        }
+
+        if (!placed)
+            return -ENOMSG;
+    }
+
+    return 0;
+}
+
+/* Converts classic directory @dir to the hashed format, rehashing its
+ * entries. The buckets are written to newly allocated blocks before the
+ * inode is switched over and the old blocks are released, so @dir keeps
+ * its classic layout if this fails. The buckets are not journaled, so
+ * that the conversion does not pin a cache slot for each of them. The caller must hold the namespace
+ * lock exclusively.
+ */
+int
+edfs_dir_make_hashed(edfs_image_t *img, edfs_inode_t *dir)
+{
+    if (edfs_disk_inode_is_hashed(&dir->inode))
+        return 0;
+
+    const uint16_t BLK_SIZE = img->sb.block_size;
+    const int n_slots = edfs_get_n_dir_entries_per_block(&img->sb);
+    const uint32_t n_buckets = edfs_get_n_dir_buckets(&img->sb);
+
+    edfs_dir_entry_t *entries = malloc(EDFS_MAX_DIR_ENTRIES * sizeof(edfs_dir_entry_t));
+    edfs_dir_entry_t *buckets = calloc((size_t)n_buckets * n_slots,
+                                       sizeof(edfs_dir_entry_t));
+    bool *used = calloc(n_buckets, sizeof(bool));
+    if (!entries || !buckets || !used)
+    {
+        free(entries);
+        free(buckets);
+        free(used);
+        return -ENOMEM;
+    }
+
+    edfs_dir_iter_t it;
+    edfs_dir_entry_t *entry;
+    int n = 0;
+    int ret;
+
+    edfs_dir_iter_init(&it, img, dir);
+    while ((ret = edfs_dir_iter_next(&it, &entry, NULL)) > 0)
+        if (!edfs_dir_entry_is_empty(entry))
+            entries[n++] = *entry;
+
+    if (ret == 0)
+        ret = edfs_dir_hash_entries(&img->sb, entries, n, buckets, used);
+
+    edfs_inode_t hashed = *dir;
+    hashed.inode.flags |= EDFS_INODE_FLAG_HASHED;
+    for (int i = 0; i < EDFS_INODE_N_DIRECT_BLOCKS; i++)
+        hashed.inode.direct[i] = EDFS_BLOCK_INVALID;
+    hashed.inode.indirect = EDFS_BLOCK_INVALID;
+
+    for (uint32_t b = 0; b < n_buckets && ret == 0; b++)
+    {
+        if (!used[b])
+            continue;
+
+        if (b >= EDFS_INODE_N_DIRECT_BLOCKS)
+            ret = edfs_inode_alloc_indirect(img, &hashed);
+
+        edfs_block_t block;
+        if (ret == 0)
+            ret = edfs_get_new_block(img, &block);
+        if (ret < 0)
+            break;
+
+        /* Nothing refers to the new buckets until the inode is switched
+         * over, so they are written like data rather than pinned; a
+         * commit writes them back before the inode.
+         */
+        ret = edfs_cache_write(img, block, &buckets[b * n_slots], 0,
+                               BLK_SIZE, EDFS_SITE_DIR);
+        if (ret >= 0)
+            ret = edfs_inode_set_blocks(img, &hashed, b, 1, block);
+        if (ret < 0)
+        {
+            edfs_cache_forget(img, block);
+            edfs_bitmap_clear(img, block);
+        }
+    }
+
+    /* Without a journal the buckets must be on disk before the inode
+     * refers to them. With one, the commit of the inode takes care of it.
+     */
+    if (ret == 0 && !img->journal)
+        ret = edfs_cache_flush(img);
+    if (ret == 0)
+        ret = edfs_bitmap_flush(img);
+    if (ret == 0)
+        ret = edfs_write_inode(img, &hashed);
+
+    if (ret < 0)
+    {
+        /* @dir is still as it was, drop whatever was built. */
+        edfs_inode_free_blocks(img, &hashed, 0);
+        edfs_inode_forget_map(img, dir->inumber);
+    }
+    else
+    {
+        /* A classic directory only has direct blocks. */
+        edfs_block_t old[EDFS_INODE_N_DIRECT_BLOCKS];
+        for (int i = 0; i < EDFS_INODE_N_DIRECT_BLOCKS; i++)
+        {
+            old[i] = dir->inode.direct[i];
+            if (old[i] != EDFS_BLOCK_INVALID)
+                edfs_cache_forget(img, old[i]);
+        }
+        edfs_bitmap_clear_blocks(img, old, EDFS_INODE_N_DIRECT_BLOCKS);
+        *dir = hashed;
+        ret = edfs_bitmap_flush(img);
+    }
+
+    free(entries);
+    free(buckets);
+    free(used);
+
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * Path resolution and directory entries
+ */
+
+/* 
+ * Checks if file or folder names are valid
+ */
+int edfs_check_filename(const char *name)
+{
+    if (name == NULL)
+        return -EINVAL;
+
+    size_t len = strlen(name);
+
+    if (len == 0) {
+        return -EINVAL;
+    } else if (len > 59) {
+        return -ENAMETOOLONG;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        char curr_char = name[i];
+        if (!(isalpha(curr_char) ||
+              isdigit(curr_char) ||
+              curr_char == ' ' || 
+              curr_char == '.'))
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Finds the slot for a new entry @name in @dir, continuing a full
+ * classic directory in the hashed format.
+ */
+static int
+edfs_dir_reserve_slot(edfs_image_t *img, edfs_inode_t *dir, const char *name,
+                      bool absent, uint32_t *off)
+{
+    int ret = edfs_dir_find_free_slot(img, dir, name, absent, off);
+
+    if (ret == -ENOMSG && !edfs_disk_inode_is_hashed(&dir->inode))
+    {
+        ret = edfs_dir_make_hashed(img, dir);
+        if (ret == 0)
+            ret = edfs_dir_find_free_slot(img, dir, name, absent, off);
+    }
+
+    return ret;
+}
+
+static int
+edfs_dir_write_entry(edfs_image_t *img, edfs_inode_t *dir, const char *name,
+                     edfs_inumber_t inumber, uint32_t off)
+{
+    edfs_dir_entry_t tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.inumber = inumber;
+    strcpy(tmp.filename, name);
+
+    int ret = edfs_write_inode_data(img, dir, &tmp, sizeof(tmp), off, NULL);
+    if (ret != sizeof(tmp)) {
+        edfs_dcache_invalidate(img, dir->inumber, name);
+        return ret < 0 ? ret : -EIO;
+    }
+
+    edfs_dcache_insert(img, dir->inumber, name, inumber);
+
+    return 0;
+}
+
+int
+edfs_add_dir_entry(edfs_image_t *img, edfs_inode_t *inode,
+                   const char *name, edfs_inumber_t inumber)
+{
+    int ret = edfs_check_filename(name);
+    if (ret != 0)
+        return ret;
+
+    uint32_t entry_off;
+    ret = edfs_dir_reserve_slot(img, inode, name, false, &entry_off);
+    if (ret < 0)
+        return ret;
+
+    return edfs_dir_write_entry(img, inode, name, inumber, entry_off);
+}
+
+/* Creates a new, empty inode of @type and enters it as @name in @dir,
+ * the new inode is left in @inode. The duplicate check and the search
+ * for a free slot share one pass over @dir, and the inode is only
+ * allocated once that slot is known, so a failed create leaves nothing
+ * behind. The caller must hold the namespace lock exclusively and
+ * should wrap the call in a journal transaction.
+ */
+int
+edfs_dir_create(edfs_image_t *img, edfs_inode_t *dir, const char *name,
+                edfs_inode_type_t type, edfs_inode_t *inode)
+{
+    int ret = edfs_check_filename(name);
+    if (ret != 0)
+        return ret;
+
+    /* A create is normally preceded by a failed lookup of @name, which
+     * left a negative entry; the scan for a duplicate is then skipped.
+     */
+    edfs_inumber_t cached;
+    bool absent = false;
+    if (edfs_dcache_lookup(img, dir->inumber, name, &cached))
+    {
+        if (cached != 0)
+            return -EEXIST;
+        absent = true;
+    }
+
+    uint32_t entry_off;
+    ret = edfs_dir_reserve_slot(img, dir, name, absent, &entry_off);
+    if (ret < 0)
+        return ret;
+
+    ret = edfs_new_inode(img, inode, type);
+    if (ret != 0)
+        return ret;
+
+    ret = edfs_write_inode(img, inode);
+    if (ret < 0)
+        return ret;
+
+    ret = edfs_dir_write_entry(img, dir, name, inode->inumber, entry_off);
+    if (ret < 0)
+        edfs_clear_inode(img, inode);
+
+    return ret;
+}
+
+int
+edfs_remove_dir_entry(edfs_image_t *img, edfs_inode_t *inode, const char *name) 
+{
+    edfs_dir_entry_t entry;
+    uint32_t off;
+
+    int ret = edfs_dir_lookup(img, inode, name, &entry, &off);
+    if (ret < 0)
+        return ret;
+    else if (ret == 0)
+        return -ENOENT;
+
+    edfs_dcache_invalidate(img, inode->inumber, name);
+
+    // clear entry and write
+    edfs_dir_entry_t tmp;
+    memset(&tmp, 0, sizeof(tmp));
+    ret = edfs_write_inode_data(img, inode, &tmp, sizeof(tmp), off, NULL);
+    if (ret < 0)
+        return ret;
+    else if (ret == 0)
+        return -EIO;
+
+    return 0;
+}
+
+/*
+ * returns negative on error, 1 if the directory has no entries and 0
+ * otherwise
+*/
+int edfs_dir_is_empty(edfs_image_t *img, edfs_inode_t *inode)
+{
+    edfs_dir_iter_t it;
+    edfs_dir_entry_t *entry;
+    int ret;
+
+    edfs_dir_iter_init(&it, img, inode);
+    while ((ret = edfs_dir_iter_next(&it, &entry, NULL)) > 0)
+    {
+        if (!edfs_dir_entry_is_empty(entry))
+            return 0;
+    }
+
+    if (ret < 0)
+        return ret;
+
+    return 1;
+}
+
+/* Searches the file system hierarchy to find the inode for
+ * the given path. Returns true if the operation succeeded.
+ */
+bool
+edfs_find_inode(edfs_image_t *img,
+                const char *path,
+                edfs_inode_t *inode)
+{
+  if (strlen(path) == 0 || path[0] != '/')
+    return false;
+
+  edfs_inode_t current_inode;
+  edfs_read_root_inode(img, &current_inode);
+
+  while (path && (path = strchr(path, '/')))
+    {
+      /* Ignore path separator */
+      while (*path == '/')
+        path++;
+
+      /* Find end of new component */
+      char *end = strchr(path, '/');
+      if (!end)
+        {
+          int len = strnlen(path, PATH_MAX);
+          if (len > 0)
+            end = (char *)&path[len];
+          else
+            {
+              /* We are done: return current entry. */
+              *inode = current_inode;
+              return true;
+            }
+        }
+
+      /* Verify length of component is not larger than maximum allowed
+       * filename size.
+       */
+      int len = end - path;
+      if (len >= (int)EDFS_FILENAME_SIZE)
+        return false;
+
+      /* Within the directory pointed to by parent_inode, find the
+       * inode number for path, len.
+       */
+      edfs_dir_entry_t direntry = { 0, };
+      strncpy(direntry.filename, path, len);
+      direntry.filename[len] = 0;
+
+      edfs_inumber_t cached;
+      if (direntry.filename[0] != 0 &&
+          edfs_dcache_lookup(img, current_inode.inumber,
+                             direntry.filename, &cached))
+        {
+          if (cached == 0)
+            return false;
+
+          current_inode.inumber = cached;
+          edfs_read_inode(img, &current_inode);
+        }
+      else if (direntry.filename[0] != 0)
+        {
+          edfs_dir_entry_t found_entry;
+          int ret = edfs_dir_lookup(img, &current_inode, direntry.filename,
+                                    &found_entry, NULL);
+          if (ret < 0)
+              return false;
+
+          bool found = ret > 0;
+          if (found)
+              direntry.inumber = found_entry.inumber;
+
+          /* Remember the outcome, including a miss. */
+          edfs_dcache_insert(img, current_inode.inumber, direntry.filename,
+                             found ? direntry.inumber : 0);
+
+          if (found)
+            {
+              /* Found what we were looking for, now get our new inode. */
+              current_inode.inumber = direntry.inumber;
+              edfs_read_inode(img, &current_inode);
+            }
+          else
+            return false;
+        }
+
+      path = end;
+    }
+
+  *inode = current_inode;
+
+  return true;
+}
+
+static inline void
+drop_trailing_slashes(char *path_copy)
+{
+  int len = strlen(path_copy);
+  while (len > 0 && path_copy[len-1] == '/')
+    {
+      path_copy[len-1] = 0;
+      len--;
+    }
+}
+
+/* Return the parent inode, for the containing directory of the inode (file or
+ * directory) specified in @path. Returns 0 on success, error code otherwise.
+ */
+int
+edfs_get_parent_inode(edfs_image_t *img,
+                      const char *path,
+                      edfs_inode_t *parent_inode)
+{
+  int res;
+  char *path_copy = strdup(path);
+
+  drop_trailing_slashes(path_copy);
+
+  if (strlen(path_copy) == 0)
     {
-      fprintf(stderr, "error: file '%s': EdFS magic number mismatch.\n",
-              img->filename);
-      return false;
+      res = -EINVAL;
+      goto out;
     }
 
-  /* Simple sanity check of size of file system image. */
-  struct stat buf;
+  /* Extract parent component */
+  char *sep = strrchr(path_copy, '/');
+  if (!sep)
+    {
+      res = -EINVAL;
+      goto out;
+    }
 
-  if (fstat(img->fd, &buf) < 0)
+  if (path_copy == sep)
     {
-      fprintf(stderr, "error: file '%s': stat failed? (%s)\n",
-              img->filename, strerror(errno));
-      return false;
+      /* The parent is the root directory. */
+      edfs_read_root_inode(img, parent_inode);
+      res = 0;
+      goto out;
     }
 
-  if (buf.st_size < edfs_get_size(&img->sb))
+  /* If not the root directory for certain, start a usual search. */
+  *sep = 0;
+  char *dirname = path_copy;
+
+  if (!edfs_find_inode(img, dirname, parent_inode))
     {
-      fprintf(stderr, "error: file '%s': file system size larger than image size.\n",
-              img->filename);
-      return false;
+      res = -ENOENT;
+      goto out;
     }
 
-  /* FIXME: implement more sanity checks? */
+  res = 0;
 
-  return true;
+out:
+  free(path_copy);
+
+  return res;
 }
 
+/* Resolves the directory that is to contain @path into @parent and
+ * copies the last component of @path into @name. Unlike
+ * edfs_get_parent_inode() and edfs_get_basename(), nothing is
+ * allocated and the path is walked only once.
+ */
 int
-edfs_get_new_block(edfs_image_t *img, edfs_block_t *block) 
+edfs_find_parent(edfs_image_t *img, const char *path, edfs_inode_t *parent,
+                 char name[EDFS_FILENAME_SIZE])
 {
-    uint8_t bitmap_data = 0x00;
-    edfs_block_t data_blk_start =
-        (img->sb.inode_table_start + img->sb.inode_table_size) / img->sb.block_size;
-    for (edfs_block_t i = data_blk_start; i < img->sb.n_blocks; i++)
+  size_t end = strlen(path);
+  while (end > 0 && path[end - 1] == '/')
+    end--;
+
+  size_t start = end;
+  while (start > 0 && path[start - 1] != '/')
+    start--;
+
+  if (start == 0 || start == end)
+    return -EINVAL;
+  else if (end - start >= EDFS_FILENAME_SIZE)
+    return -ENAMETOOLONG;
+
+  memcpy(name, path + start, end - start);
+  name[end - start] = 0;
+
+  int ret = edfs_check_filename(name);
+  if (ret != 0)
+    return ret;
+
+  if (start == 1)
+    edfs_read_root_inode(img, parent);
+  else
     {
-        uint32_t byte_off = i / 8;
-        int bit_off = i % 8;
-        if (bit_off == 0)
-        {
-            ssize_t ret = pread(img->fd, &bitmap_data, 1, byte_off);
-            if (ret < 0)
-                return -errno;
-            else if (ret != 1)
-                return -EIO;
-        }
+      char dirname[PATH_MAX];
+      if (start > sizeof(dirname))
+        return -ENAMETOOLONG;
 
-        if (!(bitmap_data & ((uint8_t)1 << bit_off)))
-        {
-            *block = i;
-            int ret = edfs_bitmap_set(img, *block);
-            if (ret != 0)
-                return ret;
-            return 0;
-        }
+      memcpy(dirname, path, start - 1);
+      dirname[start - 1] = 0;
+
+      if (!edfs_find_inode(img, dirname, parent))
+        return -ENOENT;
     }
 
-    return -ENOSPC; /* all blocks are full */
+  if (!edfs_disk_inode_is_directory(&parent->inode))
+    return -ENOTDIR;
+
+  return 0;
 }
 
-edfs_image_t *
-edfs_image_open(const char *filename, bool read_super)
+/* Separates the basename (the actual name of the file) from the path.
+ * The return value must be freed.
+ */
+char *
+edfs_get_basename(const char *path)
 {
-  edfs_image_t *img = malloc(sizeof(edfs_image_t));
+  char *res = NULL;
+  char *path_copy = strdup(path);
 
-  img->filename = filename;
-  img->fd = open(img->filename, O_RDWR);
-  if (img->fd < 0)
+  drop_trailing_slashes(path_copy);
+
+  if (strlen(path_copy) == 0)
     {
-      fprintf(stderr, "error: could not open file '%s': %s\n",
-              img->filename, strerror(errno));
-      edfs_image_close(img);
-      return NULL;
+      res = NULL;
+      goto out;
     }
 
-  /* Load super block into memory. */
-  if (read_super && !edfs_read_super(img))
+  /* Find beginning of basename. */
+  char *sep = strrchr(path_copy, '/');
+  if (!sep)
     {
-      edfs_image_close(img);
-      return NULL;
+      res = NULL;
+      goto out;
     }
 
-  return img;
+  res = strdup(sep + 1);
+
+out:
+  free(path_copy);
+
+  return res;
 }
 
 /*
- * Inode-related routine helper functions
+ * Bitmap related routines
+ *
+ * All operations work on the in-memory copy loaded at edfs_image_open()
+ * time. Modified bytes are only tracked as a dirty range and are written
+ * back in one go by edfs_bitmap_flush(). The bitmap, hint and dirty
+ * range are protected by img->alloc_lock.
  */
 
-/*
- * read entire blk into blk_buf, assume blk_buf is large enough
- * trailing bytes are 0 padded
+static inline void
+edfs_bitmap_mark_dirty(edfs_image_t *img, uint32_t byte_off)
+{
+    if (byte_off < img->bitmap_dirty_lo)
+        img->bitmap_dirty_lo = byte_off;
+    if (byte_off + 1 > img->bitmap_dirty_hi)
+        img->bitmap_dirty_hi = byte_off + 1;
+}
+
+/* Load 64 bits of the bitmap such that bit n of the result corresponds
+ * to block (word * 64 + n), regardless of host byte order.
  */
-static int edfs_read_inode_data_blk(edfs_image_t *img, edfs_inode_t *inode,
-                                    uint32_t id, void *buf)
+static inline uint64_t
+edfs_bitmap_load_word(const uint8_t *bitmap, uint32_t word)
 {
-    const uint16_t BLK_SIZE = img->sb.block_size;
+    uint64_t w;
+    memcpy(&w, bitmap + word * sizeof(w), sizeof(w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
 
-    if (id > EDFS_INODE_N_DIRECT_BLOCKS &&
-            id >= (inode->inode.size + BLK_SIZE - 1) / BLK_SIZE)
-        return -EINVAL;
-    
-    edfs_block_t block;
-    if (id < EDFS_INODE_N_DIRECT_BLOCKS) {
-        block = inode->inode.direct[id];
-    }
-    else {
-        edfs_block_t indirect_block = inode->inode.indirect;
-        if (indirect_block == EDFS_BLOCK_INVALID)
-            return -EIO;
-        off_t indirect_block_off = edfs_get_block_offset(&img->sb, indirect_block);
+/* Returns the first bit in [start, end) that is clear in @bitmap and,
+ * unless it is NULL, in @reserved; end if there is none.
+ */
+static uint32_t
+edfs_bitmap_find_clear(const uint8_t *bitmap, const uint8_t *reserved,
+                       uint32_t start, uint32_t end)
+{
+    for (uint32_t word = start / 64; word * 64 < end; word++)
+    {
+        uint64_t free_bits = ~edfs_bitmap_load_word(bitmap, word);
+        if (reserved)
+            free_bits &= ~edfs_bitmap_load_word(reserved, word);
+        if (word == start / 64)
+            free_bits &= ~UINT64_C(0) << (start % 64);
 
-        edfs_block_t indirect_blocks[EDFS_MAX_BLOCK_SIZE / sizeof(edfs_block_t)];
-        int indirect_blocks_size = img->sb.block_size;
+        if (free_bits)
+        {
+            uint32_t bit = word * 64 + __builtin_ctzll(free_bits);
+            return bit < end ? bit : end;
+        }
+    }
 
-        ssize_t ret = pread(img->fd, indirect_blocks, indirect_blocks_size, indirect_block_off);
-        if (ret != indirect_blocks_size)
-            return -EIO; 
+    return end;
+}
 
-        block = indirect_blocks[id - EDFS_INODE_N_DIRECT_BLOCKS];
-    }
+static inline void
+edfs_bitmap_update_locked(edfs_image_t *img, edfs_block_t block, bool used)
+{
+    uint32_t byte_off = block / 8;
 
-    if (block == EDFS_BLOCK_INVALID)
-        return 0;
+    if (used)
+        img->bitmap[byte_off] |= ((uint8_t)1) << (block % 8);
+    else
+        img->bitmap[byte_off] &= ~(((uint8_t)1) << (block % 8));
 
-    off_t off = edfs_get_block_offset(&img->sb, block);
-    if (pread(img->fd, buf, BLK_SIZE, off) != BLK_SIZE)
-        return -errno; 
+    edfs_bitmap_mark_dirty(img, byte_off);
+}
 
-    return BLK_SIZE;
+static inline bool
+edfs_bitmap_test(const uint8_t *bitmap, uint32_t bit)
+{
+    return bitmap[bit / 8] & (1 << (bit % 8));
 }
 
-static int edfs_write_inode_data_blk(edfs_image_t *img, edfs_inode_t *inode,
-                                    uint32_t id, const void *buf)
+/* Returns whether data block @block is neither used nor reserved. */
+static inline bool
+edfs_bitmap_block_free(edfs_image_t *img, uint32_t block)
 {
-    const uint16_t BLK_SIZE = img->sb.block_size;
+    return !edfs_bitmap_test(img->bitmap, block) &&
+        !edfs_bitmap_test(img->bitmap_reserved, block);
+}
 
-    if (id > EDFS_INODE_N_DIRECT_BLOCKS &&
-            id >= (inode->inode.size + BLK_SIZE - 1) / BLK_SIZE)
+/* Allocates a run of up to @want + @extra physically contiguous free
+ * data blocks. The first @want blocks of the run are marked as used,
+ * the others are only reserved in memory, see edfs_bitmap_claim(). The
+ * run starts at @goal if that block is free. Otherwise the search
+ * starts at the block following the previous allocation and wraps
+ * around to the start of the data area. The first block of the run is
+ * stored in *block; returns the length of the run.
+ */
+static int
+edfs_bitmap_alloc(edfs_image_t *img, uint32_t want, uint32_t extra,
+                  edfs_block_t goal, edfs_block_t *block)
+{
+    if (!img->bitmap)
+        return -EIO;
+    if (want == 0)
         return -EINVAL;
 
-    edfs_block_t block;
-    if (id < EDFS_INODE_N_DIRECT_BLOCKS) {
-        block = inode->inode.direct[id];
-
-        // add block if necessary 
-        if (block == EDFS_BLOCK_INVALID) {
-            int ret = edfs_get_new_block(img, &block);
-            if (ret != 0)
-                return ret;
-
-            inode->inode.direct[id] = block;
-            ret = edfs_write_inode(img, inode);
-            if (ret < 0) {
-                /* we might as well try to free the newly allocated block */
-                edfs_bitmap_clear(img, block);
-                return ret;
-            }
-        }
-    }
-    else {
-        edfs_block_t indirect_block = inode->inode.indirect;
-        if (indirect_block == EDFS_BLOCK_INVALID)
-            return -EIO; // TODO dit kan ook wel eens mis gaan, maar nu nog niet
-        off_t indirect_block_off = edfs_get_block_offset(&img->sb, indirect_block);
-
-        edfs_block_t indirect_blocks[EDFS_MAX_BLOCK_SIZE / sizeof(edfs_block_t)];
-        int indirect_blocks_size = img->sb.block_size;
+    const uint32_t data_start = edfs_get_data_block_start(&img->sb);
+    const uint32_t end = img->sb.n_blocks;
 
-        ssize_t ret = pread(img->fd, indirect_blocks, indirect_blocks_size, indirect_block_off);
-        if (ret != indirect_blocks_size)
-            return -EIO; 
+    pthread_mutex_lock(&img->alloc_lock);
 
-        block = indirect_blocks[id - EDFS_INODE_N_DIRECT_BLOCKS];
+    uint32_t hint = img->bitmap_hint;
+    if (hint < data_start || hint >= end)
+        hint = data_start;
 
-        // add block if necessary
-        if (block == EDFS_BLOCK_INVALID) {
-            int iret = edfs_get_new_block(img, &block);
-            if (iret != 0)
-                return iret;
-            
-            indirect_blocks[id - EDFS_INODE_N_DIRECT_BLOCKS] = block;
-            ret = pwrite(img->fd, indirect_blocks, indirect_blocks_size, indirect_block_off);
-            if (ret != indirect_blocks_size)
+    uint32_t found;
+    if (goal >= data_start && goal < end && edfs_bitmap_block_free(img, goal))
+        found = goal;
+    else
+    {
+        found = edfs_bitmap_find_clear(img->bitmap, img->bitmap_reserved,
+                                       hint, end);
+        if (found == end)
+        {
+            found = edfs_bitmap_find_clear(img->bitmap, img->bitmap_reserved,
+                                           data_start, hint);
+            if (found == hint)
             {
-                edfs_bitmap_clear(img, block);
-                return ret;
+                pthread_mutex_unlock(&img->alloc_lock);
+                return -ENOSPC; /* all blocks are full */
             }
         }
     }
 
-    off_t off = edfs_get_block_offset(&img->sb, block);
-    if (pwrite(img->fd, buf, BLK_SIZE, off) != BLK_SIZE)
-        return -errno; 
+    uint32_t n = 0;
+    while (n < want + extra && found + n < end &&
+           edfs_bitmap_block_free(img, found + n))
+    {
+        uint32_t b = found + n;
 
-    return BLK_SIZE;
-}
+        if (n < want)
+            edfs_bitmap_update_locked(img, b, true);
+        else
+            img->bitmap_reserved[b / 8] |= (uint8_t)1 << (b % 8);
+        n++;
+    }
 
-/*
- * Inode-related routines
- */
+    *block = found;
+    img->bitmap_hint = found + n;
+
+    pthread_mutex_unlock(&img->alloc_lock);
 
+    return n;
+}
 
-/* Read inode from disk, inode->inumber must be set to the inode number
- * to be read from disk.
+/* Allocates a run of up to @want physically contiguous free data blocks
+ * and marks them as used, see edfs_bitmap_alloc().
  */
 int
-edfs_read_inode(edfs_image_t *img,
-                edfs_inode_t *inode)
+edfs_get_new_blocks(edfs_image_t *img, uint32_t want, edfs_block_t goal,
+                    edfs_block_t *block)
 {
-  if (inode->inumber >= img->sb.inode_table_n_inodes)
-    return -ENOENT;
+    return edfs_bitmap_alloc(img, want, 0, goal, block);
+}
 
-  off_t offset = edfs_get_inode_offset(&img->sb, inode->inumber);
-  return pread(img->fd, &inode->inode, sizeof(edfs_disk_inode_t), offset);
+/* Marks the @n reserved blocks starting at @start as used. */
+static void
+edfs_bitmap_claim(edfs_image_t *img, edfs_block_t start, uint32_t n)
+{
+    pthread_mutex_lock(&img->alloc_lock);
+    for (uint32_t b = start; b < (uint32_t)start + n; b++)
+    {
+        img->bitmap_reserved[b / 8] &= ~((uint8_t)1 << (b % 8));
+        edfs_bitmap_update_locked(img, b, true);
+    }
+    pthread_mutex_unlock(&img->alloc_lock);
 }
 
-/* Reads the root inode from disk. @inode must point to a valid
- * inode structure.
- */
-int
-edfs_read_root_inode(edfs_image_t *img,
-                     edfs_inode_t *inode)
+/* Drops the reservation of the @n blocks starting at @start. */
+static void
+edfs_bitmap_unreserve(edfs_image_t *img, edfs_block_t start, uint32_t n)
 {
-  inode->inumber = img->sb.root_inumber;
-  return edfs_read_inode(img, inode);
+    pthread_mutex_lock(&img->alloc_lock);
+    for (uint32_t b = start; b < (uint32_t)start + n; b++)
+        img->bitmap_reserved[b / 8] &= ~((uint8_t)1 << (b % 8));
+    pthread_mutex_unlock(&img->alloc_lock);
 }
 
-/* Writes @inode to disk, inode->inumber must be set to a valid
- * inode number to which the inode will be written.
- */
+/* Allocates a single free data block and marks it as used. */
 int
-edfs_write_inode(edfs_image_t *img, edfs_inode_t *inode)
+edfs_get_new_block(edfs_image_t *img, edfs_block_t *block)
 {
-  if (inode->inumber >= img->sb.inode_table_n_inodes)
-    return -ENOENT;
+    int ret = edfs_get_new_blocks(img, 1, EDFS_BLOCK_INVALID, block);
 
-  off_t offset = edfs_get_inode_offset(&img->sb, inode->inumber);
-  return pwrite(img->fd, &inode->inode, sizeof(edfs_disk_inode_t), offset);
+    return ret < 0 ? ret : 0;
 }
 
-/* Clears the specified inode on disk, based on inode->inumber.
- */
 int
-edfs_clear_inode(edfs_image_t *img, edfs_inode_t *inode)
+edfs_bitmap_clear(edfs_image_t *img, edfs_block_t block)
 {
-  if (inode->inumber >= img->sb.inode_table_n_inodes)
-    return -ENOENT;
+    //check if block number is valid
+    if (block >= img->sb.n_blocks)
+        return -EINVAL;
+    if (!img->bitmap)
+        return -EIO;
 
-  off_t offset = edfs_get_inode_offset(&img->sb, inode->inumber);
+    pthread_mutex_lock(&img->alloc_lock);
+    edfs_bitmap_update_locked(img, block, false);
+    pthread_mutex_unlock(&img->alloc_lock);
 
-  edfs_disk_inode_t disk_inode;
-  memset(&disk_inode, 0, sizeof(edfs_disk_inode_t));
-  return pwrite(img->fd, &disk_inode, sizeof(edfs_disk_inode_t), offset);
+    return 0;
 }
 
-/* Finds a free inode and returns the inumber. NOTE: this does NOT
- * allocate the inode. Only after a valid inode has been written
- * to this inumber, this inode is allocated in the table.
+/* Marks the @n blocks in @blocks as free in a single pass under the
+ * allocation lock. Invalid block numbers are skipped.
  */
-edfs_inumber_t
-edfs_find_free_inode(edfs_image_t *img)
+void
+edfs_bitmap_clear_blocks(edfs_image_t *img, const edfs_block_t *blocks,
+                         uint32_t n)
 {
-  edfs_inode_t inode = { .inumber = 1 };
+    if (!img->bitmap || n == 0)
+        return;
+
+    pthread_mutex_lock(&img->alloc_lock);
+    for (uint32_t i = 0; i < n; i++)
+        if (blocks[i] != EDFS_BLOCK_INVALID && blocks[i] < img->sb.n_blocks)
+            edfs_bitmap_update_locked(img, blocks[i], false);
+    pthread_mutex_unlock(&img->alloc_lock);
+}
 
-  while (inode.inumber < img->sb.inode_table_n_inodes)
-    {
-      if (edfs_read_inode(img, &inode) > 0 &&
-          inode.inode.type == EDFS_INODE_TYPE_FREE)
-        return inode.inumber;
+int
+edfs_bitmap_set(edfs_image_t *img, edfs_block_t block)
+{
+    //check if block number is valid
+    if (block >= img->sb.n_blocks)
+        return -EINVAL;
+    if (!img->bitmap)
+        return -EIO;
 
-      inode.inumber++;
-    }
+    pthread_mutex_lock(&img->alloc_lock);
+    edfs_bitmap_update_locked(img, block, true);
+    pthread_mutex_unlock(&img->alloc_lock);
 
-  return 0;
+    return 0;
 }
 
-/* Create a new inode. Searches for a free inode in the inode table (returns
- * -ENOSPC if the inode table is full). @inode is initialized accordingly.
+/* Writes the modified part of the in-memory bitmap back to the image
+ * with a single pwrite. With a journal, the modified part is written by
+ * the commit of the current transaction instead.
  */
 int
-edfs_new_inode(edfs_image_t *img,
-               edfs_inode_t *inode,
-               edfs_inode_type_t type)
+edfs_bitmap_flush(edfs_image_t *img)
 {
-  edfs_inumber_t inumber;
+    if (!img->bitmap || img->journal)
+        return 0;
 
-  inumber = edfs_find_free_inode(img);
-  if (inumber == 0)
-    return -ENOSPC;
+    pthread_mutex_lock(&img->alloc_lock);
 
-  memset(inode, 0, sizeof(edfs_inode_t));
-  inode->inumber = inumber;
-  inode->inode.type = type;
+    int res = 0;
+    uint32_t lo = img->bitmap_dirty_lo;
+    size_t len = lo < img->bitmap_dirty_hi ? img->bitmap_dirty_hi - lo : 0;
 
-  return 0;
+    /* A mapped bitmap is modified in place. */
+    if (len > 0 && !img->map)
+    {
+        ssize_t ret = edfs_image_pwrite(img, img->bitmap + lo, len,
+                                        img->sb.bitmap_start + lo);
+        edfs_stats_io(img, EDFS_SITE_BITMAP, true, ret);
+        if (ret < 0)
+            res = -errno;
+        else if ((size_t)ret != len)
+            res = -EIO;
+    }
+
+    if (res == 0)
+    {
+        img->bitmap_dirty_lo = UINT32_MAX;
+        img->bitmap_dirty_hi = 0;
+    }
+
+    pthread_mutex_unlock(&img->alloc_lock);
+
+    return res;
 }
 
-int
-edfs_read_inode_data(edfs_image_t *img,
-                     edfs_inode_t *inode,
-                     void *buf,
-                     uint32_t size,
-                     uint32_t off)
+/*
+ * Extent holds
+ *
+ * edfuse_read_buf() describes the data of a file as extents of the
+ * image file, which libfuse only reads once the inode lock has been
+ * dropped. A block freed in the meantime must not be reallocated and
+ * rewritten before then, or the reply would carry another file's data.
+ * So while a hold on an inode is set, blocks freed from it are cleared
+ * in the bitmap, but stay reserved in memory until every hold set
+ * before they were freed has been cleared. The holds and the list of
+ * freed blocks are protected by img->hold_lock.
+ */
+
+/* Returns whether a hold is set on @inumber; with @epoch, only a hold
+ * set before that epoch counts. Must be called with img->hold_lock held.
+ */
+static bool
+edfs_extent_held_locked(edfs_image_t *img, edfs_inumber_t inumber,
+                        uint64_t epoch)
 {
-    // TODO dingen verifiereren 
+    for (edfs_extent_hold_t *hold = img->holds; hold; hold = hold->next)
+        if (hold->active && hold->inumber == inumber &&
+            (epoch == 0 || hold->epoch < epoch))
+            return true;
 
-    const uint16_t BLK_SIZE = img->sb.block_size;
+    return false;
+}
 
-    for (uint32_t pos = off; pos < off + size; )
-    {
-        uint32_t blk_id = pos / BLK_SIZE;
-        uint32_t blk_off = pos % BLK_SIZE;
-        uint32_t blk_size = (off + size) - pos;
-        if (blk_size > BLK_SIZE - blk_off)
-            blk_size = BLK_SIZE - blk_off;
+/* Drops the reservation of freed blocks that are no longer held. Must
+ * be called with img->hold_lock held.
+ */
+static void
+edfs_freed_release_locked(edfs_image_t *img)
+{
+    edfs_freed_t **link = &img->freed;
 
-        char blk_buf[EDFS_MAX_BLOCK_SIZE];
-        int ret = edfs_read_inode_data_blk(img, inode, blk_id, blk_buf);
-        if (ret <= 0)
-            return ret;
+    while (*link)
+    {
+        edfs_freed_t *freed = *link;
+        if (edfs_extent_held_locked(img, freed->inumber, freed->epoch))
+        {
+            link = &freed->next;
+            continue;
+        }
 
-        memcpy((char *)buf + (pos - off), blk_buf + blk_off, blk_size);
+        pthread_mutex_lock(&img->alloc_lock);
+        for (uint32_t i = 0; i < freed->n_blocks; i++)
+        {
+            edfs_block_t b = freed->blocks[i];
+            img->bitmap_reserved[b / 8] &= ~((uint8_t)1 << (b % 8));
+        }
+        pthread_mutex_unlock(&img->alloc_lock);
 
-        pos += blk_size;
+        *link = freed->next;
+        free(freed);
     }
-
-    return size;
 }
 
-int
-edfs_write_inode_data(edfs_image_t *img,
-                     edfs_inode_t *inode,
-                     const void *buf,
-                     uint32_t size,
-                     uint32_t off)
+/* Marks the @n blocks in @blocks, data blocks just freed from inode
+ * @inumber, as free, see edfs_bitmap_clear_blocks(). If a hold is set
+ * on the inode, they remain reserved until it has been cleared; should
+ * there be no memory to remember them, until the image is closed.
+ */
+static void
+edfs_bitmap_release_blocks(edfs_image_t *img, edfs_inumber_t inumber,
+                           const edfs_block_t *blocks, uint32_t n)
 {
-    // TODO dingen verifiereren 
+    if (!img->bitmap || n == 0)
+        return;
 
-    const uint16_t BLK_SIZE = img->sb.block_size;
+    pthread_mutex_lock(&img->hold_lock);
 
-    for (uint32_t pos = off; pos < off + size; )
+    if (!edfs_extent_held_locked(img, inumber, 0))
     {
-        uint32_t blk_id = pos / BLK_SIZE;
-        uint32_t blk_off = pos % BLK_SIZE;
-        uint32_t blk_size = (off + size) - pos;
-        if (blk_size > BLK_SIZE - blk_off)
-            blk_size = BLK_SIZE - blk_off;
+        pthread_mutex_unlock(&img->hold_lock);
+        edfs_bitmap_clear_blocks(img, blocks, n);
+        return;
+    }
 
-        char blk_buf[EDFS_MAX_BLOCK_SIZE];
+    edfs_freed_t *freed = malloc(sizeof(edfs_freed_t) +
+                                 n * sizeof(edfs_block_t));
+    if (freed)
+    {
+        freed->inumber = inumber;
+        freed->epoch = ++img->hold_epoch;
+        freed->n_blocks = n;
+        memcpy(freed->blocks, blocks, n * sizeof(edfs_block_t));
+        freed->next = img->freed;
+        img->freed = freed;
+    }
 
-        int ret = edfs_read_inode_data_blk(img, inode, blk_id, blk_buf);
-        if (ret < 0)
-            return ret;
-        else if (ret == 0) /* block is not allocated */
-            memset(blk_buf, 0, BLK_SIZE);
+    pthread_mutex_lock(&img->alloc_lock);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        edfs_block_t b = blocks[i];
+        if (b == EDFS_BLOCK_INVALID || b >= img->sb.n_blocks)
+            continue;
 
-        memcpy(blk_buf + blk_off, (char *)buf + (pos - off), blk_size);
+        edfs_bitmap_update_locked(img, b, false);
+        img->bitmap_reserved[b / 8] |= (uint8_t)1 << (b % 8);
+    }
+    pthread_mutex_unlock(&img->alloc_lock);
 
-        ret = edfs_write_inode_data_blk(img, inode, blk_id, blk_buf);
-        if (ret <= 0)
-            return ret;
+    pthread_mutex_unlock(&img->hold_lock);
+}
 
+/* Returns a new hold for a thread of @img, which is not set. */
+edfs_extent_hold_t *
+edfs_extent_hold_new(edfs_image_t *img)
+{
+    edfs_extent_hold_t *hold = calloc(1, sizeof(edfs_extent_hold_t));
+    if (!hold)
+        return NULL;
 
-        pos += blk_size;
-    }
+    hold->img = img;
 
-    return size;
-}
+    pthread_mutex_lock(&img->hold_lock);
+    hold->next = img->holds;
+    img->holds = hold;
+    pthread_mutex_unlock(&img->hold_lock);
 
+    return hold;
+}
 
-int
-edfs_bitmap_clear(edfs_image_t *img, edfs_block_t block)
+void
+edfs_extent_hold_free(edfs_extent_hold_t *hold)
 {
-    //check if block number is valid
-    if (block >= img->sb.n_blocks)
-        return -EINVAL;
+    if (!hold)
+        return;
 
-    size_t byte_off = img->sb.bitmap_start + (block / 8);
-    int bit_off = block % 8;
+    edfs_image_t *img = hold->img;
 
-    uint8_t bitmap_data;
-    
-    ssize_t ret = pread(img->fd, &bitmap_data, 1, byte_off);
-    if (ret < 0)
-        return -errno;
-    else if (ret != 1)
-        return -EIO;
-    
-    bitmap_data &= ~(((uint8_t)1) << bit_off);
-    
-    ret = pwrite(img->fd, &bitmap_data, 1, byte_off);
-    if (ret < 0)
-        return -errno;
-    else if (ret != 1)
-        return -EIO;
+    pthread_mutex_lock(&img->hold_lock);
+    for (edfs_extent_hold_t **link = &img->holds; *link; link = &(*link)->next)
+        if (*link == hold)
+        {
+            *link = hold->next;
+            break;
+        }
+    edfs_freed_release_locked(img);
+    pthread_mutex_unlock(&img->hold_lock);
 
-    return 0;
+    free(hold);
 }
 
-int
-edfs_bitmap_set(edfs_image_t *img, edfs_block_t block)
+/* Sets @hold on inode @inumber, replacing what it was set on before.
+ * Must be called with the inode lock held, so that no block is freed
+ * from the inode between handing out its extents and setting the hold.
+ */
+void
+edfs_extent_hold_set(edfs_extent_hold_t *hold, edfs_inumber_t inumber)
 {
-    //check if block number is valid
-    if (block >= img->sb.n_blocks)
-        return -EINVAL;
+    edfs_image_t *img = hold->img;
+
+    pthread_mutex_lock(&img->hold_lock);
+    bool was_active = hold->active;
+    hold->inumber = inumber;
+    hold->epoch = img->hold_epoch;
+    hold->active = true;
+    if (was_active)
+        edfs_freed_release_locked(img);
+    pthread_mutex_unlock(&img->hold_lock);
+}
 
-    size_t byte_off = img->sb.bitmap_start + block / 8;
-    int bit_off = block % 8;
+/* Clears @hold once the extents handed out under it have been read. */
+void
+edfs_extent_hold_clear(edfs_extent_hold_t *hold)
+{
+    /* Only the owning thread changes the state of its hold. */
+    if (!hold->active)
+        return;
 
-    uint8_t bitmap_data;
-    
-    ssize_t ret = pread(img->fd, &bitmap_data, 1, byte_off);
-    if (ret < 0)
-        return -errno;
-    else if (ret != 1)
-        return -EIO;
-    
-    bitmap_data |= ((uint8_t)1) << bit_off;
-    
-    ret = pwrite(img->fd, &bitmap_data, 1, byte_off);
-    if (ret < 0)
-        return -errno;
-    else if (ret != 1)
-        return -EIO;
+    edfs_image_t *img = hold->img;
 
-    return 0;
+    pthread_mutex_lock(&img->hold_lock);
+    hold->active = false;
+    edfs_freed_release_locked(img);
+    pthread_mutex_unlock(&img->hold_lock);
 }
-
@@ -11,6 +11,147 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+/* How the image file is accessed. */
+typedef enum
+{
+  EDFS_IO_PREAD = 0,    /* pread/pwrite on the file descriptor */
+  EDFS_IO_MMAP,         /* the whole image is mapped into memory */
+  EDFS_IO_URING,        /* as EDFS_IO_PREAD, batches go through io_uring */
+} edfs_io_mode_t;
+
+/* One request of a batch of image I/O, see edfs_image_submit(). */
+#define EDFS_IO_REQ_MAX_IOV 3
+
+typedef struct
+{
+  struct iovec iov[EDFS_IO_REQ_MAX_IOV];
+  int n_iov;
+  off_t off;
+  bool write;
+  ssize_t res;          /* bytes transferred, or negative error code */
+} edfs_io_req_t;
+
+/* Number of blocks kept in the block cache of an opened image. */
+#define EDFS_CACHE_N_SLOTS 256
+
+/* The writeback thread writes dirty blocks back once one of them has
+ * been dirty for EDFS_WRITEBACK_AGE_MS, or as soon as a quarter of the
+ * cache is dirty. Runs of blocks that are adjacent on the image are
+ * written with a single call, of at most EDFS_WRITEBACK_MAX_RUN blocks.
+ */
+#define EDFS_WRITEBACK_AGE_MS 1000
+#define EDFS_WRITEBACK_MAX_RUN 64
+
+typedef struct edfs_cache edfs_cache_t;
+
+/* Number of decoded indirect blocks kept per opened image. */
+#define EDFS_BLKMAP_N_ENTRIES 16
+
+typedef struct edfs_blkmap edfs_blkmap_t;
+
+/* Geometry of the directory entry cache: number of hash sets and
+ * entries per set.
+ */
+#define EDFS_DCACHE_N_SETS 1024
+#define EDFS_DCACHE_N_WAYS 4
+
+typedef struct edfs_dcache edfs_dcache_t;
+
+typedef struct edfs_attr_cache edfs_attr_cache_t;
+
+/* Attributes of an inode as reported by getattr, see edfs-attr.c. */
+typedef struct
+{
+  uint8_t type;
+  uint32_t size;
+  uint32_t n_blocks;    /* blocks in use, including the indirect block */
+} edfs_attr_t;
+
+typedef struct edfs_tails edfs_tails_t;
+
+/* Submission queue depth of the io_uring backend. */
+#define EDFS_URING_DEPTH 64
+
+typedef struct edfs_uring edfs_uring_t;
+
+/* Size of a newly created metadata journal, in blocks. A group commit
+ * is done after EDFS_JOURNAL_MAX_OPS operations or when the previous
+ * one is more than EDFS_JOURNAL_COMMIT_INTERVAL seconds ago.
+ */
+#define EDFS_JOURNAL_N_BLOCKS 64
+#define EDFS_JOURNAL_MAX_OPS 32
+#define EDFS_JOURNAL_COMMIT_INTERVAL 5
+
+typedef struct edfs_journal edfs_journal_t;
+
+/* Extents of a file handed out to be read from the image later, and
+ * the blocks kept out of reuse meanwhile; see edfs_extent_hold_set().
+ */
+typedef struct edfs_extent_hold edfs_extent_hold_t;
+typedef struct edfs_freed edfs_freed_t;
+
+/* Kinds of image I/O counted separately by the statistics, named after
+ * what is read or written.
+ */
+typedef enum
+{
+  EDFS_SITE_SUPER = 0,
+  EDFS_SITE_INODE,
+  EDFS_SITE_BITMAP,
+  EDFS_SITE_INDIRECT,
+  EDFS_SITE_DATA,
+  EDFS_SITE_DIR,
+  EDFS_SITE_JOURNAL,
+  EDFS_N_SITES
+} edfs_io_site_t;
+
+/* Event counters. */
+typedef enum
+{
+  EDFS_STAT_CACHE_HIT = 0,
+  EDFS_STAT_CACHE_MISS,
+  EDFS_STAT_CACHE_EVICT,
+  EDFS_STAT_DCACHE_HIT,
+  EDFS_STAT_DCACHE_MISS,
+  EDFS_STAT_ATTR_HIT,
+  EDFS_STAT_ATTR_MISS,
+  EDFS_STAT_JOURNAL_COMMIT,
+  EDFS_N_STATS
+} edfs_stat_t;
+
+/* FUSE operations of which the latency is recorded. */
+typedef enum
+{
+  EDFS_OP_GETATTR = 0,
+  EDFS_OP_READDIR,
+  EDFS_OP_OPEN,
+  EDFS_OP_RELEASE,
+  EDFS_OP_CREATE,
+  EDFS_OP_READ,
+  EDFS_OP_WRITE,
+  EDFS_OP_MKDIR,
+  EDFS_OP_RMDIR,
+  EDFS_OP_UNLINK,
+  EDFS_OP_TRUNCATE,
+  EDFS_OP_FALLOCATE,
+  EDFS_OP_FSYNC,
+  EDFS_OP_FLUSH,
+  EDFS_N_OPS
+} edfs_op_t;
+
+/* Latency histograms have power of two buckets: bucket i counts
+ * operations that took less than 2^i microseconds, the last bucket
+ * also those that took longer.
+ */
+#define EDFS_STATS_N_BUCKETS 24
+
+typedef struct edfs_stats edfs_stats_t;
+
+/* Data routines specialized for the block size of an image. */
+typedef struct edfs_data_ops edfs_data_ops_t;
 
 /* Structure to use as handle to an opened image file. */
 typedef struct
@@ -19,12 +160,299 @@ typedef struct
   const char *filename;
 
   edfs_super_block_t sb;
+
+  /* The routines of edfs_read_inode_data() and edfs_write_inode_data()
+   * for sb.block_size, see edfs-common.c.
+   */
+  const edfs_data_ops_t *data_ops;
+
+  /* In EDFS_IO_MMAP mode, map points at the mapped image and the
+   * bitmap and inode table below point into it; there is no block
+   * cache in that mode.
+   */
+  edfs_io_mode_t io_mode;
+  uint8_t *map;
+  size_t map_size;
+
+  /* In-memory copy of the block allocation bitmap, padded to a multiple
+   * of 8 bytes so it can be scanned a 64-bit word at a time. Modified
+   * bytes in [bitmap_dirty_lo, bitmap_dirty_hi) are written back by
+   * edfs_bitmap_flush().
+   */
+  uint8_t *bitmap;
+  uint32_t bitmap_dirty_lo;
+  uint32_t bitmap_dirty_hi;
+
+  /* Blocks reserved for preallocation windows, which the allocator
+   * skips. Kept in memory only, padded like the bitmap.
+   */
+  uint8_t *bitmap_reserved;
+
+  /* Block to start the next free block search at. */
+  edfs_block_t bitmap_hint;
+
+  /* In-memory copy of the inode table, edfs_write_inode() writes
+   * through to the image. inode_bitmap has a bit set for every inode in
+   * use (padded like the block bitmap), inode_hint is where the next
+   * free inode search starts.
+   */
+  edfs_disk_inode_t *inodes;
+  uint8_t *inode_bitmap;
+  edfs_inumber_t inode_hint;
+
+  /* Write-back cache through which all block I/O is done, see
+   * edfs-cache.c.
+   */
+  edfs_cache_t *cache;
+
+  /* Decoded indirect blocks of recently accessed inodes, so that data
+   * block lookups do not have to consult the indirect block each time.
+   */
+  edfs_blkmap_t *blkmaps;
+  uint32_t blkmap_clock;
+
+  /* Results of recent path component lookups, see edfs-dcache.c. */
+  edfs_dcache_t *dcache;
+
+  /* Attributes of every inode, see edfs-attr.c. */
+  edfs_attr_cache_t *attrs;
+
+  /* Units in use in the tail blocks of inline files, see edfs-tail.c. */
+  edfs_tails_t *tails;
+
+  /* In EDFS_IO_URING mode, the ring batches are submitted to, see
+   * edfs-uring.c.
+   */
+  edfs_uring_t *uring;
+
+  /* Metadata journal, NULL if the image has none; see edfs-journal.c. */
+  edfs_journal_t *journal;
+
+  /* I/O, cache and latency statistics, see edfs-stats.c. */
+  edfs_stats_t *stats;
+
+  /* Extent holds of all threads and the data blocks freed while one of
+   * them was set. hold_epoch is advanced on every such free.
+   */
+  edfs_extent_hold_t *holds;
+  edfs_freed_t *freed;
+  uint64_t hold_epoch;
+
+  /* Locking, so that the image can be used from several threads:
+   * alloc_lock protects the block bitmap, inode_lock the inode table
+   * and free-inode bitmap and blkmap_lock the decoded block maps. The
+   * block cache and dentry cache have their own locks. hold_lock
+   * protects the extent holds and freed blocks, it is taken before
+   * alloc_lock.
+   *
+   * ns_lock serializes changes to the directory tree against lookups,
+   * inode_rwlocks (one per inode) protect the data and size of a file
+   * while it is read or written.
+   */
+  pthread_mutex_t alloc_lock;
+  pthread_mutex_t inode_lock;
+  pthread_mutex_t blkmap_lock;
+  pthread_mutex_t hold_lock;
+  pthread_rwlock_t ns_lock;
+  pthread_rwlock_t *inode_rwlocks;
 } edfs_image_t;
 
 
-void           edfs_image_close           (edfs_image_t *img);
-edfs_image_t  *edfs_image_open            (const char   *filename,
-                                           bool          read_super);
+void           edfs_image_close           (edfs_image_t   *img);
+edfs_image_t  *edfs_image_open            (const char     *filename,
+                                           bool            read_super,
+                                           edfs_io_mode_t  io_mode);
+int            edfs_image_sync            (edfs_image_t   *img,
+                                           bool            datasync);
+
+/* Take the namespace lock for a lookup (shared) or for modification
+ * of the directory tree (exclusive).
+ */
+void           edfs_namespace_lock        (edfs_image_t   *img,
+                                           bool            write);
+void           edfs_namespace_unlock      (edfs_image_t   *img);
+
+/* Raw image I/O, with pread/pwrite/preadv semantics, for the backend
+ * selected at open time.
+ */
+ssize_t        edfs_image_pread           (edfs_image_t       *img,
+                                           void               *buf,
+                                           size_t              size,
+                                           off_t               off);
+ssize_t        edfs_image_pwrite          (edfs_image_t       *img,
+                                           const void         *buf,
+                                           size_t              size,
+                                           off_t               off);
+ssize_t        edfs_image_preadv          (edfs_image_t       *img,
+                                           const struct iovec *iov,
+                                           int                 n_iov,
+                                           off_t               off);
+
+ssize_t        edfs_image_pwritev         (edfs_image_t       *img,
+                                           const struct iovec *iov,
+                                           int                 n_iov,
+                                           off_t               off);
+
+/* Perform a batch of requests, returns 0 if all completed in full. */
+int            edfs_image_submit          (edfs_image_t       *img,
+                                           edfs_io_req_t      *reqs,
+                                           int                 n_reqs);
+
+/* Hint that [off, off + size) of the image will be read soon. */
+void           edfs_image_prefetch        (edfs_image_t       *img,
+                                           off_t               off,
+                                           size_t              size);
+
+
+/*
+ * Block cache routines
+ */
+
+bool           edfs_cache_init            (edfs_image_t *img);
+void           edfs_cache_free            (edfs_image_t *img);
+bool           edfs_cache_contains        (edfs_image_t *img,
+                                           edfs_block_t  block);
+int            edfs_cache_read            (edfs_image_t *img,
+                                           edfs_block_t  block,
+                                           void         *buf,
+                                           uint32_t      off,
+                                           uint32_t      size,
+                                           edfs_io_site_t site);
+int            edfs_cache_write           (edfs_image_t *img,
+                                           edfs_block_t  block,
+                                           const void   *buf,
+                                           uint32_t      off,
+                                           uint32_t      size,
+                                           edfs_io_site_t site);
+int            edfs_cache_zero            (edfs_image_t *img,
+                                           edfs_block_t  block,
+                                           edfs_io_site_t site);
+void           edfs_cache_forget          (edfs_image_t *img,
+                                           edfs_block_t  block);
+int            edfs_cache_flush           (edfs_image_t *img);
+bool           edfs_cache_writeback_start (edfs_image_t *img);
+void           edfs_cache_writeback_stop  (edfs_image_t *img);
+
+/* Metadata blocks are tracked for the journal: they are not written
+ * back by eviction or edfs_cache_flush(), only by the journal once the
+ * transaction that modified them is committed.
+ */
+void           edfs_cache_set_meta        (edfs_image_t *img,
+                                           edfs_block_t  block);
+int            edfs_cache_get_meta        (edfs_image_t *img,
+                                           edfs_block_t *blocks,
+                                           uint64_t     *seqs,
+                                           int           max);
+uint32_t       edfs_cache_n_meta          (edfs_image_t *img);
+bool           edfs_cache_clean_meta      (edfs_image_t *img,
+                                           edfs_block_t  block,
+                                           uint64_t      seq);
+
+
+/*
+ * Directory entry cache routines
+ */
+
+bool           edfs_dcache_init           (edfs_image_t   *img);
+void           edfs_dcache_free           (edfs_image_t   *img);
+bool           edfs_dcache_lookup         (edfs_image_t   *img,
+                                           edfs_inumber_t  parent,
+                                           const char     *name,
+                                           edfs_inumber_t *inumber);
+void           edfs_dcache_insert         (edfs_image_t   *img,
+                                           edfs_inumber_t  parent,
+                                           const char     *name,
+                                           edfs_inumber_t  inumber);
+void           edfs_dcache_invalidate     (edfs_image_t   *img,
+                                           edfs_inumber_t  parent,
+                                           const char     *name);
+void           edfs_dcache_forget_dir     (edfs_image_t   *img,
+                                           edfs_inumber_t  parent);
+
+
+/*
+ * Attribute cache routines
+ */
+
+bool           edfs_attr_init             (edfs_image_t   *img);
+void           edfs_attr_free             (edfs_image_t   *img);
+int            edfs_attr_get              (edfs_image_t   *img,
+                                           edfs_inumber_t  inumber,
+                                           edfs_attr_t    *attr);
+void           edfs_attr_invalidate       (edfs_image_t   *img,
+                                           edfs_inumber_t  inumber);
+
+
+/*
+ * Statistics
+ */
+
+bool           edfs_stats_init            (edfs_image_t   *img);
+void           edfs_stats_free            (edfs_image_t   *img);
+
+/* Counts one I/O call at @site that transferred @res bytes, or failed
+ * if @res is negative.
+ */
+void           edfs_stats_io              (edfs_image_t   *img,
+                                           edfs_io_site_t  site,
+                                           bool            write,
+                                           ssize_t         res);
+void           edfs_stats_io_reqs         (edfs_image_t   *img,
+                                           edfs_io_site_t  site,
+                                           const edfs_io_req_t *reqs,
+                                           int             n_reqs);
+void           edfs_stats_count           (edfs_image_t   *img,
+                                           edfs_stat_t     stat);
+
+/* Returns the number of I/O calls counted so far, over all sites. */
+uint64_t       edfs_stats_io_calls        (edfs_image_t   *img);
+
+/* Monotonic time in nanoseconds, the start time for edfs_stats_op(). */
+uint64_t       edfs_stats_now             (void);
+void           edfs_stats_op              (edfs_image_t   *img,
+                                           edfs_op_t       op,
+                                           uint64_t        start);
+
+/* Returns a text report of all statistics, to be freed by the caller,
+ * and its length in *size.
+ */
+char          *edfs_stats_report          (edfs_image_t   *img,
+                                           size_t         *size);
+
+
+/*
+ * Metadata journal routines
+ */
+
+bool           edfs_journal_init          (edfs_image_t   *img);
+void           edfs_journal_free          (edfs_image_t   *img);
+bool           edfs_journal_replay        (edfs_image_t   *img);
+int            edfs_journal_create        (edfs_image_t   *img);
+
+/* Brackets an operation modifying metadata, so that a group commit
+ * never contains half of it. edfs_journal_stop() commits when due.
+ */
+void           edfs_journal_start         (edfs_image_t   *img);
+void           edfs_journal_stop          (edfs_image_t   *img);
+int            edfs_journal_commit        (edfs_image_t   *img);
+int            edfs_journal_commit_pinned (edfs_image_t   *img);
+
+/* Records that @inumber was modified, called with img->inode_lock held. */
+void           edfs_journal_mark_inode    (edfs_image_t   *img,
+                                           edfs_inumber_t  inumber);
+
+
+#ifdef EDFS_WITH_IO_URING
+/*
+ * io_uring backend, only built with WITH_IO_URING=1
+ */
+
+bool           edfs_uring_init            (edfs_image_t   *img);
+void           edfs_uring_free            (edfs_image_t   *img);
+void           edfs_uring_submit          (edfs_image_t   *img,
+                                           edfs_io_req_t  *reqs,
+                                           int             n_reqs);
+#endif /* EDFS_WITH_IO_URING */
 
 
 
@@ -42,6 +470,36 @@ typedef struct
   edfs_disk_inode_t inode;
 } edfs_inode_t;
 
+/* Number of blocks reserved beyond an allocation for a file being
+ * written, so that its next blocks are placed right after it.
+ */
+#define EDFS_PREALLOC_N_BLOCKS 16
+
+/* Preallocation window of an open file: blocks that are reserved for
+ * it in memory, but are not (yet) part of the file. They are not marked
+ * as used in the bitmap on the image.
+ */
+typedef struct
+{
+  edfs_block_t start;
+  uint32_t n_blocks;
+} edfs_prealloc_t;
+
+/* Bounds of the readahead window, in blocks. The window starts at the
+ * minimum on the first sequential read and doubles on every following
+ * one.
+ */
+#define EDFS_READAHEAD_MIN 4
+#define EDFS_READAHEAD_MAX 64
+
+/* Sequential access state of an open file. */
+typedef struct
+{
+  uint32_t next_off;    /* offset at which a sequential read continues */
+  uint32_t window;      /* current window size in blocks, 0 if random */
+  uint32_t ra_end;      /* first block not prefetched yet */
+} edfs_readahead_t;
+
 
 int            edfs_read_inode            (edfs_image_t *img,
                                            edfs_inode_t *inode);
@@ -56,6 +514,13 @@ int            edfs_new_inode             (edfs_image_t *img,
                                            edfs_inode_t *inode,
                                            edfs_inode_type_t type);
 
+/* Per-inode reader/writer lock around data access of a file. */
+void           edfs_inode_lock            (edfs_image_t   *img,
+                                           edfs_inumber_t  inumber,
+                                           bool            write);
+void           edfs_inode_unlock          (edfs_image_t   *img,
+                                           edfs_inumber_t  inumber);
+
 /* Attempt to read size bytes into buf
  * returns bytes read, or negative value on error
  */ 
@@ -64,16 +529,216 @@ int            edfs_read_inode_data       (edfs_image_t *img,
                                            void         *buf,
                                            uint32_t      size,
                                            uint32_t      off);
-int            edfs_write_inode_data      (edfs_image_t *img,
+
+/* Write @size bytes of @buf at @off, allocating blocks as necessary.
+ * New blocks are taken from @pa first, which may be NULL. Returns bytes
+ * written, or negative value on error.
+ */
+int            edfs_write_inode_data      (edfs_image_t    *img,
+                                           edfs_inode_t    *inode,
+                                           const void      *buf,
+                                           uint32_t         size,
+                                           uint32_t         off,
+                                           edfs_prealloc_t *pa);
+
+/* Allocate zero-filled blocks for the range [off, off + size), extending
+ * the file size if needed.
+ */
+int            edfs_allocate_inode_data   (edfs_image_t    *img,
+                                           edfs_inode_t    *inode,
+                                           uint32_t         size,
+                                           uint32_t         off,
+                                           edfs_prealloc_t *pa);
+
+/* Account for a read of [off, off + size) of @inode and, while access
+ * is sequential, prefetch the blocks following it.
+ */
+void           edfs_readahead             (edfs_image_t     *img,
+                                           edfs_inode_t     *inode,
+                                           edfs_readahead_t *ra,
+                                           uint32_t          off,
+                                           uint32_t          size);
+
+/* Release the blocks of @inode from logical block @from onwards. */
+int            edfs_inode_free_blocks     (edfs_image_t    *img,
+                                           edfs_inode_t    *inode,
+                                           uint32_t         from);
+
+/* Set the size of a file, releasing blocks beyond the new end. */
+int            edfs_truncate_inode_data   (edfs_image_t    *img,
+                                           edfs_inode_t    *inode,
+                                           uint32_t         size);
+
+/* Return the blocks left in @pa to the free pool. */
+void           edfs_prealloc_release      (edfs_image_t    *img,
+                                           edfs_prealloc_t *pa);
+
+/* Resolve the physical blocks backing @n consecutive blocks of @inode
+ * starting at block @first. Unallocated blocks are EDFS_BLOCK_INVALID.
+ */
+int            edfs_inode_map_blocks      (edfs_image_t *img,
                                            edfs_inode_t *inode,
-                                           const void   *buf,
-                                           uint32_t      size,
-                                           uint32_t      off);
+                                           uint32_t      first,
+                                           uint32_t      n,
+                                           edfs_block_t *blocks);
+void           edfs_inode_forget_map      (edfs_image_t *img,
+                                           edfs_inumber_t inumber);
+
+/* Number of blocks in use by @inode, including its indirect block. */
+int            edfs_inode_count_blocks    (edfs_image_t *img,
+                                           edfs_inode_t *inode);
+
+
+/*
+ * Inline data routines
+ *
+ * Callers hold the inode lock exclusively for all but edfs_tail_read(),
+ * and write the inode after edfs_tail_release(). The other routines
+ * write it themselves.
+ */
+
+bool           edfs_tail_init             (edfs_image_t   *img);
+void           edfs_tail_free             (edfs_image_t   *img);
+bool           edfs_tail_fits             (edfs_image_t   *img,
+                                           edfs_inode_t   *inode,
+                                           uint32_t        size,
+                                           uint32_t        off);
+int            edfs_tail_read             (edfs_image_t   *img,
+                                           edfs_inode_t   *inode,
+                                           void           *buf,
+                                           uint32_t        size,
+                                           uint32_t        off);
+int            edfs_tail_write            (edfs_image_t   *img,
+                                           edfs_inode_t   *inode,
+                                           const void     *buf,
+                                           uint32_t        size,
+                                           uint32_t        off);
+int            edfs_tail_truncate         (edfs_image_t   *img,
+                                           edfs_inode_t   *inode,
+                                           uint32_t        size);
+void           edfs_tail_release          (edfs_image_t   *img,
+                                           edfs_inode_t   *inode);
+
+
+/*
+ * Directory iteration
+ */
+
+/* Iterates over all entry slots of a directory, including empty ones,
+ * reading each directory block only once. Unallocated blocks yield
+ * empty slots, so a free slot found this way can simply be written.
+ * Unallocated buckets of a hashed directory are skipped instead; the
+ * free slot for a name is found with edfs_dir_find_free().
+ */
+typedef struct
+{
+  edfs_image_t *img;
+  edfs_inode_t *dir;
+
+  uint32_t blk_id;     /* next block to load */
+  uint32_t blk_off;    /* byte offset of the loaded block */
+  uint32_t slot;       /* next slot within the loaded block */
+  uint32_t n_slots;    /* slots in the loaded block, 0 if none */
+  edfs_dir_entry_t entries[EDFS_MAX_BLOCK_SIZE / sizeof(edfs_dir_entry_t)];
+} edfs_dir_iter_t;
+
+void           edfs_dir_iter_init         (edfs_dir_iter_t   *it,
+                                           edfs_image_t      *img,
+                                           edfs_inode_t      *dir);
+int            edfs_dir_iter_next         (edfs_dir_iter_t   *it,
+                                           edfs_dir_entry_t **entry,
+                                           uint32_t          *off);
+int            edfs_dir_iter_next_block   (edfs_dir_iter_t   *it);
+int            edfs_dir_iter_seek         (edfs_dir_iter_t   *it,
+                                           uint32_t           off);
+
+/* Returns the index of the non-empty entry named @name within
+ * @entries[0..n), or -1.
+ */
+int            edfs_dir_entries_find      (const edfs_dir_entry_t *entries,
+                                           int                     n,
+                                           const char             *name);
+
+/* Lookup and slot allocation for both classic and hashed directories,
+ * see edfs.h for the hashed format.
+ */
+int            edfs_dir_lookup            (edfs_image_t     *img,
+                                           edfs_inode_t     *dir,
+                                           const char       *name,
+                                           edfs_dir_entry_t *entry,
+                                           uint32_t         *off);
+int            edfs_dir_find_free         (edfs_image_t     *img,
+                                           edfs_inode_t     *dir,
+                                           const char       *name,
+                                           uint32_t         *off);
+int            edfs_dir_make_hashed       (edfs_image_t     *img,
+                                           edfs_inode_t     *dir);
+
+
+/*
+ * Path resolution and directory entries
+ */
+
+/* Returns 0 if @name may be used as a file name, -EINVAL or
+ * -ENAMETOOLONG otherwise.
+ */
+int            edfs_check_filename        (const char     *name);
+
+/* Returns true if @path was found, and its inode in @inode. */
+bool           edfs_find_inode            (edfs_image_t   *img,
+                                           const char     *path,
+                                           edfs_inode_t   *inode);
+int            edfs_get_parent_inode      (edfs_image_t   *img,
+                                           const char     *path,
+                                           edfs_inode_t   *parent_inode);
+char          *edfs_get_basename          (const char     *path);
+int            edfs_find_parent           (edfs_image_t   *img,
+                                           const char     *path,
+                                           edfs_inode_t   *parent,
+                                           char            name[EDFS_FILENAME_SIZE]);
+
+int            edfs_add_dir_entry         (edfs_image_t   *img,
+                                           edfs_inode_t   *inode,
+                                           const char     *name,
+                                           edfs_inumber_t  inumber);
+int            edfs_dir_create            (edfs_image_t      *img,
+                                           edfs_inode_t      *dir,
+                                           const char        *name,
+                                           edfs_inode_type_t  type,
+                                           edfs_inode_t      *inode);
+int            edfs_remove_dir_entry      (edfs_image_t   *img,
+                                           edfs_inode_t   *inode,
+                                           const char     *name);
+
+/* Returns 1 if @inode has no entries, 0 if it has, or an error code. */
+int            edfs_dir_is_empty          (edfs_image_t   *img,
+                                           edfs_inode_t   *inode);
 
 /* bitmap related routines */
 int             edfs_bitmap_clear         (edfs_image_t *img,
                                            edfs_block_t block);
 int             edfs_bitmap_set           (edfs_image_t *img,
                                            edfs_block_t block);
+void            edfs_bitmap_clear_blocks  (edfs_image_t       *img,
+                                           const edfs_block_t *blocks,
+                                           uint32_t            n);
+int             edfs_bitmap_flush         (edfs_image_t *img);
+int             edfs_get_new_block        (edfs_image_t *img,
+                                           edfs_block_t *block);
+int             edfs_get_new_blocks       (edfs_image_t *img,
+                                           uint32_t      want,
+                                           edfs_block_t  goal,
+                                           edfs_block_t *block);
+
+/* A thread that hands out extents of a file's data on the image, to be
+ * read after it has dropped the inode lock, sets a hold on the inode
+ * for as long as they may still be read. Data blocks freed from the
+ * inode meanwhile are not reallocated until the hold is cleared.
+ */
+edfs_extent_hold_t *edfs_extent_hold_new  (edfs_image_t       *img);
+void            edfs_extent_hold_free     (edfs_extent_hold_t *hold);
+void            edfs_extent_hold_set      (edfs_extent_hold_t *hold,
+                                           edfs_inumber_t      inumber);
+void            edfs_extent_hold_clear    (edfs_extent_hold_t *hold);
 
 #endif /* __EDFS_COMMON_H__ */
@@ -0,0 +1,185 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/*
+ * Directory entry cache
+ *
+ * Maps (parent inumber, filename) to the inumber found in the parent
+ * directory. An inumber of 0 records that the name does not exist
+ * (negative entry). The table is set-associative: a name hashes to a
+ * set of EDFS_DCACHE_N_WAYS entries, of which the least recently used
+ * one is replaced on insertion. All routines take dcache->lock.
+ */
+
+#include "edfs-common.h"
+
+#include <string.h>
+#include <stdlib.h>
+
+typedef struct
+{
+    edfs_inumber_t parent;      /* 0 if the entry is unused */
+    edfs_inumber_t inumber;     /* 0 for a negative entry */
+    uint32_t last_use;
+    char filename[EDFS_FILENAME_SIZE];
+} edfs_dcache_entry_t;
+
+struct edfs_dcache
+{
+    pthread_mutex_t lock;
+    uint32_t clock;
+    edfs_dcache_entry_t entries[EDFS_DCACHE_N_SETS][EDFS_DCACHE_N_WAYS];
+};
+
+bool
+edfs_dcache_init(edfs_image_t *img)
+{
+    img->dcache = calloc(1, sizeof(edfs_dcache_t));
+    if (!img->dcache)
+        return false;
+
+    pthread_mutex_init(&img->dcache->lock, NULL);
+
+    return true;
+}
+
+void
+edfs_dcache_free(edfs_image_t *img)
+{
+    if (img->dcache)
+        pthread_mutex_destroy(&img->dcache->lock);
+
+    free(img->dcache);
+    img->dcache = NULL;
+}
+
+/* FNV-1a over the parent inumber and the filename. */
+static uint32_t
+edfs_dcache_hash(edfs_inumber_t parent, const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    for (int i = 0; i < 4; i++)
+    {
+        h ^= (parent >> (i * 8)) & 0xff;
+        h *= 16777619u;
+    }
+
+    for (; *name; name++)
+    {
+        h ^= (uint8_t)*name;
+        h *= 16777619u;
+    }
+
+    return h % EDFS_DCACHE_N_SETS;
+}
+
+static edfs_dcache_entry_t *
+edfs_dcache_find(edfs_dcache_t *dcache, edfs_inumber_t parent, const char *name)
+{
+    edfs_dcache_entry_t *set = dcache->entries[edfs_dcache_hash(parent, name)];
+
+    for (int i = 0; i < EDFS_DCACHE_N_WAYS; i++)
+        if (set[i].parent == parent && strcmp(set[i].filename, name) == 0)
+            return &set[i];
+
+    return NULL;
+}
+
+/* Looks up @name in directory @parent. Returns true on a cache hit, in
+ * which case *inumber is set (to 0 if the name is known not to exist).
+ */
+bool
+edfs_dcache_lookup(edfs_image_t *img, edfs_inumber_t parent,
+                   const char *name, edfs_inumber_t *inumber)
+{
+    if (!img->dcache)
+        return false;
+
+    pthread_mutex_lock(&img->dcache->lock);
+
+    edfs_dcache_entry_t *entry = edfs_dcache_find(img->dcache, parent, name);
+    if (entry)
+    {
+        entry->last_use = ++img->dcache->clock;
+        *inumber = entry->inumber;
+    }
+
+    pthread_mutex_unlock(&img->dcache->lock);
+
+    edfs_stats_count(img, entry ? EDFS_STAT_DCACHE_HIT : EDFS_STAT_DCACHE_MISS);
+
+    return entry != NULL;
+}
+
+/* Records that @name in directory @parent refers to @inumber, or does
+ * not exist if @inumber is 0.
+ */
+void
+edfs_dcache_insert(edfs_image_t *img, edfs_inumber_t parent,
+                   const char *name, edfs_inumber_t inumber)
+{
+    if (!img->dcache || parent == 0 || strlen(name) >= EDFS_FILENAME_SIZE)
+        return;
+
+    pthread_mutex_lock(&img->dcache->lock);
+
+    edfs_dcache_entry_t *entry = edfs_dcache_find(img->dcache, parent, name);
+    if (!entry)
+    {
+        edfs_dcache_entry_t *set =
+            img->dcache->entries[edfs_dcache_hash(parent, name)];
+
+        entry = &set[0];
+        for (int i = 1; i < EDFS_DCACHE_N_WAYS; i++)
+            if (set[i].last_use < entry->last_use)
+                entry = &set[i];
+
+        entry->parent = parent;
+        strcpy(entry->filename, name);
+    }
+
+    entry->inumber = inumber;
+    entry->last_use = ++img->dcache->clock;
+
+    pthread_mutex_unlock(&img->dcache->lock);
+}
+
+/* Drops the cached entry for @name in directory @parent, if any. */
+void
+edfs_dcache_invalidate(edfs_image_t *img, edfs_inumber_t parent,
+                       const char *name)
+{
+    if (!img->dcache)
+        return;
+
+    pthread_mutex_lock(&img->dcache->lock);
+
+    edfs_dcache_entry_t *entry = edfs_dcache_find(img->dcache, parent, name);
+    if (entry)
+        memset(entry, 0, sizeof(edfs_dcache_entry_t));
+
+    pthread_mutex_unlock(&img->dcache->lock);
+}
+
+/* Drops all entries of directory @parent, to be called when the
+ * directory is removed so its inumber can be reused safely.
+ */
+void
+edfs_dcache_forget_dir(edfs_image_t *img, edfs_inumber_t parent)
+{
+    if (!img->dcache)
+        return;
+
+    pthread_mutex_lock(&img->dcache->lock);
+
+    for (int s = 0; s < EDFS_DCACHE_N_SETS; s++)
+        for (int i = 0; i < EDFS_DCACHE_N_WAYS; i++)
+            if (img->dcache->entries[s][i].parent == parent)
+                memset(&img->dcache->entries[s][i], 0,
+                       sizeof(edfs_dcache_entry_t));
+
+    pthread_mutex_unlock(&img->dcache->lock);
+}
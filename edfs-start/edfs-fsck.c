@@ -0,0 +1,1067 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/*
+ * fsck.edfs -- parallel consistency checker
+ *
+ * The image is opened through edfs-common, which replays a committed
+ * journal transaction and loads the bitmap and the inode table once.
+ * The check then runs in three passes over a pool of threads:
+ *
+ *   1. the inode table is split in chunks that threads take in turn.
+ *      Every block an inode refers to is checked and set in a reference
+ *      bitmap of the thread; a block already set there is a duplicate.
+ *   2. the directory tree is walked from the root. Every thread keeps
+ *      a deque of directories still to be read, takes work from the
+ *      back of its own and steals from the front of the others'. An
+ *      inode found through a second directory entry is an error, so
+ *      each directory is read exactly once.
+ *   3. the reference bitmaps are OR-merged, the blocks set in more than
+ *      one of them are duplicates too. The tail blocks holding the data
+ *      of inline files are added in a sequential pass that checks that
+ *      no two files share a unit. Together with the metadata and
+ *      journal blocks they must equal the on-disk bitmap; the rest are
+ *      leaked or unmarked blocks.
+ *
+ * Metadata blocks are read with edfs_image_pread(), bypassing the
+ * block cache: each is read once, and the cache locks would only make
+ * the threads wait for each other. Errors are collected per chunk and
+ * per thread and printed once a pass is done, the errors of pass 1 in
+ * inode order.
+ */
+
+#include "edfs-common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <unistd.h>
+
+/* Inodes per chunk of pass 1. */
+#define EDFS_FSCK_CHUNK_SIZE 1024
+
+#define EDFS_FSCK_MAX_THREADS 64
+
+/* Errors found by one chunk or thread, in a lazily opened stream. A
+ * NULL log discards errors.
+ */
+typedef struct
+{
+    FILE *f;
+    char *buf;
+    size_t size;
+    uint32_t n_errors;
+} edfs_fsck_log_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    edfs_inumber_t *items;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t capacity;
+} edfs_fsck_deque_t;
+
+typedef struct edfs_fsck edfs_fsck_t;
+
+typedef struct
+{
+    edfs_fsck_t *fsck;
+    int id;
+    pthread_t thread;
+
+    uint64_t *refs;
+    uint64_t *dups;
+    uint8_t *buf;
+    edfs_block_t *blocks;
+
+    edfs_fsck_deque_t deque;
+    edfs_fsck_log_t log;
+    uint32_t n_dirs;
+} edfs_fsck_thread_t;
+
+struct edfs_fsck
+{
+    edfs_image_t *img;
+    int n_threads;
+    edfs_fsck_thread_t *threads;
+
+    edfs_block_t data_start;
+    uint32_t n_words;           /* 64-bit words of a block bitmap */
+    uint32_t n_indirect;
+
+    /* Pass 1 */
+    uint32_t n_chunks;
+    uint32_t next_chunk;
+    edfs_fsck_log_t *chunk_logs;
+
+    /* Pass 2: the number of entries found for every inode, and the
+     * directories that are queued or being read.
+     */
+    uint8_t *links;
+    uint32_t pending;
+
+    uint32_t n_errors;
+};
+
+static void
+edfs_fsck_error(edfs_fsck_log_t *log, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (!log)
+        return;
+
+    if (!log->f)
+        log->f = open_memstream(&log->buf, &log->size);
+
+    log->n_errors++;
+    if (!log->f)
+        return;
+
+    fprintf(log->f, "ERROR: ");
+    va_start(ap, fmt);
+    vfprintf(log->f, fmt, ap);
+    va_end(ap);
+    fprintf(log->f, "\n");
+}
+
+/* Prints the errors in @log and releases the stream. */
+static void
+edfs_fsck_log_flush(edfs_fsck_t *fsck, edfs_fsck_log_t *log)
+{
+    if (log->f)
+    {
+        fclose(log->f);
+        fwrite(log->buf, 1, log->size, stdout);
+        free(log->buf);
+    }
+
+    fsck->n_errors += log->n_errors;
+    memset(log, 0, sizeof(edfs_fsck_log_t));
+}
+
+static inline bool
+edfs_fsck_test(const uint64_t *bitmap, edfs_block_t block)
+{
+    return bitmap[block / 64] >> (block % 64) & 1;
+}
+
+/* Returns the contents of @block, in @buf unless the image is mapped. */
+static const uint8_t *
+edfs_fsck_read_block(edfs_fsck_t *fsck, edfs_block_t block, uint8_t *buf)
+{
+    edfs_image_t *img = fsck->img;
+    const uint16_t BLK_SIZE = img->sb.block_size;
+    off_t off = edfs_get_block_offset(&img->sb, block);
+
+    if (img->map)
+        return img->map + off;
+
+    if (edfs_image_pread(img, buf, BLK_SIZE, off) != BLK_SIZE)
+        return NULL;
+
+    return buf;
+}
+
+/* Checks that @block may be referred to by an inode. */
+static bool
+edfs_fsck_check_block(edfs_fsck_t *fsck, edfs_fsck_log_t *log,
+                      edfs_inumber_t inumber, const char *what,
+                      edfs_block_t block)
+{
+    const edfs_super_block_t *sb = &fsck->img->sb;
+
+    if (block >= sb->n_blocks)
+        edfs_fsck_error(log, "inode %u: %s block %u out of range.",
+                        inumber, what, block);
+    else if (block < fsck->data_start)
+        edfs_fsck_error(log, "inode %u: %s block %u overlaps with the "
+                        "file system metadata.", inumber, what, block);
+    else if (block >= sb->journal_start &&
+             block < sb->journal_start + sb->journal_n_blocks)
+        edfs_fsck_error(log, "inode %u: %s block %u overlaps with the "
+                        "journal.", inumber, what, block);
+    else
+        return true;
+
+    return false;
+}
+
+/* Collects the blocks of inode @inumber: the @n_blocks entries of
+ * @blocks are the logical blocks, 0 for holes, and *@indirect is its
+ * indirect block if it is valid. Blocks that may not be referred to are
+ * reported in @log and left out.
+ */
+static bool
+edfs_fsck_inode_blocks(edfs_fsck_t *fsck, edfs_fsck_log_t *log,
+                       edfs_inumber_t inumber, uint8_t *buf,
+                       edfs_block_t *blocks, uint32_t *n_blocks,
+                       edfs_block_t *indirect)
+{
+    const edfs_disk_inode_t *inode = &fsck->img->inodes[inumber];
+
+    *n_blocks = EDFS_INODE_N_DIRECT_BLOCKS;
+    *indirect = EDFS_BLOCK_INVALID;
+
+    for (int i = 0; i < EDFS_INODE_N_DIRECT_BLOCKS; i++)
+    {
+        blocks[i] = inode->direct[i];
+        if (blocks[i] != EDFS_BLOCK_INVALID &&
+            !edfs_fsck_check_block(fsck, log, inumber, "direct", blocks[i]))
+            blocks[i] = EDFS_BLOCK_INVALID;
+    }
+
+    if (inode->indirect == EDFS_BLOCK_INVALID ||
+        !edfs_fsck_check_block(fsck, log, inumber, "indirect",
+                               inode->indirect))
+        return true;
+
+    const uint8_t *data = edfs_fsck_read_block(fsck, inode->indirect, buf);
+    if (!data)
+    {
+        edfs_fsck_error(log, "inode %u: could not read indirect block %u.",
+                        inumber, inode->indirect);
+        return false;
+    }
+
+    *indirect = inode->indirect;
+    *n_blocks += fsck->n_indirect;
+
+    /* May be unaligned in the mapping. */
+    memcpy(blocks + EDFS_INODE_N_DIRECT_BLOCKS, data,
+           fsck->n_indirect * sizeof(edfs_block_t));
+
+    for (uint32_t i = EDFS_INODE_N_DIRECT_BLOCKS; i < *n_blocks; i++)
+        if (blocks[i] != EDFS_BLOCK_INVALID &&
+            !edfs_fsck_check_block(fsck, log, inumber, "data", blocks[i]))
+            blocks[i] = EDFS_BLOCK_INVALID;
+
+    return true;
+}
+
+/* Checks the tail block fields of inline file @inumber. */
+static bool
+edfs_fsck_check_inline(edfs_fsck_t *fsck, edfs_fsck_log_t *log,
+                       edfs_inumber_t inumber)
+{
+    const edfs_super_block_t *sb = &fsck->img->sb;
+    const edfs_disk_inode_t *inode = &fsck->img->inodes[inumber];
+
+    if (inode->size == 0 || inode->size > edfs_get_inline_max_size(sb))
+        edfs_fsck_error(log, "inode %u: inline file has invalid size %u.",
+                        inumber, inode->size);
+    else if (inode->tail_off % EDFS_TAIL_UNIT_SIZE != 0 ||
+             inode->tail_off + inode->size > sb->block_size)
+        edfs_fsck_error(log, "inode %u: inline data at invalid offset %u.",
+                        inumber, inode->tail_off);
+    else
+        return edfs_fsck_check_block(fsck, log, inumber, "tail", inode->tail);
+
+    return false;
+}
+
+static void
+edfs_fsck_ref(edfs_fsck_thread_t *t, edfs_block_t block)
+{
+    uint64_t bit = (uint64_t)1 << (block % 64);
+
+    if (t->refs[block / 64] & bit)
+        t->dups[block / 64] |= bit;
+    t->refs[block / 64] |= bit;
+}
+
+/*
+ * Pass 1: inodes and their block references
+ */
+
+static void
+edfs_fsck_check_inode(edfs_fsck_thread_t *t, edfs_fsck_log_t *log,
+                      edfs_inumber_t inumber)
+{
+    edfs_fsck_t *fsck = t->fsck;
+    const edfs_disk_inode_t *inode = &fsck->img->inodes[inumber];
+    const uint16_t BLK_SIZE = fsck->img->sb.block_size;
+
+    if (inode->type == EDFS_INODE_TYPE_FREE)
+        return;
+
+    if (inumber == 0)
+    {
+        edfs_fsck_error(log, "inode 0 must be unused (free).");
+        return;
+    }
+
+    if (inode->type != EDFS_INODE_TYPE_FILE &&
+        inode->type != EDFS_INODE_TYPE_DIRECTORY)
+    {
+        edfs_fsck_error(log, "inode %u has invalid type %u.",
+                        inumber, inode->type);
+        return;
+    }
+
+    if ((inode->flags & EDFS_INODE_FLAG_HASHED) &&
+        inode->type != EDFS_INODE_TYPE_DIRECTORY)
+        edfs_fsck_error(log, "inode %u: only directories can be hashed.",
+                        inumber);
+
+    /* The tail block is accounted for in pass 3. */
+    if (inode->flags & EDFS_INODE_FLAG_INLINE)
+    {
+        if (inode->type != EDFS_INODE_TYPE_FILE)
+            edfs_fsck_error(log, "inode %u: only files can be inline.",
+                            inumber);
+        else if (inode->direct[0] != EDFS_BLOCK_INVALID ||
+                 inode->direct[1] != EDFS_BLOCK_INVALID ||
+                 inode->indirect != EDFS_BLOCK_INVALID)
+            edfs_fsck_error(log, "inode %u: inline file has blocks.",
+                            inumber);
+        else
+            edfs_fsck_check_inline(fsck, log, inumber);
+    }
+
+    uint32_t n_blocks;
+    edfs_block_t indirect;
+    if (!edfs_fsck_inode_blocks(fsck, log, inumber, t->buf, t->blocks,
+                                &n_blocks, &indirect))
+        return;
+
+    if (indirect != EDFS_BLOCK_INVALID)
+        edfs_fsck_ref(t, indirect);
+
+    /* Classic directories only use their direct blocks, files no blocks
+     * past their size. Holes are allowed in both.
+     */
+    uint32_t limit = n_blocks;
+    if (inode->type == EDFS_INODE_TYPE_FILE)
+        limit = (inode->size + BLK_SIZE - 1) / BLK_SIZE;
+    else if (!(inode->flags & EDFS_INODE_FLAG_HASHED))
+        limit = EDFS_INODE_N_DIRECT_BLOCKS;
+
+    uint32_t n_over = 0;
+    for (uint32_t i = 0; i < n_blocks; i++)
+    {
+        if (t->blocks[i] == EDFS_BLOCK_INVALID)
+            continue;
+
+        edfs_fsck_ref(t, t->blocks[i]);
+        n_over += i >= limit;
+    }
+
+    if (n_over > 0)
+        edfs_fsck_error(log, "inode %u (size %u) has %u blocks allocated "
+                        "beyond its end.", inumber, inode->size, n_over);
+}
+
+static void
+edfs_fsck_pass_inodes(edfs_fsck_thread_t *t)
+{
+    edfs_fsck_t *fsck = t->fsck;
+    const uint32_t n_inodes = fsck->img->sb.inode_table_n_inodes;
+
+    while (true)
+    {
+        uint32_t chunk = __atomic_fetch_add(&fsck->next_chunk, 1,
+                                            __ATOMIC_RELAXED);
+        if (chunk >= fsck->n_chunks)
+            break;
+
+        edfs_inumber_t end = (chunk + 1) * EDFS_FSCK_CHUNK_SIZE;
+        if (end > n_inodes)
+            end = n_inodes;
+
+        for (edfs_inumber_t i = chunk * EDFS_FSCK_CHUNK_SIZE; i < end; i++)
+            edfs_fsck_check_inode(t, &fsck->chunk_logs[chunk], i);
+    }
+}
+
+/*
+ * Pass 2: directory tree
+ */
+
+static bool
+edfs_fsck_deque_push(edfs_fsck_deque_t *deque, edfs_inumber_t inumber)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail == deque->capacity)
+    {
+        /* Compact first, grow only if that does not make room. */
+        if (deque->head > 0)
+        {
+            memmove(deque->items, deque->items + deque->head,
+                    (deque->tail - deque->head) * sizeof(edfs_inumber_t));
+            deque->tail -= deque->head;
+            deque->head = 0;
+        }
+        else
+        {
+            uint32_t capacity = deque->capacity ? deque->capacity * 2 : 64;
+            edfs_inumber_t *items = realloc(deque->items,
+                                            capacity * sizeof(edfs_inumber_t));
+            if (!items)
+            {
+                pthread_mutex_unlock(&deque->lock);
+                return false;
+            }
+
+            deque->items = items;
+            deque->capacity = capacity;
+        }
+    }
+
+    deque->items[deque->tail++] = inumber;
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return true;
+}
+
+/* The owner takes the most recently pushed directory, which keeps its
+ * walk depth first; thieves take the oldest, closest to the root and
+ * therefore likely the largest subtree.
+ */
+static bool
+edfs_fsck_deque_take(edfs_fsck_deque_t *deque, bool steal,
+                     edfs_inumber_t *inumber)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->head < deque->tail)
+    {
+        *inumber = steal ? deque->items[deque->head++] :
+            deque->items[--deque->tail];
+        found = true;
+
+        if (deque->head == deque->tail)
+            deque->head = deque->tail = 0;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+/* Checks that @name in bucket @bucket of a hashed directory is found by
+ * a lookup, which starts at its home bucket and only moves on past
+ * buckets that overflowed.
+ */
+static bool
+edfs_fsck_hashed_reachable(edfs_fsck_t *fsck, const edfs_block_t *buckets,
+                           const bool *overflow, uint32_t bucket,
+                           const char *name)
+{
+    const uint32_t n_buckets = edfs_get_n_dir_buckets(&fsck->img->sb);
+
+    for (uint32_t b = edfs_dir_hash(name) % n_buckets; b != bucket;
+         b = (b + 1) % n_buckets)
+        if (buckets[b] == EDFS_BLOCK_INVALID || !overflow[b])
+            return false;
+
+    return true;
+}
+
+static void
+edfs_fsck_check_entry(edfs_fsck_thread_t *t, edfs_inumber_t dir,
+                      const edfs_dir_entry_t *entry)
+{
+    edfs_fsck_t *fsck = t->fsck;
+    edfs_image_t *img = fsck->img;
+    edfs_inumber_t inumber = entry->inumber;
+
+    char name[EDFS_FILENAME_SIZE + 1];
+    memcpy(name, entry->filename, EDFS_FILENAME_SIZE);
+    name[EDFS_FILENAME_SIZE] = 0;
+
+    if (!memchr(entry->filename, 0, EDFS_FILENAME_SIZE))
+        edfs_fsck_error(&t->log, "directory %u: filename pointing at inode "
+                        "%u not null-terminated.", dir, inumber);
+    else if (edfs_check_filename(name) < 0)
+        edfs_fsck_error(&t->log, "directory %u: invalid filename '%s'.",
+                        dir, name);
+
+    if (inumber >= img->sb.inode_table_n_inodes)
+    {
+        edfs_fsck_error(&t->log, "directory %u: '%s' refers to inode %u "
+                        "out of range.", dir, name, inumber);
+        return;
+    }
+
+    const edfs_disk_inode_t *inode = &img->inodes[inumber];
+    if (inode->type == EDFS_INODE_TYPE_FREE)
+    {
+        edfs_fsck_error(&t->log, "directory %u: '%s' refers to free inode %u.",
+                        dir, name, inumber);
+        return;
+    }
+
+    uint8_t links = __atomic_fetch_add(&fsck->links[inumber], 1,
+                                       __ATOMIC_RELAXED);
+    if (links > 0)
+    {
+        /* Keep the count from wrapping to "not linked". */
+        if (links == UINT8_MAX)
+            __atomic_store_n(&fsck->links[inumber], UINT8_MAX,
+                             __ATOMIC_RELAXED);
+        edfs_fsck_error(&t->log, "directory %u: '%s': inode %u already "
+                        "visited.", dir, name, inumber);
+        return;
+    }
+
+    if (inode->type == EDFS_INODE_TYPE_DIRECTORY)
+    {
+        __atomic_fetch_add(&fsck->pending, 1, __ATOMIC_RELAXED);
+        if (!edfs_fsck_deque_push(&t->deque, inumber))
+        {
+            __atomic_fetch_sub(&fsck->pending, 1, __ATOMIC_RELAXED);
+            edfs_fsck_error(&t->log, "out of memory queueing directory %u.",
+                            inumber);
+        }
+    }
+}
+
+static void
+edfs_fsck_check_dir(edfs_fsck_thread_t *t, edfs_inumber_t dir)
+{
+    edfs_fsck_t *fsck = t->fsck;
+    const edfs_super_block_t *sb = &fsck->img->sb;
+    const bool hashed = fsck->img->inodes[dir].flags & EDFS_INODE_FLAG_HASHED;
+    const int n_slots = edfs_get_n_dir_entries_per_block(sb);
+
+    /* Bad block references were reported in pass 1. */
+    uint32_t n_blocks;
+    edfs_block_t indirect;
+    if (!edfs_fsck_inode_blocks(fsck, NULL, dir, t->buf, t->blocks,
+                                &n_blocks, &indirect))
+        return;
+
+    if (!hashed)
+        n_blocks = EDFS_INODE_N_DIRECT_BLOCKS;
+
+    /* The overflow flags of all buckets are needed to check that each
+     * entry is reachable, so those are read before the entries.
+     */
+    bool *overflow = NULL;
+    if (hashed)
+    {
+        overflow = calloc(n_blocks, sizeof(bool));
+        if (!overflow)
+        {
+            edfs_fsck_error(&t->log, "out of memory checking directory %u.",
+                            dir);
+            return;
+        }
+
+        for (uint32_t b = 0; b < n_blocks; b++)
+        {
+            if (t->blocks[b] == EDFS_BLOCK_INVALID)
+                continue;
+
+            const uint8_t *data = edfs_fsck_read_block(fsck, t->blocks[b],
+                                                       t->buf);
+            if (data)
+                overflow[b] = ((const edfs_dir_entry_t *)data)[0]
+                    .filename[EDFS_DIR_BUCKET_OVERFLOW];
+        }
+    }
+
+    for (uint32_t b = 0; b < n_blocks; b++)
+    {
+        if (t->blocks[b] == EDFS_BLOCK_INVALID)
+            continue;
+
+        const uint8_t *data = edfs_fsck_read_block(fsck, t->blocks[b], t->buf);
+        if (!data)
+        {
+            edfs_fsck_error(&t->log, "directory %u: could not read block %u.",
+                            dir, t->blocks[b]);
+            continue;
+        }
+
+        for (int s = hashed ? 1 : 0; s < n_slots; s++)
+        {
+            edfs_dir_entry_t entry;
+            memcpy(&entry, data + s * sizeof(edfs_dir_entry_t),
+                   sizeof(edfs_dir_entry_t));
+            if (entry.inumber == 0)
+                continue;
+
+            edfs_fsck_check_entry(t, dir, &entry);
+
+            entry.filename[EDFS_FILENAME_SIZE - 1] = 0;
+            if (hashed &&
+                !edfs_fsck_hashed_reachable(fsck, t->blocks, overflow, b,
+                                            entry.filename))
+                edfs_fsck_error(&t->log, "directory %u: '%s' in bucket %u "
+                                "is not reachable from its home bucket.",
+                                dir, entry.filename, b);
+        }
+    }
+
+    free(overflow);
+}
+
+static void
+edfs_fsck_pass_dirs(edfs_fsck_thread_t *t)
+{
+    edfs_fsck_t *fsck = t->fsck;
+
+    while (true)
+    {
+        edfs_inumber_t dir;
+        bool found = edfs_fsck_deque_take(&t->deque, false, &dir);
+
+        for (int i = 1; i < fsck->n_threads && !found; i++)
+        {
+            edfs_fsck_thread_t *victim =
+                &fsck->threads[(t->id + i) % fsck->n_threads];
+            found = edfs_fsck_deque_take(&victim->deque, true, &dir);
+        }
+
+        if (!found)
+        {
+            /* A directory still being read may queue more. */
+            if (__atomic_load_n(&fsck->pending, __ATOMIC_ACQUIRE) == 0)
+                break;
+
+            sched_yield();
+            continue;
+        }
+
+        edfs_fsck_check_dir(t, dir);
+        t->n_dirs++;
+
+        __atomic_fetch_sub(&fsck->pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Pass 3: bitmap
+ */
+
+/* Reports the inodes that refer to the blocks set in @dups. */
+static void
+edfs_fsck_report_dups(edfs_fsck_t *fsck, const uint64_t *dups)
+{
+    edfs_image_t *img = fsck->img;
+    edfs_fsck_thread_t *t = &fsck->threads[0];
+
+    edfs_inumber_t *owner = calloc(img->sb.n_blocks, sizeof(edfs_inumber_t));
+    if (!owner)
+    {
+        edfs_fsck_error(&t->log, "out of memory looking up duplicate blocks.");
+        return;
+    }
+
+    for (edfs_inumber_t i = 1; i < img->sb.inode_table_n_inodes; i++)
+    {
+        uint32_t n_blocks;
+        edfs_block_t indirect;
+
+        if (img->inodes[i].type == EDFS_INODE_TYPE_FREE ||
+            !edfs_fsck_inode_blocks(fsck, NULL, i, t->buf, t->blocks,
+                                    &n_blocks, &indirect))
+            continue;
+
+        t->blocks[n_blocks++] = indirect;
+
+        for (uint32_t k = 0; k < n_blocks; k++)
+        {
+            edfs_block_t block = t->blocks[k];
+            if (block == EDFS_BLOCK_INVALID || !edfs_fsck_test(dups, block))
+                continue;
+
+            if (owner[block] != 0)
+                edfs_fsck_error(&t->log, "block %u referenced by inode %u "
+                                "and inode %u.", block, owner[block], i);
+            owner[block] = i;
+        }
+    }
+
+    free(owner);
+}
+
+/* Sets the tail blocks of all valid inline files in @refs. Every unit
+ * of a tail block may only hold the data of one file and a tail block
+ * cannot be referred to as a block of an inode as well.
+ */
+static void
+edfs_fsck_check_tails(edfs_fsck_t *fsck, uint64_t *refs)
+{
+    edfs_image_t *img = fsck->img;
+    edfs_fsck_log_t *log = &fsck->threads[0].log;
+
+    const uint32_t n_unit_words =
+        (img->sb.block_size / EDFS_TAIL_UNIT_SIZE + 63) / 64;
+    uint64_t *units = NULL;
+    uint64_t *tails = NULL;
+
+    for (edfs_inumber_t i = 1; i < img->sb.inode_table_n_inodes; i++)
+    {
+        const edfs_disk_inode_t *inode = &img->inodes[i];
+        if (!edfs_disk_inode_is_inline(inode) ||
+            inode->direct[0] != EDFS_BLOCK_INVALID ||
+            inode->direct[1] != EDFS_BLOCK_INVALID ||
+            inode->indirect != EDFS_BLOCK_INVALID ||
+            !edfs_fsck_check_inline(fsck, NULL, i))
+            continue;
+
+        if (!units)
+        {
+            units = calloc((size_t)img->sb.n_blocks * n_unit_words,
+                           sizeof(uint64_t));
+            tails = calloc(fsck->n_words, sizeof(uint64_t));
+            if (!units || !tails)
+            {
+                edfs_fsck_error(log, "out of memory checking tail blocks.");
+                break;
+            }
+        }
+
+        const edfs_block_t block = inode->tail;
+        uint64_t *map = units + (size_t)block * n_unit_words;
+        uint32_t first = inode->tail_off / EDFS_TAIL_UNIT_SIZE;
+        uint32_t n = (inode->size + EDFS_TAIL_UNIT_SIZE - 1) / EDFS_TAIL_UNIT_SIZE;
+
+        if (!edfs_fsck_test(tails, block) && edfs_fsck_test(refs, block))
+            edfs_fsck_error(log, "block %u is a tail block and referenced "
+                            "by an inode as well.", block);
+        tails[block / 64] |= (uint64_t)1 << (block % 64);
+
+        bool overlap = false;
+        for (uint32_t u = first; u < first + n; u++)
+        {
+            overlap |= edfs_fsck_test(map, u);
+            map[u / 64] |= (uint64_t)1 << (u % 64);
+        }
+
+        if (overlap)
+            edfs_fsck_error(log, "inode %u: inline data overlaps with that of "
+                            "another file in tail block %u.", i, block);
+    }
+
+    for (uint32_t w = 0; tails && w < fsck->n_words; w++)
+        refs[w] |= tails[w];
+
+    free(units);
+    free(tails);
+}
+
+static void
+edfs_fsck_pass_bitmap(edfs_fsck_t *fsck)
+{
+    const edfs_super_block_t *sb = &fsck->img->sb;
+    edfs_fsck_log_t *log = &fsck->threads[0].log;
+
+    uint64_t *refs = calloc(fsck->n_words, sizeof(uint64_t));
+    uint64_t *dups = calloc(fsck->n_words, sizeof(uint64_t));
+    if (!refs || !dups)
+    {
+        edfs_fsck_error(log, "out of memory merging reference bitmaps.");
+        free(refs);
+        free(dups);
+        return;
+    }
+
+    bool any_dups = false;
+    for (uint32_t w = 0; w < fsck->n_words; w++)
+    {
+        for (int i = 0; i < fsck->n_threads; i++)
+        {
+            const edfs_fsck_thread_t *t = &fsck->threads[i];
+
+            dups[w] |= t->dups[w] | (refs[w] & t->refs[w]);
+            refs[w] |= t->refs[w];
+        }
+        any_dups |= dups[w] != 0;
+    }
+
+    if (any_dups)
+        edfs_fsck_report_dups(fsck, dups);
+
+    edfs_fsck_check_tails(fsck, refs);
+
+    /* Blocks below the data area and the journal are in use without an
+     * inode referring to them.
+     */
+    for (edfs_block_t b = 0; b < fsck->data_start; b++)
+        refs[b / 64] |= (uint64_t)1 << (b % 64);
+    for (uint32_t b = sb->journal_start;
+         b < (uint32_t)sb->journal_start + sb->journal_n_blocks; b++)
+        refs[b / 64] |= (uint64_t)1 << (b % 64);
+
+    for (uint32_t w = 0; w < fsck->n_words; w++)
+    {
+        uint64_t disk;
+        memcpy(&disk, fsck->img->bitmap + w * 8, sizeof(uint64_t));
+
+        /* Bits past the last block do not count. */
+        if (w == fsck->n_words - 1 && sb->n_blocks % 64)
+            disk &= ((uint64_t)1 << (sb->n_blocks % 64)) - 1;
+
+        for (uint64_t diff = disk ^ refs[w]; diff; diff &= diff - 1)
+        {
+            int bit = __builtin_ctzll(diff);
+            uint32_t block = w * 64 + bit;
+
+            if (disk >> bit & 1)
+                edfs_fsck_error(log, "block %u marked in the bitmap but not "
+                                "referenced (leaked).", block);
+            else
+                edfs_fsck_error(log, "block %u referenced but not marked in "
+                                "the bitmap.", block);
+        }
+    }
+
+    free(refs);
+    free(dups);
+}
+
+static void *
+edfs_fsck_inodes_main(void *arg)
+{
+    edfs_fsck_pass_inodes(arg);
+
+    return NULL;
+}
+
+static void *
+edfs_fsck_dirs_main(void *arg)
+{
+    edfs_fsck_pass_dirs(arg);
+
+    return NULL;
+}
+
+/* Runs @func on every thread of the pool, the calling thread being
+ * thread 0.
+ */
+static bool
+edfs_fsck_run(edfs_fsck_t *fsck, void *(*func)(void *))
+{
+    int n_started = 1;
+    bool ok = true;
+
+    for (int i = 1; i < fsck->n_threads; i++, n_started++)
+        if (pthread_create(&fsck->threads[i].thread, NULL, func,
+                           &fsck->threads[i]) != 0)
+        {
+            ok = false;
+            break;
+        }
+
+    /* Whatever was not started is picked up by the others, through
+     * the chunk counter or by stealing.
+     */
+    func(&fsck->threads[0]);
+
+    for (int i = 1; i < n_started; i++)
+        pthread_join(fsck->threads[i].thread, NULL);
+
+    return ok;
+}
+
+static bool
+edfs_fsck_init(edfs_fsck_t *fsck, edfs_image_t *img, int n_threads)
+{
+    const edfs_super_block_t *sb = &img->sb;
+
+    memset(fsck, 0, sizeof(edfs_fsck_t));
+    fsck->img = img;
+    fsck->n_threads = n_threads;
+    fsck->data_start = edfs_get_data_block_start(sb);
+    fsck->n_words = (sb->n_blocks + 63) / 64;
+    fsck->n_indirect = edfs_get_n_blocks_per_indirect_block(sb);
+    fsck->n_chunks = (sb->inode_table_n_inodes + EDFS_FSCK_CHUNK_SIZE - 1) /
+        EDFS_FSCK_CHUNK_SIZE;
+
+    fsck->threads = calloc(n_threads, sizeof(edfs_fsck_thread_t));
+    fsck->chunk_logs = calloc(fsck->n_chunks, sizeof(edfs_fsck_log_t));
+    fsck->links = calloc(sb->inode_table_n_inodes, sizeof(uint8_t));
+    if (!fsck->threads || !fsck->chunk_logs || !fsck->links)
+        return false;
+
+    for (int i = 0; i < n_threads; i++)
+    {
+        edfs_fsck_thread_t *t = &fsck->threads[i];
+
+        t->fsck = fsck;
+        t->id = i;
+        pthread_mutex_init(&t->deque.lock, NULL);
+
+        t->refs = calloc(fsck->n_words, sizeof(uint64_t));
+        t->dups = calloc(fsck->n_words, sizeof(uint64_t));
+        t->buf = malloc(sb->block_size);
+
+        /* One extra slot for the indirect block, see
+         * edfs_fsck_report_dups().
+         */
+        t->blocks = malloc((EDFS_INODE_N_DIRECT_BLOCKS + fsck->n_indirect + 1) *
+                           sizeof(edfs_block_t));
+        if (!t->refs || !t->dups || !t->buf || !t->blocks)
+            return false;
+    }
+
+    return true;
+}
+
+static void
+edfs_fsck_free(edfs_fsck_t *fsck)
+{
+    for (int i = 0; fsck->threads && i < fsck->n_threads; i++)
+    {
+        edfs_fsck_thread_t *t = &fsck->threads[i];
+
+        pthread_mutex_destroy(&t->deque.lock);
+        free(t->deque.items);
+        free(t->refs);
+        free(t->dups);
+        free(t->buf);
+        free(t->blocks);
+    }
+
+    free(fsck->threads);
+    free(fsck->chunk_logs);
+    free(fsck->links);
+}
+
+/* Checks the file system in @img, returns the number of errors found or
+ * -1 if the check could not be completed.
+ */
+static int
+edfs_fsck_check(edfs_image_t *img, int n_threads)
+{
+    const edfs_super_block_t *sb = &img->sb;
+    edfs_fsck_t fsck;
+    int ret = -1;
+
+    if (!edfs_fsck_init(&fsck, img, n_threads))
+    {
+        fprintf(stderr, "error: out of memory.\n");
+        goto out;
+    }
+
+    uint64_t start = edfs_stats_now();
+
+    printf("1. checking inodes.\n");
+    if (!edfs_fsck_run(&fsck, edfs_fsck_inodes_main))
+        fprintf(stderr, "warning: could not start all threads.\n");
+    for (uint32_t i = 0; i < fsck.n_chunks; i++)
+        edfs_fsck_log_flush(&fsck, &fsck.chunk_logs[i]);
+
+    printf("2. checking directory structure.\n");
+    if (sb->root_inumber == 0 || sb->root_inumber >= sb->inode_table_n_inodes ||
+        img->inodes[sb->root_inumber].type != EDFS_INODE_TYPE_DIRECTORY)
+        edfs_fsck_error(&fsck.threads[0].log, "root inode %u is not a "
+                        "directory.", sb->root_inumber);
+    else
+    {
+        fsck.links[sb->root_inumber] = 1;
+        fsck.pending = 1;
+        if (!edfs_fsck_deque_push(&fsck.threads[0].deque, sb->root_inumber))
+        {
+            fprintf(stderr, "error: out of memory.\n");
+            goto out;
+        }
+
+        if (!edfs_fsck_run(&fsck, edfs_fsck_dirs_main))
+            fprintf(stderr, "warning: could not start all threads.\n");
+    }
+
+    uint32_t n_dirs = 0;
+    for (int i = 0; i < n_threads; i++)
+    {
+        n_dirs += fsck.threads[i].n_dirs;
+        edfs_fsck_log_flush(&fsck, &fsck.threads[i].log);
+    }
+
+    uint32_t n_used = 0;
+    for (edfs_inumber_t i = 1; i < sb->inode_table_n_inodes; i++)
+    {
+        if (img->inodes[i].type == EDFS_INODE_TYPE_FREE)
+            continue;
+
+        n_used++;
+        if (fsck.links[i] == 0)
+            edfs_fsck_error(&fsck.threads[0].log, "orphan inode %u.", i);
+    }
+    edfs_fsck_log_flush(&fsck, &fsck.threads[0].log);
+
+    printf("3. checking bitmap consistency.\n");
+    edfs_fsck_pass_bitmap(&fsck);
+    edfs_fsck_log_flush(&fsck, &fsck.threads[0].log);
+
+    printf("%u inodes in use, %u directories, %d threads, %.3f s\n",
+           n_used, n_dirs, n_threads, (edfs_stats_now() - start) / 1e9);
+
+    ret = fsck.n_errors;
+
+out:
+    edfs_fsck_free(&fsck);
+
+    return ret;
+}
+
+static void
+edfs_fsck_usage(const char *argv0)
+{
+    fprintf(stderr, "usage: %s [--mmap] [-t threads] <image-filename>\n",
+            argv0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    edfs_io_mode_t io_mode = EDFS_IO_PREAD;
+    const char *filename = NULL;
+    long n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--mmap") == 0)
+            io_mode = EDFS_IO_MMAP;
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+            n_threads = strtol(argv[++i], NULL, 0);
+        else if (argv[i][0] != '-' && !filename)
+            filename = argv[i];
+        else
+        {
+            edfs_fsck_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (!filename || n_threads < 1)
+    {
+        edfs_fsck_usage(argv[0]);
+        return 2;
+    }
+    if (n_threads > EDFS_FSCK_MAX_THREADS)
+        n_threads = EDFS_FSCK_MAX_THREADS;
+
+    edfs_image_t *img = edfs_image_open(filename, true, io_mode);
+    if (!img)
+        return 2;
+
+    int n_errors = edfs_fsck_check(img, n_threads);
+
+    edfs_image_close(img);
+
+    if (n_errors < 0)
+        return 2;
+    else if (n_errors > 0)
+    {
+        printf("%d errors found.\n", n_errors);
+        return 1;
+    }
+
+    printf("File system check completed successfully.\n");
+
+    return 0;
+}
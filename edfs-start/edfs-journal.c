@@ -0,0 +1,692 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/*
+ * Write-ahead metadata journal
+ *
+ * When the image has a journal, the inode table, the bitmap and the
+ * metadata blocks in the cache (directory blocks and indirect blocks)
+ * are no longer written in place as they are modified. Operations are
+ * instead grouped into transactions that are committed together:
+ *
+ *   1. dirty data blocks are written back, so that committed metadata
+ *      never refers to blocks with stale contents;
+ *   2. the modified metadata is copied into the journal area, a header
+ *      block followed by the payload, and synced to disk;
+ *   3. the same records are written to their home locations.
+ *
+ * The journal holds a single transaction. Every commit starts with a
+ * sync, which also makes the home location writes of the previous
+ * transaction durable before it is overwritten. A transaction that
+ * does not fit is split, in which case only the parts are atomic.
+ *
+ * On mount a transaction with a valid checksum is written to its home
+ * locations again, which is harmless if it already was.
+ *
+ * Operations that modify metadata are bracketed by edfs_journal_start()
+ * and edfs_journal_stop(), which take op_lock shared; a commit takes it
+ * exclusively so it never sees a half-finished operation. op_lock comes
+ * before all other locks.
+ *
+ * The exception is edfs_journal_commit_pinned(), run by the cache when
+ * the modified metadata blocks fill it. It commits without op_lock, so
+ * like a transaction that does not fit it is only atomic in parts:
+ * the operations in flight are committed halfway. What they modify
+ * after their part was copied stays dirty for the next transaction.
+ */
+
+#include "edfs-common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EDFS_JOURNAL_MAGIC 0x4c4e524a   /* "JRNL" */
+
+/* States of the inode table flags in journal->inode_dirty. */
+#define EDFS_JOURNAL_DIRTY  1
+#define EDFS_JOURNAL_COPIED 2
+
+/* Start of the header block. The record table follows the header; the
+ * payload, the records' contents back to back, starts at the next block.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint16_t n_records;
+    uint16_t reserved;
+    uint32_t payload_size;
+    uint32_t checksum;          /* FNV-1a, computed with this field 0 */
+} __attribute__((__packed__)) edfs_journal_header_t;
+
+typedef struct
+{
+    uint32_t off;               /* byte offset within the image */
+    uint32_t size;              /* at most one block */
+} __attribute__((__packed__)) edfs_journal_record_t;
+
+struct edfs_journal
+{
+    /* Held shared by operations, exclusively by a commit. */
+    pthread_rwlock_t op_lock;
+
+    /* Protects n_ops and last_commit. */
+    pthread_mutex_t lock;
+    uint32_t n_ops;
+    time_t last_commit;
+
+    /* Serializes commits, taken after op_lock. */
+    pthread_mutex_t commit_lock;
+
+    uint32_t seq;
+    uint16_t max_records;
+    uint32_t capacity;          /* payload bytes */
+
+    /* One flag per block of the inode table, protected by
+     * img->inode_lock: EDFS_JOURNAL_DIRTY if modified, or
+     * EDFS_JOURNAL_COPIED once copied into the transaction.
+     */
+    uint8_t *inode_dirty;
+    uint32_t n_inode_chunks;
+
+    /* Transaction being assembled, as it is written to the journal. */
+    uint8_t *buf;
+    edfs_io_req_t *reqs;
+};
+
+static inline edfs_journal_header_t *
+edfs_journal_header(uint8_t *buf)
+{
+    return (edfs_journal_header_t *)buf;
+}
+
+static inline edfs_journal_record_t *
+edfs_journal_records(uint8_t *buf)
+{
+    return (edfs_journal_record_t *)(buf + sizeof(edfs_journal_header_t));
+}
+
+static inline uint16_t
+edfs_journal_max_records(const edfs_super_block_t *sb)
+{
+    return (sb->block_size - sizeof(edfs_journal_header_t)) /
+        sizeof(edfs_journal_record_t);
+}
+
+static inline uint32_t
+edfs_journal_capacity(const edfs_super_block_t *sb)
+{
+    return (uint32_t)(sb->journal_n_blocks - 1) * sb->block_size;
+}
+
+static uint32_t
+edfs_journal_fnv1a(uint32_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/* Checksum over the header, record table and payload in @buf. */
+static uint32_t
+edfs_journal_checksum(const edfs_super_block_t *sb, uint8_t *buf)
+{
+    edfs_journal_header_t header = *edfs_journal_header(buf);
+    header.checksum = 0;
+
+    uint32_t hash = edfs_journal_fnv1a(2166136261u, &header, sizeof(header));
+    hash = edfs_journal_fnv1a(hash, edfs_journal_records(buf),
+                              header.n_records * sizeof(edfs_journal_record_t));
+    return edfs_journal_fnv1a(hash, buf + sb->block_size, header.payload_size);
+}
+
+/* Returns true if @buf holds a complete transaction for @img. */
+static bool
+edfs_journal_valid(edfs_image_t *img, uint8_t *buf)
+{
+    const edfs_super_block_t *sb = &img->sb;
+    const edfs_journal_header_t *header = edfs_journal_header(buf);
+
+    if (header->magic != EDFS_JOURNAL_MAGIC ||
+        header->n_records > edfs_journal_max_records(sb) ||
+        header->payload_size > edfs_journal_capacity(sb))
+        return false;
+
+    /* Only the bitmap, inode table and data area are journaled. */
+    const uint64_t journal_lo = edfs_get_block_offset(sb, sb->journal_start);
+    const uint64_t journal_hi = journal_lo +
+        (uint64_t)sb->journal_n_blocks * sb->block_size;
+    const edfs_journal_record_t *records = edfs_journal_records(buf);
+    uint64_t total = 0;
+
+    for (uint16_t i = 0; i < header->n_records; i++)
+    {
+        uint64_t off = records[i].off;
+        uint64_t end = off + records[i].size;
+
+        if (records[i].size > sb->block_size || off < sb->bitmap_start ||
+            end > (uint64_t)edfs_get_size(sb) ||
+            (off < journal_hi && end > journal_lo))
+            return false;
+
+        total += records[i].size;
+    }
+
+    return total == header->payload_size &&
+        header->checksum == edfs_journal_checksum(sb, buf);
+}
+
+/* Writes the records of the transaction in @buf to their home
+ * locations, as one batch.
+ */
+static int
+edfs_journal_apply(edfs_image_t *img, uint8_t *buf, edfs_io_req_t *reqs)
+{
+    const edfs_journal_header_t *header = edfs_journal_header(buf);
+    const edfs_journal_record_t *records = edfs_journal_records(buf);
+    uint8_t *data = buf + img->sb.block_size;
+
+    for (uint16_t i = 0; i < header->n_records; i++)
+    {
+        reqs[i].iov[0].iov_base = data;
+        reqs[i].iov[0].iov_len = records[i].size;
+        reqs[i].n_iov = 1;
+        reqs[i].off = records[i].off;
+        reqs[i].write = true;
+
+        data += records[i].size;
+    }
+
+    int ret = edfs_image_submit(img, reqs, header->n_records);
+    edfs_stats_io_reqs(img, EDFS_SITE_JOURNAL, reqs, header->n_records);
+
+    return ret;
+}
+
+/* Applies a committed transaction left behind in the journal and clears
+ * it. Called right after the super block is read, before any other
+ * metadata is loaded. Returns true if the image can be used.
+ */
+bool
+edfs_journal_replay(edfs_image_t *img)
+{
+    const edfs_super_block_t *sb = &img->sb;
+
+    if (sb->journal_n_blocks == 0)
+        return true;
+
+    if (sb->journal_n_blocks < 2)
+    {
+        fprintf(stderr, "error: file '%s': journal too small.\n",
+                img->filename);
+        return false;
+    }
+
+    const size_t size = (size_t)sb->journal_n_blocks * sb->block_size;
+    const off_t off = edfs_get_block_offset(sb, sb->journal_start);
+
+    uint8_t *buf = malloc(size);
+    edfs_io_req_t *reqs = malloc(edfs_journal_max_records(sb) *
+                                 sizeof(edfs_io_req_t));
+    if (!buf || !reqs)
+    {
+        fprintf(stderr, "error: file '%s': out of memory reading journal.\n",
+                img->filename);
+        free(buf);
+        free(reqs);
+        return false;
+    }
+
+    bool ok = true;
+    ssize_t ret = pread(img->fd, buf, size, off);
+    edfs_stats_io(img, EDFS_SITE_JOURNAL, false, ret);
+    if (ret != (ssize_t)size)
+    {
+        fprintf(stderr, "error: file '%s': could not read journal.\n",
+                img->filename);
+        ok = false;
+    }
+    else if (edfs_journal_header(buf)->magic == EDFS_JOURNAL_MAGIC)
+    {
+        /* An invalid transaction was not committed completely, the
+         * previous one is already in place.
+         */
+        if (edfs_journal_valid(img, buf))
+        {
+            ok = edfs_journal_apply(img, buf, reqs) == 0 &&
+                fdatasync(img->fd) == 0;
+            if (!ok)
+                fprintf(stderr, "error: file '%s': could not replay journal.\n",
+                        img->filename);
+        }
+
+        memset(buf, 0, sb->block_size);
+        if (ok)
+        {
+            ret = pwrite(img->fd, buf, sb->block_size, off);
+            edfs_stats_io(img, EDFS_SITE_JOURNAL, true, ret);
+            if (ret != sb->block_size || fdatasync(img->fd) < 0)
+            {
+                fprintf(stderr, "error: file '%s': could not clear journal.\n",
+                        img->filename);
+                ok = false;
+            }
+        }
+    }
+
+    free(buf);
+    free(reqs);
+
+    return ok;
+}
+
+bool
+edfs_journal_init(edfs_image_t *img)
+{
+    const edfs_super_block_t *sb = &img->sb;
+
+    edfs_journal_t *journal = calloc(1, sizeof(edfs_journal_t));
+    if (!journal)
+        return false;
+
+    journal->seq = 1;
+    journal->max_records = edfs_journal_max_records(sb);
+    journal->capacity = edfs_journal_capacity(sb);
+    journal->n_inode_chunks =
+        (sb->inode_table_n_inodes * sizeof(edfs_disk_inode_t) +
+         sb->block_size - 1) / sb->block_size;
+
+    journal->inode_dirty = calloc(journal->n_inode_chunks, 1);
+    journal->buf = calloc(sb->journal_n_blocks, sb->block_size);
+    journal->reqs = malloc(journal->max_records * sizeof(edfs_io_req_t));
+    if (!journal->inode_dirty || !journal->buf || !journal->reqs)
+    {
+        fprintf(stderr, "error: file '%s': out of memory allocating journal.\n",
+                img->filename);
+        free(journal->inode_dirty);
+        free(journal->buf);
+        free(journal->reqs);
+        free(journal);
+        return false;
+    }
+
+    pthread_rwlock_init(&journal->op_lock, NULL);
+    pthread_mutex_init(&journal->lock, NULL);
+    pthread_mutex_init(&journal->commit_lock, NULL);
+    journal->last_commit = time(NULL);
+
+    img->journal = journal;
+
+    return true;
+}
+
+/* Releases the journal, uncommitted modifications are lost. */
+void
+edfs_journal_free(edfs_image_t *img)
+{
+    edfs_journal_t *journal = img->journal;
+    if (!journal)
+        return;
+
+    pthread_rwlock_destroy(&journal->op_lock);
+    pthread_mutex_destroy(&journal->lock);
+    pthread_mutex_destroy(&journal->commit_lock);
+    free(journal->inode_dirty);
+    free(journal->buf);
+    free(journal->reqs);
+    free(journal);
+    img->journal = NULL;
+}
+
+/* Adds a journal to an image that has none. The journal is allocated as
+ * one contiguous run in the data area.
+ */
+int
+edfs_journal_create(edfs_image_t *img)
+{
+    edfs_super_block_t *sb = &img->sb;
+
+    if (img->journal || sb->journal_n_blocks > 0)
+        return -EEXIST;
+    if (img->map)
+        return -EOPNOTSUPP;
+
+    edfs_block_t start;
+    int n = edfs_get_new_blocks(img, EDFS_JOURNAL_N_BLOCKS,
+                                edfs_get_data_block_start(sb), &start);
+    if (n < 0)
+        return n;
+    else if (n < EDFS_JOURNAL_N_BLOCKS)
+    {
+        for (int i = 0; i < n; i++)
+            edfs_bitmap_clear(img, start + i);
+        edfs_bitmap_flush(img);
+        return -ENOSPC;
+    }
+
+    /* The blocks may hold anything, only the header needs clearing. */
+    uint8_t zero[EDFS_MAX_BLOCK_SIZE] = { 0, };
+    ssize_t ret = edfs_image_pwrite(img, zero, sb->block_size,
+                                    edfs_get_block_offset(sb, start));
+    edfs_stats_io(img, EDFS_SITE_JOURNAL, true, ret);
+    if (ret != sb->block_size)
+        return -EIO;
+
+    sb->journal_magic = EDFS_JOURNAL_SB_MAGIC;
+    sb->journal_start = start;
+    sb->journal_n_blocks = EDFS_JOURNAL_N_BLOCKS;
+
+    int res = edfs_bitmap_flush(img);
+    if (res < 0)
+        return res;
+
+    ret = edfs_image_pwrite(img, sb, sizeof(edfs_super_block_t),
+                            EDFS_SUPER_BLOCK_OFFSET);
+    edfs_stats_io(img, EDFS_SITE_SUPER, true, ret);
+    if (ret != sizeof(edfs_super_block_t) || fsync(img->fd) < 0)
+        return -EIO;
+
+    return edfs_journal_init(img) ? 0 : -ENOMEM;
+}
+
+void
+edfs_journal_mark_inode(edfs_image_t *img, edfs_inumber_t inumber)
+{
+    uint32_t chunk = inumber * sizeof(edfs_disk_inode_t) / img->sb.block_size;
+
+    img->journal->inode_dirty[chunk] = EDFS_JOURNAL_DIRTY;
+}
+
+void
+edfs_journal_start(edfs_image_t *img)
+{
+    if (img->journal)
+        pthread_rwlock_rdlock(&img->journal->op_lock);
+}
+
+void
+edfs_journal_stop(edfs_image_t *img)
+{
+    edfs_journal_t *journal = img->journal;
+    if (!journal)
+        return;
+
+    pthread_mutex_lock(&journal->lock);
+    bool due = ++journal->n_ops >= EDFS_JOURNAL_MAX_OPS ||
+        time(NULL) - journal->last_commit >= EDFS_JOURNAL_COMMIT_INTERVAL;
+    pthread_mutex_unlock(&journal->lock);
+
+    pthread_rwlock_unlock(&journal->op_lock);
+
+    /* Pinned blocks cannot be evicted, do not let them fill the cache. */
+    if (due || edfs_cache_n_meta(img) > EDFS_CACHE_N_SLOTS / 4)
+        edfs_journal_commit(img);
+}
+
+/* Writes the transaction assembled in journal->buf to the journal and
+ * then to the home locations.
+ */
+static int
+edfs_journal_write(edfs_image_t *img)
+{
+    edfs_journal_t *journal = img->journal;
+    edfs_journal_header_t *header = edfs_journal_header(journal->buf);
+    const uint16_t BLK_SIZE = img->sb.block_size;
+
+    if (header->n_records == 0)
+        return 0;
+
+    header->magic = EDFS_JOURNAL_MAGIC;
+    header->seq = journal->seq++;
+    header->checksum = edfs_journal_checksum(&img->sb, journal->buf);
+
+    size_t len = BLK_SIZE + (header->payload_size + BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE;
+    off_t off = edfs_get_block_offset(&img->sb, img->sb.journal_start);
+
+    /* The data written back and the home locations of the previous
+     * transaction must be on disk before the journal is overwritten.
+     */
+    if (fdatasync(img->fd) < 0)
+        return -errno;
+
+    ssize_t ret = edfs_image_pwrite(img, journal->buf, len, off);
+    edfs_stats_io(img, EDFS_SITE_JOURNAL, true, ret);
+    if (ret < 0)
+        return -errno;
+    else if ((size_t)ret != len)
+        return -EIO;
+
+    if (fdatasync(img->fd) < 0)
+        return -errno;
+
+    edfs_stats_count(img, EDFS_STAT_JOURNAL_COMMIT);
+
+    ret = edfs_journal_apply(img, journal->buf, journal->reqs);
+
+    header->n_records = 0;
+    header->payload_size = 0;
+
+    return ret;
+}
+
+/* Adds a record of @size bytes at image offset @off to the transaction
+ * and returns where its contents are to be stored in *data. A full
+ * transaction is written first.
+ */
+static int
+edfs_journal_add(edfs_image_t *img, off_t off, uint32_t size, uint8_t **data)
+{
+    edfs_journal_t *journal = img->journal;
+    edfs_journal_header_t *header = edfs_journal_header(journal->buf);
+
+    if (header->n_records == journal->max_records ||
+        header->payload_size + size > journal->capacity)
+    {
+        int ret = edfs_journal_write(img);
+        if (ret < 0)
+            return ret;
+    }
+
+    edfs_journal_record_t *record = &edfs_journal_records(journal->buf)[header->n_records++];
+    record->off = off;
+    record->size = size;
+
+    *data = journal->buf + img->sb.block_size + header->payload_size;
+    header->payload_size += size;
+
+    return 0;
+}
+
+static int
+edfs_journal_add_inodes(edfs_image_t *img)
+{
+    edfs_journal_t *journal = img->journal;
+    const uint16_t BLK_SIZE = img->sb.block_size;
+    const uint32_t table_size = img->sb.inode_table_n_inodes * sizeof(edfs_disk_inode_t);
+    int ret = 0;
+
+    pthread_mutex_lock(&img->inode_lock);
+    for (uint32_t i = 0; i < journal->n_inode_chunks && ret == 0; i++)
+    {
+        if (journal->inode_dirty[i] != EDFS_JOURNAL_DIRTY)
+            continue;
+
+        uint32_t start = i * BLK_SIZE;
+        uint32_t size = table_size - start < BLK_SIZE ? table_size - start : BLK_SIZE;
+        uint8_t *data;
+
+        ret = edfs_journal_add(img, img->sb.inode_table_start + start, size, &data);
+        if (ret == 0)
+        {
+            memcpy(data, (uint8_t *)img->inodes + start, size);
+            journal->inode_dirty[i] = EDFS_JOURNAL_COPIED;
+        }
+    }
+    pthread_mutex_unlock(&img->inode_lock);
+
+    return ret;
+}
+
+/* Copies the dirty range of the bitmap into the transaction and clears
+ * it, storing the range copied in [*lo, *hi).
+ */
+static int
+edfs_journal_add_bitmap(edfs_image_t *img, uint32_t *lo, uint32_t *hi)
+{
+    const uint16_t BLK_SIZE = img->sb.block_size;
+    int ret = 0;
+
+    pthread_mutex_lock(&img->alloc_lock);
+    *lo = img->bitmap_dirty_lo;
+    *hi = img->bitmap_dirty_hi;
+    for (uint32_t off = *lo; off < *hi && ret == 0; off += BLK_SIZE)
+    {
+        uint32_t size = *hi - off < BLK_SIZE ? *hi - off : BLK_SIZE;
+        uint8_t *data;
+
+        ret = edfs_journal_add(img, img->sb.bitmap_start + off, size, &data);
+        if (ret == 0)
+            memcpy(data, img->bitmap + off, size);
+    }
+    img->bitmap_dirty_lo = UINT32_MAX;
+    img->bitmap_dirty_hi = 0;
+    pthread_mutex_unlock(&img->alloc_lock);
+
+    return ret;
+}
+
+static int
+edfs_journal_add_blocks(edfs_image_t *img, const edfs_block_t *blocks, int n)
+{
+    const uint16_t BLK_SIZE = img->sb.block_size;
+
+    for (int i = 0; i < n; i++)
+    {
+        uint8_t *data;
+        int ret = edfs_journal_add(img, edfs_get_block_offset(&img->sb, blocks[i]),
+                                   BLK_SIZE, &data);
+        if (ret == 0)
+            ret = edfs_cache_read(img, blocks[i], data, 0, BLK_SIZE,
+                                  EDFS_SITE_JOURNAL);
+        if (ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+/* Commits the metadata modified since the previous commit, with
+ * journal->commit_lock held. Returns the number of cached blocks that
+ * were unpinned, or a negative error code.
+ */
+static int
+edfs_journal_commit_locked(edfs_image_t *img)
+{
+    edfs_journal_t *journal = img->journal;
+
+    edfs_block_t blocks[EDFS_CACHE_N_SLOTS];
+    uint64_t seqs[EDFS_CACHE_N_SLOTS];
+    int n_blocks = edfs_cache_get_meta(img, blocks, seqs, EDFS_CACHE_N_SLOTS);
+    uint32_t lo = UINT32_MAX, hi = 0;
+
+    int ret = edfs_cache_flush(img);
+    if (ret == 0)
+        ret = edfs_journal_add_inodes(img);
+    if (ret == 0)
+        ret = edfs_journal_add_bitmap(img, &lo, &hi);
+    if (ret == 0)
+        ret = edfs_journal_add_blocks(img, blocks, n_blocks);
+    if (ret == 0)
+        ret = edfs_journal_write(img);
+
+    /* Parts modified again after they were copied stay dirty, on failure
+     * the copied ones are marked dirty again, to be retried next time.
+     */
+    uint8_t state = ret == 0 ? 0 : EDFS_JOURNAL_DIRTY;
+
+    pthread_mutex_lock(&img->inode_lock);
+    for (uint32_t i = 0; i < journal->n_inode_chunks; i++)
+        if (journal->inode_dirty[i] == EDFS_JOURNAL_COPIED)
+            journal->inode_dirty[i] = state;
+    pthread_mutex_unlock(&img->inode_lock);
+
+    int n_unpinned = 0;
+    if (ret == 0)
+    {
+        for (int i = 0; i < n_blocks; i++)
+            n_unpinned += edfs_cache_clean_meta(img, blocks[i], seqs[i]);
+    }
+    else
+    {
+        pthread_mutex_lock(&img->alloc_lock);
+        if (lo < img->bitmap_dirty_lo)
+            img->bitmap_dirty_lo = lo;
+        if (hi > img->bitmap_dirty_hi)
+            img->bitmap_dirty_hi = hi;
+        pthread_mutex_unlock(&img->alloc_lock);
+
+        edfs_journal_header_t *header = edfs_journal_header(journal->buf);
+        header->n_records = 0;
+        header->payload_size = 0;
+    }
+
+    return ret < 0 ? ret : n_unpinned;
+}
+
+/* Commits all metadata modified since the previous commit. Must not be
+ * called within edfs_journal_start() and edfs_journal_stop().
+ */
+int
+edfs_journal_commit(edfs_image_t *img)
+{
+    edfs_journal_t *journal = img->journal;
+    if (!journal)
+        return 0;
+
+    pthread_rwlock_wrlock(&journal->op_lock);
+
+    pthread_mutex_lock(&journal->commit_lock);
+    int ret = edfs_journal_commit_locked(img);
+    pthread_mutex_unlock(&journal->commit_lock);
+
+    pthread_mutex_lock(&journal->lock);
+    journal->n_ops = 0;
+    journal->last_commit = time(NULL);
+    pthread_mutex_unlock(&journal->lock);
+
+    pthread_rwlock_unlock(&journal->op_lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Commits the metadata modified so far without waiting for the
+ * operations in flight, see the top of this file. Called by the cache,
+ * possibly within an operation, when every slot is pinned; the caller
+ * must not hold img->inode_lock, img->alloc_lock or the cache lock.
+ * Returns the number of blocks unpinned, or a negative error code.
+ */
+int
+edfs_journal_commit_pinned(edfs_image_t *img)
+{
+    edfs_journal_t *journal = img->journal;
+    if (!journal)
+        return 0;
+
+    pthread_mutex_lock(&journal->commit_lock);
+    int ret = edfs_journal_commit_locked(img);
+    pthread_mutex_unlock(&journal->commit_lock);
+
+    return ret;
+}
@@ -0,0 +1,929 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/*
+ * mkfs.edfs -- creates an EdFS image, optionally populated with a
+ * synthetic directory tree
+ *
+ * The layout follows the shipped images: boot block, super block at
+ * EDFS_SUPER_BLOCK_OFFSET, the bitmap and the inode table each starting
+ * on a block boundary, then the data area. By default the inode table
+ * takes 2% of the image space, rounded up to whole blocks of inodes.
+ *
+ * The tree is planned in memory first: every directory at a depth below
+ * -d gets -f subdirectories, and every directory gets -F files with
+ * sizes drawn from -z. Inodes are numbered breadth first and each
+ * directory or file gets a contiguous range of blocks in the same
+ * order, an indirect block before the data blocks it refers to. The
+ * image is then written front to back in one pass through a large
+ * buffer; free space at the end is left as a hole.
+ */
+
+#include "edfs-common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Size of the buffer the image is written through. */
+#define EDFS_MKFS_BUF_SIZE (1 << 20)
+
+/* Part of the image space given to the inode table by default, in
+ * percent.
+ */
+#define EDFS_MKFS_INODE_PERCENT 2
+
+typedef enum
+{
+    EDFS_MKFS_SIZE_FIXED,
+    EDFS_MKFS_SIZE_UNIFORM,
+    EDFS_MKFS_SIZE_EXP,
+} edfs_mkfs_dist_t;
+
+/* A directory or file of the synthetic tree. Its inumber is its index
+ * plus one, the children of a directory have consecutive indices.
+ */
+typedef struct
+{
+    bool dir;
+    uint8_t depth;
+    uint32_t name;              /* number within the parent */
+    uint32_t size;              /* files only */
+    uint32_t first_child;
+    uint32_t n_children;
+
+    bool hashed;
+    bool has_indirect;
+    edfs_block_t first_block;   /* EDFS_BLOCK_INVALID if none */
+    uint32_t n_blocks;          /* including the indirect block */
+    edfs_block_t direct[EDFS_INODE_N_DIRECT_BLOCKS];    /* hashed only */
+} edfs_mkfs_node_t;
+
+typedef struct
+{
+    /* Options */
+    uint16_t block_size;
+    uint32_t n_blocks;
+    uint32_t n_inodes;
+    bool journal;
+    uint32_t depth;
+    uint32_t n_subdirs;
+    uint32_t n_files;
+    edfs_mkfs_dist_t dist;
+    uint32_t size_a;
+    uint32_t size_b;
+
+    edfs_super_block_t sb;
+    uint32_t max_file_size;
+
+    edfs_mkfs_node_t *nodes;
+    uint32_t n_nodes;
+    edfs_block_t next_block;
+} edfs_mkfs_t;
+
+/* Buffered sequential writer. */
+typedef struct
+{
+    int fd;
+    uint8_t *buf;
+    size_t len;
+    uint64_t off;
+} edfs_mkfs_writer_t;
+
+static uint64_t edfs_mkfs_rand_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t
+edfs_mkfs_rand(void)
+{
+    uint64_t x = edfs_mkfs_rand_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    edfs_mkfs_rand_state = x;
+
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static uint32_t
+edfs_mkfs_file_size(const edfs_mkfs_t *mkfs)
+{
+    uint64_t size;
+
+    switch (mkfs->dist)
+    {
+        case EDFS_MKFS_SIZE_UNIFORM:
+            size = mkfs->size_a +
+                edfs_mkfs_rand() % ((uint64_t)mkfs->size_b - mkfs->size_a + 1);
+            break;
+
+        case EDFS_MKFS_SIZE_EXP:
+            {
+                /* Inverse transform of a uniform sample in (0, 1]. */
+                double u = ((edfs_mkfs_rand() >> 11) + 1) / 9007199254740992.0;
+                double x = 0.0;
+
+                /* -ln(u) without libm: ln(u) = ln(m) + e ln(2) */
+                int e = 0;
+                while (u < 0.5)
+                {
+                    u *= 2.0;
+                    e--;
+                }
+                double t = (u - 1.0) / (u + 1.0);
+                for (int k = 1; k < 40; k += 2)
+                {
+                    double p = t;
+                    for (int j = 1; j < k; j++)
+                        p *= t;
+                    x += p / k;
+                }
+                x = -(2.0 * x + e * 0.6931471805599453);
+
+                size = (uint64_t)(x * mkfs->size_a);
+            }
+            break;
+
+        default:
+            size = mkfs->size_a;
+            break;
+    }
+
+    return size > mkfs->max_file_size ? mkfs->max_file_size : size;
+}
+
+static void
+edfs_mkfs_filename(const edfs_mkfs_node_t *node, char *name)
+{
+    memset(name, 0, EDFS_FILENAME_SIZE);
+    if (node->dir)
+        snprintf(name, EDFS_FILENAME_SIZE, "dir%u", node->name);
+    else
+        snprintf(name, EDFS_FILENAME_SIZE, "file%u.dat", node->name);
+}
+
+/* Places the entries of hashed directory @dir as edfs_dir_hashed_find_free()
+ * would, inserting them in order. Stores the number of entries of every
+ * bucket in @fill, whether it overflowed in @overflow, and if @slots is
+ * not NULL the bucket and slot of every child.
+ */
+static void
+edfs_mkfs_hash_dir(const edfs_mkfs_t *mkfs, const edfs_mkfs_node_t *dir,
+                   uint32_t *fill, bool *overflow, uint32_t *slots)
+{
+    const uint32_t n_buckets = edfs_get_n_dir_buckets(&mkfs->sb);
+    const uint32_t n_slots = edfs_get_n_dir_entries_per_block(&mkfs->sb);
+
+    memset(fill, 0, n_buckets * sizeof(uint32_t));
+    memset(overflow, 0, n_buckets * sizeof(bool));
+
+    for (uint32_t c = 0; c < dir->n_children; c++)
+    {
+        char name[EDFS_FILENAME_SIZE];
+        edfs_mkfs_filename(&mkfs->nodes[dir->first_child + c], name);
+
+        uint32_t home = edfs_dir_hash(name) % n_buckets;
+        for (uint32_t i = 0; i < n_buckets; i++)
+        {
+            uint32_t bucket = (home + i) % n_buckets;
+
+            /* Slot 0 of a bucket is its header. */
+            if (fill[bucket] < n_slots - 1)
+            {
+                if (slots)
+                    slots[c] = bucket * n_slots + 1 + fill[bucket];
+                fill[bucket]++;
+                break;
+            }
+
+            overflow[bucket] = true;
+        }
+    }
+}
+
+static int
+edfs_mkfs_plan_tree(edfs_mkfs_t *mkfs)
+{
+    const uint32_t max_nodes = mkfs->n_inodes - 1;
+
+    mkfs->nodes = calloc(max_nodes, sizeof(edfs_mkfs_node_t));
+    if (!mkfs->nodes)
+        return -ENOMEM;
+
+    mkfs->nodes[0].dir = true;
+    mkfs->n_nodes = 1;
+
+    /* The array doubles as the breadth first queue. */
+    for (uint32_t i = 0; i < mkfs->n_nodes; i++)
+    {
+        edfs_mkfs_node_t *node = &mkfs->nodes[i];
+        if (!node->dir)
+            continue;
+
+        uint32_t n_subdirs = node->depth < mkfs->depth ? mkfs->n_subdirs : 0;
+        uint32_t n_children = n_subdirs + mkfs->n_files;
+
+        if (n_children > max_nodes - mkfs->n_nodes)
+        {
+            fprintf(stderr, "error: the tree needs more than %u inodes.\n",
+                    mkfs->n_inodes);
+            return -ENOSPC;
+        }
+
+        node->first_child = mkfs->n_nodes;
+        node->n_children = n_children;
+
+        for (uint32_t c = 0; c < n_children; c++)
+        {
+            edfs_mkfs_node_t *child = &mkfs->nodes[mkfs->n_nodes++];
+
+            child->dir = c < n_subdirs;
+            child->depth = node->depth + 1;
+            child->name = child->dir ? c + 1 : c - n_subdirs + 1;
+            if (!child->dir)
+                child->size = edfs_mkfs_file_size(mkfs);
+        }
+    }
+
+    return 0;
+}
+
+/* Assigns every node its range of blocks. */
+static int
+edfs_mkfs_plan_blocks(edfs_mkfs_t *mkfs)
+{
+    const uint16_t BLK_SIZE = mkfs->sb.block_size;
+    const uint32_t n_slots = edfs_get_n_dir_entries_per_block(&mkfs->sb);
+    const uint32_t n_buckets = edfs_get_n_dir_buckets(&mkfs->sb);
+
+    uint32_t *fill = malloc(n_buckets * sizeof(uint32_t));
+    bool *overflow = malloc(n_buckets * sizeof(bool));
+    if (!fill || !overflow)
+    {
+        free(fill);
+        free(overflow);
+        return -ENOMEM;
+    }
+
+    uint32_t next = mkfs->next_block;
+    int ret = 0;
+
+    for (uint32_t i = 0; i < mkfs->n_nodes && ret == 0; i++)
+    {
+        edfs_mkfs_node_t *node = &mkfs->nodes[i];
+        uint32_t n_data = 0;
+
+        if (!node->dir)
+        {
+            n_data = (node->size + BLK_SIZE - 1) / BLK_SIZE;
+            node->has_indirect = n_data > EDFS_INODE_N_DIRECT_BLOCKS;
+        }
+        else if (node->n_children <= EDFS_INODE_N_DIRECT_BLOCKS * n_slots)
+            n_data = (node->n_children + n_slots - 1) / n_slots;
+        else if (node->n_children <= n_buckets * (n_slots - 1))
+        {
+            node->hashed = true;
+            edfs_mkfs_hash_dir(mkfs, node, fill, overflow, NULL);
+            for (uint32_t b = 0; b < n_buckets; b++)
+                if (fill[b] > 0)
+                {
+                    n_data++;
+                    if (b >= EDFS_INODE_N_DIRECT_BLOCKS)
+                        node->has_indirect = true;
+                }
+
+            /* Buckets are laid out after the indirect block in order. */
+            for (uint32_t b = 0, n = 0; b < EDFS_INODE_N_DIRECT_BLOCKS; b++)
+                if (fill[b] > 0)
+                    node->direct[b] = next + node->has_indirect + n++;
+        }
+        else
+        {
+            fprintf(stderr, "error: a directory can hold at most %u entries.\n",
+                    n_buckets * (n_slots - 1));
+            ret = -EINVAL;
+            break;
+        }
+
+        node->n_blocks = n_data + node->has_indirect;
+        if (node->n_blocks == 0)
+            continue;
+
+        if (next + node->n_blocks > mkfs->sb.n_blocks)
+        {
+            fprintf(stderr, "error: the tree does not fit in %u blocks.\n",
+                    mkfs->sb.n_blocks);
+            ret = -ENOSPC;
+            break;
+        }
+
+        node->first_block = next;
+        next += node->n_blocks;
+    }
+
+    mkfs->next_block = next;
+
+    free(fill);
+    free(overflow);
+
+    return ret;
+}
+
+static int
+edfs_mkfs_flush(edfs_mkfs_writer_t *w)
+{
+    size_t done = 0;
+
+    while (done < w->len)
+    {
+        ssize_t n = pwrite(w->fd, w->buf + done, w->len - done, w->off + done);
+        if (n < 0)
+            return -errno;
+        done += n;
+    }
+
+    w->off += w->len;
+    w->len = 0;
+
+    return 0;
+}
+
+/* Appends @size bytes from @data, or zeroes if @data is NULL. */
+static int
+edfs_mkfs_put(edfs_mkfs_writer_t *w, const void *data, size_t size)
+{
+    while (size > 0)
+    {
+        size_t n = EDFS_MKFS_BUF_SIZE - w->len;
+        if (n > size)
+            n = size;
+
+        if (data)
+        {
+            memcpy(w->buf + w->len, data, n);
+            data = (const uint8_t *)data + n;
+        }
+        else
+            memset(w->buf + w->len, 0, n);
+
+        w->len += n;
+        size -= n;
+
+        if (w->len == EDFS_MKFS_BUF_SIZE)
+        {
+            int ret = edfs_mkfs_flush(w);
+            if (ret < 0)
+                return ret;
+        }
+    }
+
+    return 0;
+}
+
+/* Pads with zeroes up to image offset @off. */
+static int
+edfs_mkfs_pad(edfs_mkfs_writer_t *w, uint64_t off)
+{
+    return edfs_mkfs_put(w, NULL, off - (w->off + w->len));
+}
+
+/* Returns the buffer space for the next block, which the caller fills
+ * in completely.
+ */
+static uint8_t *
+edfs_mkfs_next_block(edfs_mkfs_writer_t *w, uint16_t block_size, int *ret)
+{
+    *ret = 0;
+    if (w->len + block_size > EDFS_MKFS_BUF_SIZE)
+        *ret = edfs_mkfs_flush(w);
+
+    uint8_t *block = w->buf + w->len;
+    w->len += block_size;
+
+    return block;
+}
+
+static void
+edfs_mkfs_fill_inode(const edfs_mkfs_node_t *node, edfs_disk_inode_t *inode)
+{
+    memset(inode, 0, sizeof(edfs_disk_inode_t));
+    inode->type = node->dir ? EDFS_INODE_TYPE_DIRECTORY : EDFS_INODE_TYPE_FILE;
+    inode->size = node->dir ? 0 : node->size;
+    if (node->hashed)
+        inode->flags |= EDFS_INODE_FLAG_HASHED;
+
+    if (node->n_blocks == 0)
+        return;
+
+    edfs_block_t block = node->first_block;
+    if (node->has_indirect)
+        inode->indirect = block++;
+
+    for (uint32_t i = 0; i < EDFS_INODE_N_DIRECT_BLOCKS; i++)
+    {
+        if (node->hashed)
+            inode->direct[i] = node->direct[i];
+        else if (i < node->n_blocks - node->has_indirect)
+            inode->direct[i] = block + i;
+    }
+}
+
+/* Writes the blocks of hashed directory @node; buckets without entries
+ * are not allocated.
+ */
+static int
+edfs_mkfs_write_hashed_dir(edfs_mkfs_t *mkfs, edfs_mkfs_writer_t *w,
+                           const edfs_mkfs_node_t *node)
+{
+    const uint16_t BLK_SIZE = mkfs->sb.block_size;
+    const uint32_t n_slots = edfs_get_n_dir_entries_per_block(&mkfs->sb);
+    const uint32_t n_buckets = edfs_get_n_dir_buckets(&mkfs->sb);
+    int ret = 0;
+
+    uint32_t *fill = malloc(n_buckets * sizeof(uint32_t));
+    bool *overflow = malloc(n_buckets * sizeof(bool));
+    uint32_t *slots = malloc(node->n_children * sizeof(uint32_t));
+    edfs_block_t *phys = calloc(n_buckets, sizeof(edfs_block_t));
+    uint32_t *first_of = malloc(n_buckets * sizeof(uint32_t));
+    uint32_t *order = malloc(node->n_children * sizeof(uint32_t));
+    if (!fill || !overflow || !slots || !phys || !first_of || !order)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    edfs_mkfs_hash_dir(mkfs, node, fill, overflow, slots);
+
+    /* Physical blocks follow the indirect block in bucket order. */
+    edfs_block_t block = node->first_block + node->has_indirect;
+    for (uint32_t b = 0; b < n_buckets; b++)
+        if (fill[b] > 0)
+            phys[b] = block++;
+
+    if (node->has_indirect)
+    {
+        uint8_t *data = edfs_mkfs_next_block(w, BLK_SIZE, &ret);
+        if (ret < 0)
+            goto out;
+
+        memset(data, 0, BLK_SIZE);
+        memcpy(data, phys + EDFS_INODE_N_DIRECT_BLOCKS,
+               (n_buckets - EDFS_INODE_N_DIRECT_BLOCKS) * sizeof(edfs_block_t));
+    }
+
+    /* Sort the children by bucket with a counting sort, so that every
+     * bucket is written once.
+     */
+    uint32_t start = 0;
+    for (uint32_t b = 0; b < n_buckets; b++)
+    {
+        first_of[b] = start;
+        start += fill[b];
+    }
+    for (uint32_t c = 0; c < node->n_children; c++)
+        order[first_of[slots[c] / n_slots]++] = c;
+
+    uint32_t c = 0;
+    for (uint32_t b = 0; b < n_buckets; b++)
+    {
+        if (fill[b] == 0)
+            continue;
+
+        uint8_t *data = edfs_mkfs_next_block(w, BLK_SIZE, &ret);
+        if (ret < 0)
+            goto out;
+
+        memset(data, 0, BLK_SIZE);
+
+        edfs_dir_entry_t *entries = (edfs_dir_entry_t *)data;
+        entries[0].filename[EDFS_DIR_BUCKET_OVERFLOW] = overflow[b];
+
+        for (uint32_t i = 0; i < fill[b]; i++, c++)
+        {
+            uint32_t child = order[c];
+            edfs_dir_entry_t *entry = &entries[slots[child] % n_slots];
+
+            entry->inumber = node->first_child + child + 1;
+            edfs_mkfs_filename(&mkfs->nodes[node->first_child + child],
+                               entry->filename);
+        }
+    }
+
+out:
+    free(fill);
+    free(overflow);
+    free(slots);
+    free(phys);
+    free(first_of);
+    free(order);
+
+    return ret;
+}
+
+static int
+edfs_mkfs_write_node(edfs_mkfs_t *mkfs, edfs_mkfs_writer_t *w,
+                     const edfs_mkfs_node_t *node, edfs_inumber_t inumber)
+{
+    const uint16_t BLK_SIZE = mkfs->sb.block_size;
+    const uint32_t n_slots = edfs_get_n_dir_entries_per_block(&mkfs->sb);
+    int ret = 0;
+
+    if (node->hashed)
+        return edfs_mkfs_write_hashed_dir(mkfs, w, node);
+
+    uint32_t n_data = node->n_blocks - node->has_indirect;
+    edfs_block_t block = node->first_block + node->has_indirect;
+
+    if (node->has_indirect)
+    {
+        edfs_block_t *entries =
+            (edfs_block_t *)edfs_mkfs_next_block(w, BLK_SIZE, &ret);
+        if (ret < 0)
+            return ret;
+
+        memset(entries, 0, BLK_SIZE);
+        for (uint32_t i = EDFS_INODE_N_DIRECT_BLOCKS; i < n_data; i++)
+            entries[i - EDFS_INODE_N_DIRECT_BLOCKS] = block + i;
+    }
+
+    for (uint32_t i = 0; i < n_data; i++)
+    {
+        uint8_t *data = edfs_mkfs_next_block(w, BLK_SIZE, &ret);
+        if (ret < 0)
+            return ret;
+
+        memset(data, 0, BLK_SIZE);
+
+        if (node->dir)
+        {
+            edfs_dir_entry_t *entries = (edfs_dir_entry_t *)data;
+            for (uint32_t s = 0; s < n_slots; s++)
+            {
+                uint32_t c = i * n_slots + s;
+                if (c >= node->n_children)
+                    break;
+
+                entries[s].inumber = node->first_child + c + 1;
+                edfs_mkfs_filename(&mkfs->nodes[node->first_child + c],
+                                   entries[s].filename);
+            }
+            continue;
+        }
+
+        /* Recognizable contents: lines of letters that depend on the
+         * inumber and the offset.
+         */
+        uint32_t off = i * BLK_SIZE;
+        uint32_t len = node->size - off < BLK_SIZE ? node->size - off : BLK_SIZE;
+        for (uint32_t j = 0; j < len; j++)
+            data[j] = (off + j) % 64 == 63 ?
+                '\n' : 'a' + (inumber + (off + j) / 64) % 26;
+    }
+
+    return 0;
+}
+
+static int
+edfs_mkfs_write(edfs_mkfs_t *mkfs, int fd)
+{
+    const edfs_super_block_t *sb = &mkfs->sb;
+    const uint16_t BLK_SIZE = sb->block_size;
+
+    edfs_mkfs_writer_t w = { .fd = fd, .len = 0, .off = 0 };
+    w.buf = malloc(EDFS_MKFS_BUF_SIZE);
+    uint8_t *bitmap = calloc(1, sb->bitmap_size);
+    edfs_disk_inode_t *inodes = calloc(sb->inode_table_n_inodes,
+                                       sizeof(edfs_disk_inode_t));
+    int ret = 0;
+
+    if (!w.buf || !bitmap || !inodes)
+    {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    /* The inode table and the bitmap precede the data in the image, so
+     * both are built before anything is written.
+     */
+    for (uint32_t i = 0; i < mkfs->n_nodes; i++)
+        edfs_mkfs_fill_inode(&mkfs->nodes[i], &inodes[i + 1]);
+
+    for (uint32_t b = 0; b < mkfs->next_block; b++)
+        bitmap[b / 8] |= 1 << (b % 8);
+
+    ret = edfs_mkfs_pad(&w, EDFS_SUPER_BLOCK_OFFSET);
+    if (ret == 0)
+        ret = edfs_mkfs_put(&w, sb, sizeof(edfs_super_block_t));
+    if (ret == 0)
+        ret = edfs_mkfs_pad(&w, sb->bitmap_start);
+    if (ret == 0)
+        ret = edfs_mkfs_put(&w, bitmap, sb->bitmap_size);
+    if (ret == 0)
+        ret = edfs_mkfs_pad(&w, sb->inode_table_start);
+    if (ret == 0)
+        ret = edfs_mkfs_put(&w, inodes, sb->inode_table_size);
+    if (ret == 0)
+        ret = edfs_mkfs_pad(&w, (uint64_t)edfs_get_data_block_start(sb) * BLK_SIZE);
+
+    /* An empty journal: its header block is all zeroes. */
+    if (ret == 0 && sb->journal_n_blocks > 0)
+        ret = edfs_mkfs_put(&w, NULL, (size_t)sb->journal_n_blocks * BLK_SIZE);
+
+    for (uint32_t i = 0; i < mkfs->n_nodes && ret == 0; i++)
+        ret = edfs_mkfs_write_node(mkfs, &w, &mkfs->nodes[i], i + 1);
+
+    if (ret == 0)
+        ret = edfs_mkfs_flush(&w);
+
+    /* Free space at the end reads as zeroes. */
+    if (ret == 0 && ftruncate(fd, edfs_get_size(sb)) < 0)
+        ret = -errno;
+    if (ret == 0 && fsync(fd) < 0)
+        ret = -errno;
+
+out:
+    free(w.buf);
+    free(bitmap);
+    free(inodes);
+
+    return ret;
+}
+
+/* Computes the layout of the image from the options. */
+static int
+edfs_mkfs_layout(edfs_mkfs_t *mkfs)
+{
+    edfs_super_block_t *sb = &mkfs->sb;
+    const uint16_t BLK_SIZE = mkfs->block_size;
+
+    memset(sb, 0, sizeof(edfs_super_block_t));
+    sb->magic = EDFS_MAGIC;
+    sb->version = 0;
+    sb->block_size = BLK_SIZE;
+    sb->n_blocks = mkfs->n_blocks;
+    sb->root_inumber = 1;
+
+    sb->bitmap_start = (EDFS_SUPER_BLOCK_OFFSET + sizeof(edfs_super_block_t) +
+                        BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE;
+    /* Like the shipped images, the bitmap fills whole blocks. */
+    sb->bitmap_size = ((mkfs->n_blocks + 7) / 8 + BLK_SIZE - 1) / BLK_SIZE *
+        BLK_SIZE;
+
+    const uint32_t per_block = BLK_SIZE / sizeof(edfs_disk_inode_t);
+    if (mkfs->n_inodes == 0)
+    {
+        uint32_t n = (mkfs->n_blocks * EDFS_MKFS_INODE_PERCENT + 99) / 100;
+        mkfs->n_inodes = n * per_block;
+    }
+    if (mkfs->n_inodes < 2)
+    {
+        fprintf(stderr, "error: at least 2 inodes are needed.\n");
+        return -EINVAL;
+    }
+
+    sb->inode_table_start = (sb->bitmap_start + sb->bitmap_size +
+                             BLK_SIZE - 1) / BLK_SIZE * BLK_SIZE;
+    sb->inode_table_n_inodes = mkfs->n_inodes;
+    sb->inode_table_size = mkfs->n_inodes * sizeof(edfs_disk_inode_t);
+
+    mkfs->next_block = edfs_get_data_block_start(sb);
+
+    if (mkfs->journal)
+    {
+        sb->journal_magic = EDFS_JOURNAL_SB_MAGIC;
+        sb->journal_start = mkfs->next_block;
+        sb->journal_n_blocks = EDFS_JOURNAL_N_BLOCKS;
+        mkfs->next_block += EDFS_JOURNAL_N_BLOCKS;
+    }
+
+    if (mkfs->next_block >= mkfs->n_blocks)
+    {
+        fprintf(stderr, "error: no room for data, use more blocks.\n");
+        return -ENOSPC;
+    }
+
+    mkfs->max_file_size = (EDFS_INODE_N_DIRECT_BLOCKS +
+                           edfs_get_n_blocks_per_indirect_block(sb)) * BLK_SIZE;
+
+    return 0;
+}
+
+/* Parses a size with an optional K, M or G suffix. */
+static bool
+edfs_mkfs_parse_size(const char *str, uint64_t *size)
+{
+    char *end;
+    unsigned long long value = strtoull(str, &end, 0);
+
+    if (end == str)
+        return false;
+
+    switch (*end)
+    {
+        case 'G': value <<= 10; /* fall through */
+        case 'M': value <<= 10; /* fall through */
+        case 'K': value <<= 10; end++; break;
+        case 0: break;
+        default: return false;
+    }
+
+    *size = value;
+    return *end == 0;
+}
+
+/* -z fixed:N, uniform:MIN:MAX or exp:MEAN */
+static bool
+edfs_mkfs_parse_dist(edfs_mkfs_t *mkfs, const char *str)
+{
+    char buf[64];
+    uint64_t a, b;
+
+    snprintf(buf, sizeof(buf), "%s", str);
+
+    char *arg = strchr(buf, ':');
+    if (!arg)
+        return false;
+    *arg++ = 0;
+
+    char *arg2 = strchr(arg, ':');
+    if (arg2)
+        *arg2++ = 0;
+
+    if (!edfs_mkfs_parse_size(arg, &a) || a > UINT32_MAX)
+        return false;
+
+    if (strcmp(buf, "fixed") == 0 && !arg2)
+        mkfs->dist = EDFS_MKFS_SIZE_FIXED;
+    else if (strcmp(buf, "exp") == 0 && !arg2)
+        mkfs->dist = EDFS_MKFS_SIZE_EXP;
+    else if (strcmp(buf, "uniform") == 0 && arg2 &&
+             edfs_mkfs_parse_size(arg2, &b) && b >= a && b <= UINT32_MAX)
+    {
+        mkfs->dist = EDFS_MKFS_SIZE_UNIFORM;
+        mkfs->size_b = b;
+    }
+    else
+        return false;
+
+    mkfs->size_a = a;
+
+    return true;
+}
+
+static void
+edfs_mkfs_usage(const char *argv0)
+{
+    fprintf(stderr,
+            "usage: %s [options] image\n"
+            "  -b SIZE   block size, a power of two from %d to %d (512)\n"
+            "  -n N      number of blocks, at most %d (2048)\n"
+            "  -s SIZE   image size instead of -n, e.g. 512M\n"
+            "  -i N      number of inodes (as many as fill 2%% of the image)\n"
+            "  -j        add a metadata journal\n"
+            "  -d N      depth of the synthetic tree (0)\n"
+            "  -f N      subdirectories per directory (0)\n"
+            "  -F N      files per directory (0)\n"
+            "  -z DIST   file sizes: fixed:N, uniform:MIN:MAX or exp:MEAN\n"
+            "            (fixed:4K)\n"
+            "  -r SEED   seed for the file sizes\n",
+            argv0, EDFS_MIN_BLOCK_SIZE, EDFS_MAX_BLOCK_SIZE,
+            EDFS_MAX_BLOCKS - 1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    edfs_mkfs_t mkfs =
+    {
+        .block_size = 512,
+        .n_blocks = 2048,
+        .dist = EDFS_MKFS_SIZE_FIXED,
+        .size_a = 4096,
+    };
+    const char *size_arg = NULL;
+    uint64_t size = 0;
+    uint64_t value;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:n:s:i:jd:f:F:z:r:h")) != -1)
+    {
+        bool ok = true;
+
+        switch (opt)
+        {
+            case 'b':
+                ok = edfs_mkfs_parse_size(optarg, &value) &&
+                    value >= EDFS_MIN_BLOCK_SIZE && value <= EDFS_MAX_BLOCK_SIZE &&
+                    (value & (value - 1)) == 0;
+                mkfs.block_size = value;
+                break;
+            case 'n':
+                ok = edfs_mkfs_parse_size(optarg, &value) && value > 0 &&
+                    value < EDFS_MAX_BLOCKS;
+                mkfs.n_blocks = value;
+                break;
+            case 's':
+                ok = edfs_mkfs_parse_size(optarg, &size) && size > 0;
+                size_arg = optarg;
+                break;
+            case 'i':
+                ok = edfs_mkfs_parse_size(optarg, &value) && value <= UINT32_MAX;
+                mkfs.n_inodes = value;
+                break;
+            case 'j':
+                mkfs.journal = true;
+                break;
+            case 'd':
+                ok = edfs_mkfs_parse_size(optarg, &value) && value < 256;
+                mkfs.depth = value;
+                break;
+            case 'f':
+                ok = edfs_mkfs_parse_size(optarg, &value) && value <= UINT32_MAX;
+                mkfs.n_subdirs = value;
+                break;
+            case 'F':
+                ok = edfs_mkfs_parse_size(optarg, &value) && value <= UINT32_MAX;
+                mkfs.n_files = value;
+                break;
+            case 'z':
+                ok = edfs_mkfs_parse_dist(&mkfs, optarg);
+                break;
+            case 'r':
+                edfs_mkfs_rand_state = strtoull(optarg, NULL, 0) | 1;
+                break;
+            default:
+                ok = false;
+                break;
+        }
+
+        if (!ok)
+        {
+            edfs_mkfs_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        edfs_mkfs_usage(argv[0]);
+        return 1;
+    }
+
+    const char *filename = argv[optind];
+
+    if (size > 0)
+    {
+        if (size / mkfs.block_size == 0 ||
+            size / mkfs.block_size >= EDFS_MAX_BLOCKS)
+        {
+            fprintf(stderr, "error: %s bytes is not between 1 and %d blocks.\n",
+                    size_arg, EDFS_MAX_BLOCKS - 1);
+            return 1;
+        }
+        mkfs.n_blocks = size / mkfs.block_size;
+    }
+
+    if (edfs_mkfs_layout(&mkfs) < 0 || edfs_mkfs_plan_tree(&mkfs) < 0 ||
+        edfs_mkfs_plan_blocks(&mkfs) < 0)
+    {
+        free(mkfs.nodes);
+        return 1;
+    }
+
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        fprintf(stderr, "error: could not open file '%s': %s\n",
+                filename, strerror(errno));
+        free(mkfs.nodes);
+        return 1;
+    }
+
+    int ret = edfs_mkfs_write(&mkfs, fd);
+    close(fd);
+
+    if (ret < 0)
+    {
+        fprintf(stderr, "error: file '%s': %s\n", filename, strerror(-ret));
+        free(mkfs.nodes);
+        return 1;
+    }
+
+    uint32_t n_dirs = 0;
+    for (uint32_t i = 0; i < mkfs.n_nodes; i++)
+        n_dirs += mkfs.nodes[i].dir;
+
+    printf("%s: %u blocks of %u bytes, %u inodes, %u directories, %u files, "
+           "%u blocks used\n", filename, mkfs.sb.n_blocks, mkfs.sb.block_size,
+           mkfs.sb.inode_table_n_inodes, n_dirs, mkfs.n_nodes - n_dirs,
+           mkfs.next_block);
+
+    free(mkfs.nodes);
+
+    return 0;
+}
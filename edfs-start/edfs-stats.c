@@ -0,0 +1,257 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/*
+ * Statistics
+ *
+ * Counts image I/O per kind of block, cache and directory entry cache
+ * hits and misses, journal commits and the latency of every FUSE
+ * operation. I/O is counted where it is issued, so the numbers show
+ * what actually reaches the image file (or the mapping), not what the
+ * file system was asked to do.
+ *
+ * All counters are updated with relaxed atomic additions and are never
+ * reset; a report is therefore a consistent snapshot of each counter,
+ * but not of all counters together. Every routine accepts an image
+ * without statistics and then does nothing.
+ */
+
+#include "edfs-common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct
+{
+    uint64_t calls;
+    uint64_t bytes;
+    uint64_t errors;
+} edfs_stats_io_t;
+
+typedef struct
+{
+    uint64_t n;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t hist[EDFS_STATS_N_BUCKETS];
+} edfs_stats_op_t;
+
+struct edfs_stats
+{
+    uint64_t start;
+    edfs_stats_io_t io[EDFS_N_SITES][2];        /* [site][write] */
+    uint64_t counts[EDFS_N_STATS];
+    edfs_stats_op_t ops[EDFS_N_OPS];
+};
+
+static const char *edfs_site_names[EDFS_N_SITES] =
+{
+    "super", "inode", "bitmap", "indirect", "data", "dir", "journal"
+};
+
+static const char *edfs_stat_names[EDFS_N_STATS] =
+{
+    "cache_hit", "cache_miss", "cache_evict",
+    "dcache_hit", "dcache_miss", "attr_hit", "attr_miss", "journal_commit"
+};
+
+static const char *edfs_op_names[EDFS_N_OPS] =
+{
+    "getattr", "readdir", "open", "release", "create", "read", "write",
+    "mkdir", "rmdir", "unlink", "truncate", "fallocate", "fsync",
+    "flush"
+};
+
+static inline void
+edfs_stats_add(uint64_t *counter, uint64_t value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t
+edfs_stats_load(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+bool
+edfs_stats_init(edfs_image_t *img)
+{
+    img->stats = calloc(1, sizeof(edfs_stats_t));
+    if (!img->stats)
+        return false;
+
+    img->stats->start = edfs_stats_now();
+
+    return true;
+}
+
+void
+edfs_stats_free(edfs_image_t *img)
+{
+    free(img->stats);
+    img->stats = NULL;
+}
+
+uint64_t
+edfs_stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+edfs_stats_io(edfs_image_t *img, edfs_io_site_t site, bool write,
+              ssize_t res)
+{
+    if (!img->stats)
+        return;
+
+    edfs_stats_io_t *io = &img->stats->io[site][write];
+
+    edfs_stats_add(&io->calls, 1);
+    if (res < 0)
+        edfs_stats_add(&io->errors, 1);
+    else
+        edfs_stats_add(&io->bytes, res);
+}
+
+/* Counts each request of a batch submitted with edfs_image_submit(). */
+void
+edfs_stats_io_reqs(edfs_image_t *img, edfs_io_site_t site,
+                   const edfs_io_req_t *reqs, int n_reqs)
+{
+    for (int i = 0; i < n_reqs; i++)
+        edfs_stats_io(img, site, reqs[i].write, reqs[i].res);
+}
+
+void
+edfs_stats_count(edfs_image_t *img, edfs_stat_t stat)
+{
+    if (img->stats)
+        edfs_stats_add(&img->stats->counts[stat], 1);
+}
+
+uint64_t
+edfs_stats_io_calls(edfs_image_t *img)
+{
+    uint64_t calls = 0;
+
+    if (!img->stats)
+        return 0;
+
+    for (int i = 0; i < EDFS_N_SITES; i++)
+        calls += edfs_stats_load(&img->stats->io[i][false].calls) +
+            edfs_stats_load(&img->stats->io[i][true].calls);
+
+    return calls;
+}
+
+/* Records an operation of kind @op that started at @start. */
+void
+edfs_stats_op(edfs_image_t *img, edfs_op_t op, uint64_t start)
+{
+    if (!img->stats)
+        return;
+
+    edfs_stats_op_t *stat = &img->stats->ops[op];
+    uint64_t ns = edfs_stats_now() - start;
+    uint64_t us = ns / 1000;
+
+    /* Bucket i holds latencies below 2^i microseconds. */
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= EDFS_STATS_N_BUCKETS)
+        bucket = EDFS_STATS_N_BUCKETS - 1;
+
+    edfs_stats_add(&stat->n, 1);
+    edfs_stats_add(&stat->total_ns, ns);
+    edfs_stats_add(&stat->hist[bucket], 1);
+
+    uint64_t max = edfs_stats_load(&stat->max_ns);
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&stat->max_ns, &max, ns, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+char *
+edfs_stats_report(edfs_image_t *img, size_t *size)
+{
+    char *report = NULL;
+    FILE *f = open_memstream(&report, size);
+    if (!f)
+        return NULL;
+
+    edfs_stats_t *stats = img->stats;
+    if (!stats)
+    {
+        fprintf(f, "no statistics\n");
+        fclose(f);
+        return report;
+    }
+
+    fprintf(f, "uptime %.3f s\n",
+            (edfs_stats_now() - stats->start) / 1e9);
+
+    fprintf(f, "\nio %-10s %10s %14s %10s %14s %8s\n",
+            "", "reads", "read_bytes", "writes", "write_bytes", "errors");
+    for (int i = 0; i < EDFS_N_SITES; i++)
+    {
+        const edfs_stats_io_t *r = &stats->io[i][false];
+        const edfs_stats_io_t *w = &stats->io[i][true];
+
+        fprintf(f, "io %-10s %10lu %14lu %10lu %14lu %8lu\n",
+                edfs_site_names[i],
+                (unsigned long)edfs_stats_load(&r->calls),
+                (unsigned long)edfs_stats_load(&r->bytes),
+                (unsigned long)edfs_stats_load(&w->calls),
+                (unsigned long)edfs_stats_load(&w->bytes),
+                (unsigned long)(edfs_stats_load(&r->errors) +
+                                edfs_stats_load(&w->errors)));
+    }
+
+    fprintf(f, "\n");
+    for (int i = 0; i < EDFS_N_STATS; i++)
+        fprintf(f, "count %-14s %lu\n", edfs_stat_names[i],
+                (unsigned long)edfs_stats_load(&stats->counts[i]));
+
+    /* One line per operation: count, mean and maximum latency, then the
+     * histogram up to its last non-empty bucket.
+     */
+    fprintf(f, "\nop %-10s %10s %10s %10s   histogram (bucket i: < 2^i us)\n",
+            "", "n", "mean_us", "max_us");
+    for (int i = 0; i < EDFS_N_OPS; i++)
+    {
+        const edfs_stats_op_t *op = &stats->ops[i];
+        uint64_t n = edfs_stats_load(&op->n);
+        uint64_t total = edfs_stats_load(&op->total_ns);
+
+        fprintf(f, "op %-10s %10lu %10.1f %10.1f", edfs_op_names[i],
+                (unsigned long)n, n ? total / 1e3 / n : 0.0,
+                edfs_stats_load(&op->max_ns) / 1e3);
+
+        int last = -1;
+        for (int b = 0; b < EDFS_STATS_N_BUCKETS; b++)
+            if (edfs_stats_load(&op->hist[b]) > 0)
+                last = b;
+        for (int b = 0; b <= last; b++)
+            fprintf(f, b == 0 ? "   %lu" : " %lu",
+                    (unsigned long)edfs_stats_load(&op->hist[b]));
+        fprintf(f, "\n");
+    }
+
+    if (fclose(f) != 0)
+    {
+        free(report);
+        return NULL;
+    }
+
+    return report;
+}
@@ -0,0 +1,439 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/*
+ * Inline data of small files
+ *
+ * Files of at most edfs_get_inline_max_size() bytes do not get blocks
+ * of their own, their data is packed into tail blocks shared with other
+ * small files (see edfs.h). Reading such a file is a single cached
+ * block read and writing it needs no block allocation, except when a
+ * new tail block is started.
+ *
+ * Tail blocks are divided into units of EDFS_TAIL_UNIT_SIZE bytes and
+ * the data of a file occupies a run of consecutive units. Which units
+ * are in use is only kept in memory: it is rebuilt from the inode table
+ * when the image is opened. New data goes to the tail block that was
+ * last allocated from, or else to the one in which units were freed
+ * most recently; a new tail block is only started when neither has
+ * room. A tail block is released once none of its units is in use.
+ *
+ * Moving the data of a file within or between tail blocks only changes
+ * its inode, the data itself is not journaled, like that of any file.
+ * All state below is protected by tails->lock, which is taken after
+ * the per-inode lock and before the allocator and cache locks.
+ */
+
+#include "edfs-common.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define EDFS_TAIL_N_WORDS \
+    ((EDFS_MAX_BLOCK_SIZE / EDFS_TAIL_UNIT_SIZE + 63) / 64)
+
+typedef struct
+{
+    uint64_t used[EDFS_TAIL_N_WORDS];
+    uint32_t n_used;
+} edfs_tail_t;
+
+struct edfs_tails
+{
+    pthread_mutex_t lock;
+
+    uint32_t n_units;           /* units per tail block */
+
+    /* Per block of the image, NULL unless it is a tail block. */
+    edfs_tail_t **tails;
+
+    /* Tail blocks tried first for new data, or EDFS_BLOCK_INVALID. */
+    edfs_block_t current;
+    edfs_block_t reuse;
+};
+
+static inline uint32_t
+edfs_tail_units(uint32_t size)
+{
+    return (size + EDFS_TAIL_UNIT_SIZE - 1) / EDFS_TAIL_UNIT_SIZE;
+}
+
+static inline bool
+edfs_tail_test(const edfs_tail_t *tail, uint32_t unit)
+{
+    return tail->used[unit / 64] & ((uint64_t)1 << (unit % 64));
+}
+
+static void
+edfs_tail_mark(edfs_tail_t *tail, uint32_t first, uint32_t n, bool used)
+{
+    for (uint32_t u = first; u < first + n; u++)
+    {
+        if (used)
+            tail->used[u / 64] |= (uint64_t)1 << (u % 64);
+        else
+            tail->used[u / 64] &= ~((uint64_t)1 << (u % 64));
+    }
+
+    if (used)
+        tail->n_used += n;
+    else
+        tail->n_used -= n;
+}
+
+/* Returns the first unit of a run of @n free units in @tail, or
+ * n_units if there is none.
+ */
+static uint32_t
+edfs_tail_find(const edfs_tails_t *tails, const edfs_tail_t *tail, uint32_t n)
+{
+    uint32_t run = 0;
+
+    for (uint32_t u = 0; u < tails->n_units; u++)
+    {
+        run = edfs_tail_test(tail, u) ? 0 : run + 1;
+        if (run == n)
+            return u + 1 - n;
+    }
+
+    return tails->n_units;
+}
+
+bool
+edfs_tail_init(edfs_image_t *img)
+{
+    edfs_tails_t *tails = calloc(1, sizeof(edfs_tails_t));
+    if (!tails)
+        return false;
+
+    tails->n_units = img->sb.block_size / EDFS_TAIL_UNIT_SIZE;
+    tails->current = EDFS_BLOCK_INVALID;
+    tails->reuse = EDFS_BLOCK_INVALID;
+    tails->tails = calloc(img->sb.n_blocks, sizeof(edfs_tail_t *));
+    if (!tails->tails)
+    {
+        free(tails);
+        return false;
+    }
+
+    pthread_mutex_init(&tails->lock, NULL);
+    img->tails = tails;
+
+    /* Rebuild the unit maps from the inline files in the table. */
+    for (uint32_t i = 1; i < img->sb.inode_table_n_inodes; i++)
+    {
+        const edfs_disk_inode_t *inode = &img->inodes[i];
+        if (!edfs_disk_inode_is_inline(inode) || inode->tail >= img->sb.n_blocks)
+            continue;
+
+        uint32_t first = inode->tail_off / EDFS_TAIL_UNIT_SIZE;
+        uint32_t n = edfs_tail_units(inode->size);
+        if (first + n > tails->n_units)
+            continue;
+
+        edfs_tail_t *tail = tails->tails[inode->tail];
+        if (!tail)
+        {
+            tail = calloc(1, sizeof(edfs_tail_t));
+            if (!tail)
+            {
+                edfs_tail_free(img);
+                return false;
+            }
+            tails->tails[inode->tail] = tail;
+        }
+
+        edfs_tail_mark(tail, first, n, true);
+        tails->reuse = inode->tail;
+    }
+
+    return true;
+}
+
+void
+edfs_tail_free(edfs_image_t *img)
+{
+    edfs_tails_t *tails = img->tails;
+    if (!tails)
+        return;
+
+    for (uint32_t i = 0; i < img->sb.n_blocks; i++)
+        free(tails->tails[i]);
+    free(tails->tails);
+    pthread_mutex_destroy(&tails->lock);
+    free(tails);
+    img->tails = NULL;
+}
+
+/* Allocates @n consecutive units, returned as a block and byte offset.
+ * Must be called with tails->lock held.
+ */
+static int
+edfs_tail_alloc(edfs_image_t *img, uint32_t n, edfs_block_t *block,
+                uint16_t *off)
+{
+    edfs_tails_t *tails = img->tails;
+    const edfs_block_t candidates[] = { tails->current, tails->reuse };
+
+    for (size_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++)
+    {
+        edfs_block_t b = candidates[i];
+        if (b == EDFS_BLOCK_INVALID || !tails->tails[b])
+            continue;
+
+        uint32_t first = edfs_tail_find(tails, tails->tails[b], n);
+        if (first < tails->n_units)
+        {
+            edfs_tail_mark(tails->tails[b], first, n, true);
+            tails->current = b;
+            *block = b;
+            *off = first * EDFS_TAIL_UNIT_SIZE;
+            return 0;
+        }
+    }
+
+    edfs_tail_t *tail = calloc(1, sizeof(edfs_tail_t));
+    if (!tail)
+        return -ENOMEM;
+
+    edfs_block_t b;
+    int ret = edfs_get_new_block(img, &b);
+    if (ret < 0)
+    {
+        free(tail);
+        return ret;
+    }
+
+    ret = edfs_cache_zero(img, b, EDFS_SITE_DATA);
+    if (ret < 0)
+    {
+        edfs_bitmap_clear(img, b);
+        free(tail);
+        return ret;
+    }
+
+    edfs_tail_mark(tail, 0, n, true);
+    tails->tails[b] = tail;
+    tails->current = b;
+    *block = b;
+    *off = 0;
+
+    return 0;
+}
+
+/* Frees @n units starting at byte @off of tail block @block, releasing
+ * the block if it is no longer used. Must be called with tails->lock
+ * held.
+ */
+static void
+edfs_tail_release_units(edfs_image_t *img, edfs_block_t block, uint16_t off,
+                        uint32_t n)
+{
+    edfs_tails_t *tails = img->tails;
+    edfs_tail_t *tail = tails->tails[block];
+    if (!tail || n == 0)
+        return;
+
+    edfs_tail_mark(tail, off / EDFS_TAIL_UNIT_SIZE, n, false);
+    if (tail->n_used > 0)
+    {
+        if (block != tails->current)
+            tails->reuse = block;
+        return;
+    }
+
+    free(tail);
+    tails->tails[block] = NULL;
+    if (tails->current == block)
+        tails->current = EDFS_BLOCK_INVALID;
+    if (tails->reuse == block)
+        tails->reuse = EDFS_BLOCK_INVALID;
+
+    edfs_cache_forget(img, block);
+    edfs_bitmap_clear(img, block);
+}
+
+int
+edfs_tail_read(edfs_image_t *img, edfs_inode_t *inode, void *buf,
+               uint32_t size, uint32_t off)
+{
+    const uint32_t file_size = inode->inode.size;
+    uint32_t n = 0;
+
+    if (off < file_size)
+    {
+        n = file_size - off < size ? file_size - off : size;
+
+        int ret = edfs_cache_read(img, inode->inode.tail, buf,
+                                  inode->inode.tail_off + off, n,
+                                  EDFS_SITE_DATA);
+        if (ret < 0)
+            return ret;
+    }
+
+    /* Like a hole, the part beyond the end of the file reads as zeroes. */
+    memset((char *)buf + n, 0, size - n);
+
+    return size;
+}
+
+/* Gives @inode a size of @size, with @buf stored at @off, which must
+ * fit inline. The data is rewritten in place if its units suffice,
+ * otherwise it moves to newly allocated units. The part between the old
+ * and the new end of the file reads as zeroes.
+ */
+static int
+edfs_tail_update(edfs_image_t *img, edfs_inode_t *inode, uint32_t size,
+                 const void *buf, uint32_t buf_size, uint32_t off)
+{
+    edfs_tails_t *tails = img->tails;
+    edfs_disk_inode_t *di = &inode->inode;
+
+    const bool is_inline = edfs_disk_inode_is_inline(di);
+    const uint32_t old_size = di->size;
+    const uint32_t have = is_inline ? edfs_tail_units(old_size) : 0;
+    const uint32_t need = edfs_tail_units(size);
+    int ret = 0;
+
+    pthread_mutex_lock(&tails->lock);
+
+    if (is_inline && need <= have)
+    {
+        if (size > old_size)
+        {
+            uint8_t zero[EDFS_MAX_BLOCK_SIZE] = { 0, };
+            ret = edfs_cache_write(img, di->tail, zero, di->tail_off + old_size,
+                                   size - old_size, EDFS_SITE_DATA);
+        }
+        if (ret >= 0 && buf_size > 0)
+            ret = edfs_cache_write(img, di->tail, buf, di->tail_off + off,
+                                   buf_size, EDFS_SITE_DATA);
+
+        edfs_tail_release_units(img, di->tail,
+                                di->tail_off + need * EDFS_TAIL_UNIT_SIZE,
+                                have - need);
+    }
+    else
+    {
+        /* A file that is not inline yet has no blocks, only a hole. */
+        uint8_t data[EDFS_MAX_BLOCK_SIZE] = { 0, };
+        if (is_inline)
+            ret = edfs_cache_read(img, di->tail, data, di->tail_off,
+                                  old_size < size ? old_size : size,
+                                  EDFS_SITE_DATA);
+        if (buf_size > 0)
+            memcpy(data + off, buf, buf_size);
+
+        edfs_block_t block;
+        uint16_t tail_off;
+        if (ret >= 0)
+            ret = edfs_tail_alloc(img, need, &block, &tail_off);
+        if (ret >= 0)
+        {
+            ret = edfs_cache_write(img, block, data, tail_off, size,
+                                   EDFS_SITE_DATA);
+            if (ret < 0)
+                edfs_tail_release_units(img, block, tail_off, need);
+        }
+        if (ret >= 0)
+        {
+            if (is_inline)
+                edfs_tail_release_units(img, di->tail, di->tail_off, have);
+
+            di->flags |= EDFS_INODE_FLAG_INLINE;
+            di->tail = block;
+            di->tail_off = tail_off;
+        }
+    }
+
+    pthread_mutex_unlock(&tails->lock);
+
+    if (ret >= 0)
+    {
+        di->size = size;
+        ret = edfs_write_inode(img, inode);
+    }
+
+    int fret = edfs_bitmap_flush(img);
+    if (ret < 0)
+        return ret;
+
+    return fret < 0 ? fret : 0;
+}
+
+/* Returns true if writing @size bytes at @off of @inode keeps, or
+ * makes, its data inline: the file must still end within the inline
+ * limit afterwards and, if it is not inline yet, may not have any
+ * blocks.
+ */
+bool
+edfs_tail_fits(edfs_image_t *img, edfs_inode_t *inode, uint32_t size,
+               uint32_t off)
+{
+    const edfs_disk_inode_t *di = &inode->inode;
+    const uint32_t max = edfs_get_inline_max_size(&img->sb);
+
+    if (!img->tails || di->type != EDFS_INODE_TYPE_FILE || size == 0 ||
+            off + size < off || off + size > max || di->size > max)
+        return false;
+    else if (edfs_disk_inode_is_inline(di))
+        return true;
+
+    for (int i = 0; i < EDFS_INODE_N_DIRECT_BLOCKS; i++)
+        if (di->direct[i] != EDFS_BLOCK_INVALID)
+            return false;
+
+    return di->indirect == EDFS_BLOCK_INVALID;
+}
+
+int
+edfs_tail_write(edfs_image_t *img, edfs_inode_t *inode, const void *buf,
+                uint32_t size, uint32_t off)
+{
+    uint32_t new_size = off + size > inode->inode.size ?
+        off + size : inode->inode.size;
+
+    int ret = edfs_tail_update(img, inode, new_size, buf, size, off);
+
+    return ret < 0 ? ret : (int)size;
+}
+
+int
+edfs_tail_truncate(edfs_image_t *img, edfs_inode_t *inode, uint32_t size)
+{
+    if (size > 0)
+        return edfs_tail_update(img, inode, size, NULL, 0, 0);
+
+    edfs_tail_release(img, inode);
+    inode->inode.size = 0;
+
+    int ret = edfs_write_inode(img, inode);
+    int fret = edfs_bitmap_flush(img);
+    if (ret < 0)
+        return ret;
+
+    return fret < 0 ? fret : 0;
+}
+
+void
+edfs_tail_release(edfs_image_t *img, edfs_inode_t *inode)
+{
+    edfs_disk_inode_t *di = &inode->inode;
+    if (!edfs_disk_inode_is_inline(di))
+        return;
+
+    if (img->tails)
+    {
+        pthread_mutex_lock(&img->tails->lock);
+        edfs_tail_release_units(img, di->tail, di->tail_off,
+                                edfs_tail_units(di->size));
+        pthread_mutex_unlock(&img->tails->lock);
+    }
+
+    di->flags &= ~EDFS_INODE_FLAG_INLINE;
+    di->tail = 0;
+    di->tail_off = 0;
+}
@@ -0,0 +1,125 @@
+/* EdFS -- An educational file system
+ *
+ * Copyright (C) 2019  Leiden University, The Netherlands.
+ */
+
+/*
+ * io_uring backend
+ *
+ * Executes the batches handed to edfs_image_submit() in EDFS_IO_URING
+ * mode. All requests of a batch are queued as vectored reads and writes
+ * on a ring shared by the image and submitted with a single syscall,
+ * which also waits for their completion. Batches larger than the ring
+ * are split into EDFS_URING_DEPTH sized chunks.
+ *
+ * This file is only built with WITH_IO_URING=1 and requires liburing.
+ */
+
+#include "edfs-common.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#include <liburing.h>
+
+struct edfs_uring
+{
+    /* The ring is used by one batch at a time. */
+    pthread_mutex_t lock;
+    struct io_uring ring;
+};
+
+bool
+edfs_uring_init(edfs_image_t *img)
+{
+    edfs_uring_t *uring = calloc(1, sizeof(edfs_uring_t));
+    if (!uring)
+        return false;
+
+    int ret = io_uring_queue_init(EDFS_URING_DEPTH, &uring->ring, 0);
+    if (ret < 0)
+    {
+        fprintf(stderr, "error: file '%s': could not set up io_uring: %s\n",
+                img->filename, strerror(-ret));
+        free(uring);
+        return false;
+    }
+
+    pthread_mutex_init(&uring->lock, NULL);
+    img->uring = uring;
+
+    return true;
+}
+
+void
+edfs_uring_free(edfs_image_t *img)
+{
+    edfs_uring_t *uring = img->uring;
+    if (!uring)
+        return;
+
+    io_uring_queue_exit(&uring->ring);
+    pthread_mutex_destroy(&uring->lock);
+    free(uring);
+    img->uring = NULL;
+}
+
+/* Queues and completes @n_reqs requests, at most EDFS_URING_DEPTH. */
+static void
+edfs_uring_submit_chunk(edfs_image_t *img, edfs_io_req_t *reqs, int n_reqs)
+{
+    struct io_uring *ring = &img->uring->ring;
+
+    for (int i = 0; i < n_reqs; i++)
+    {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+        edfs_io_req_t *req = &reqs[i];
+
+        if (req->write)
+            io_uring_prep_writev(sqe, img->fd, req->iov, req->n_iov, req->off);
+        else
+            io_uring_prep_readv(sqe, img->fd, req->iov, req->n_iov, req->off);
+
+        io_uring_sqe_set_data(sqe, req);
+        req->res = -EIO;
+    }
+
+    int ret = io_uring_submit_and_wait(ring, n_reqs);
+    if (ret < 0)
+    {
+        for (int i = 0; i < n_reqs; i++)
+            reqs[i].res = ret;
+        return;
+    }
+
+    for (int i = 0; i < n_reqs; i++)
+    {
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(ring, &cqe) < 0)
+            break;
+
+        edfs_io_req_t *req = io_uring_cqe_get_data(cqe);
+        req->res = cqe->res;
+        io_uring_cqe_seen(ring, cqe);
+    }
+}
+
+/* Performs all requests in @reqs and stores their result in res. */
+void
+edfs_uring_submit(edfs_image_t *img, edfs_io_req_t *reqs, int n_reqs)
+{
+    pthread_mutex_lock(&img->uring->lock);
+
+    for (int done = 0; done < n_reqs; done += EDFS_URING_DEPTH)
+    {
+        int n = n_reqs - done;
+        if (n > EDFS_URING_DEPTH)
+            n = EDFS_URING_DEPTH;
+
+        edfs_uring_submit_chunk(img, reqs + done, n);
+    }
+
+    pthread_mutex_unlock(&img->uring->lock);
+}
@@ -42,6 +42,7 @@ typedef uint16_t edfs_block_t;
 #define EDFS_SUPER_BLOCK_OFFSET 512
 
 #define EDFS_MAGIC 0x00133700f00d0034ULL
+#define EDFS_JOURNAL_SB_MAGIC 0x4a534645   /* "EFSJ" */
 
 typedef struct
 {
@@ -62,6 +63,15 @@ typedef struct
 
   /* Inode hosting the root directory of the file system. */
   edfs_inumber_t root_inumber;
+
+  /* Metadata journal, see edfs-journal.c. Located in the data area and
+   * marked as used in the bitmap. The remainder of the super block
+   * sector is unused and may hold anything, so the fields below are
+   * only valid if journal_magic is EDFS_JOURNAL_SB_MAGIC.
+   */
+  uint32_t journal_magic;
+  edfs_block_t journal_start;
+  uint16_t journal_n_blocks;
 } __attribute__((__packed__)) edfs_super_block_t;
 
 
@@ -83,21 +93,37 @@ typedef enum
                                         * compatibility.
                                         */
 
-/* Padded to be 16 bytes in size, with 5 reserved bytes available for
- * future expansion.
+/* Inode flags. */
+#define EDFS_INODE_FLAG_HASHED 0x01     /* directory in hashed format */
+#define EDFS_INODE_FLAG_INLINE 0x02     /* file data stored in a tail block */
+
+/* Padded to be 16 bytes in size. The fields that were reserved for
+ * future expansion locate the data of an inline file, they are 0 for
+ * other inodes.
  */
 typedef struct
 {
   edfs_inode_type_t type : 8;
-  uint8_t reserved[3];
+  uint8_t flags;
+  edfs_block_t tail;
 
   uint32_t size;
 
   edfs_block_t direct[EDFS_INODE_N_DIRECT_BLOCKS];
   edfs_block_t indirect;
-  uint16_t reserved2;
+  uint16_t tail_off;
 } __attribute__((__packed__)) edfs_disk_inode_t;
 
+/* A regular file with EDFS_INODE_FLAG_INLINE set has no blocks of its
+ * own, its direct and indirect blocks are invalid. Its size bytes are
+ * stored at byte tail_off of block tail instead, a so-called tail block
+ * that is shared with other small files. A tail block is marked as used
+ * in the bitmap while it holds the data of any file. The data of a file
+ * starts at a multiple of EDFS_TAIL_UNIT_SIZE and files of at most
+ * edfs_get_inline_max_size() bytes are stored this way.
+ */
+#define EDFS_TAIL_UNIT_SIZE 32
+
 
 /*
  * Directory entry
@@ -116,6 +142,19 @@ typedef struct
   char filename[EDFS_FILENAME_SIZE];
 } __attribute__((__packed__)) edfs_dir_entry_t;
 
+/* A classic directory stores its entries in the direct blocks only.
+ * A directory with EDFS_INODE_FLAG_HASHED set uses every block it can
+ * address as a bucket instead: a name is stored in the bucket given by
+ * edfs_dir_hash(), or if that is full in the next bucket that is not,
+ * wrapping around. Buckets that hold no names need not be allocated.
+ *
+ * The first entry of a bucket is a header and always reads as empty.
+ * Its filename[EDFS_DIR_BUCKET_OVERFLOW] is set once the bucket was
+ * found full on insertion; a lookup only continues in the next bucket
+ * if it is set.
+ */
+#define EDFS_DIR_BUCKET_OVERFLOW 1
+
 
 
 /*
@@ -147,12 +186,50 @@ edfs_get_n_blocks_per_indirect_block(const edfs_super_block_t *sb)
   return sb->block_size / sizeof(edfs_block_t);
 }
 
+/* Number of buckets of a hashed directory. */
+static inline uint32_t
+edfs_get_n_dir_buckets(const edfs_super_block_t *sb)
+{
+  return EDFS_INODE_N_DIRECT_BLOCKS + edfs_get_n_blocks_per_indirect_block(sb);
+}
+
+static inline uint32_t
+edfs_get_inline_max_size(const edfs_super_block_t *sb)
+{
+  return sb->block_size / 4;
+}
+
+/* 32-bit FNV-1a hash of a filename, selecting its home bucket. */
+static inline uint32_t
+edfs_dir_hash(const char *name)
+{
+  uint32_t hash = 2166136261u;
+
+  for (; *name; name++)
+    {
+      hash ^= (uint8_t)*name;
+      hash *= 16777619u;
+    }
+
+  return hash;
+}
+
 static inline uint32_t
 edfs_get_block_offset(const edfs_super_block_t *sb, edfs_block_t block)
 {
   return sb->block_size * block;
 }
 
+/* First block following the inode table; blocks before it are never
+ * handed out for file or directory data.
+ */
+static inline edfs_block_t
+edfs_get_data_block_start(const edfs_super_block_t *sb)
+{
+  return (sb->inode_table_start + sb->inode_table_size + sb->block_size - 1)
+      / sb->block_size;
+}
+
 static inline off_t
 edfs_get_inode_offset(edfs_super_block_t *sb, edfs_inumber_t inumber)
 {
@@ -174,4 +251,18 @@ edfs_disk_inode_is_directory(const edfs_disk_inode_t *inode)
   return inode->type == EDFS_INODE_TYPE_DIRECTORY;
 }
 
+static inline bool
+edfs_disk_inode_is_hashed(const edfs_disk_inode_t *inode)
+{
+  return inode->type == EDFS_INODE_TYPE_DIRECTORY &&
+      (inode->flags & EDFS_INODE_FLAG_HASHED);
+}
+
+static inline bool
+edfs_disk_inode_is_inline(const edfs_disk_inode_t *inode)
+{
+  return inode->type == EDFS_INODE_TYPE_FILE &&
+      (inode->flags & EDFS_INODE_FLAG_INLINE);
+}
+
 #endif /* __EDFS_H__ */
@@ -14,363 +14,90 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <unistd.h>
-#include <limits.h>
-#include <ctype.h>
 
 #include <stdbool.h>
 
-/* 
- * Checks if file or folder names are valid
- */
-static int edfs_check_filename(const char *name)
-{
-    if (name == NULL)
-        return -EINVAL;
-
-    size_t len = strlen(name);
-
-    if (len == 0) {
-        return -EINVAL;
-    } else if (len > 59) {
-        return -ENAMETOOLONG;
-    }
-
-    for (size_t i = 0; i < len; i++) {
-        char curr_char = name[i];
-        if (!(isalpha(curr_char) ||
-              isdigit(curr_char) ||
-              curr_char == ' ' || 
-              curr_char == '.'))
-            return -EINVAL;
-    }
-
-    return 0;
-}
-
-static int
-edfs_add_dir_entry(edfs_image_t *img, edfs_inode_t *inode,
-                   const char *name, edfs_inumber_t inumber)
-{
-    const uint32_t n_entries =
-        EDFS_INODE_N_DIRECT_BLOCKS * img->sb.block_size / sizeof(edfs_dir_entry_t);
-
-    int ret = edfs_check_filename(name);
-    if (ret != 0)
-        return ret;
-
-    uint32_t entry_off = UINT32_MAX;
-    for (uint32_t i = 0; i < n_entries; i++)
-    {
-        edfs_dir_entry_t tmp;
-        uint32_t off = i * sizeof(edfs_dir_entry_t);
-        ret = edfs_read_inode_data(img, inode, &tmp, sizeof(tmp), off);
-        if (ret < 0)
-            return ret;
-        else if (ret == 0) {
-            /*
-             * if ret == 0, we attempt to read from an unallocated block,
-             * thus we can store an new entry at this location
-             */
-            if (entry_off == UINT32_MAX)
-                entry_off = off;
-
-            continue;
-        }
-
-        if (tmp.inumber == EDFS_BLOCK_INVALID) {
-            if (entry_off == UINT32_MAX)
-                entry_off = off;
-            
-            continue;
-        }
-
-        if (strcmp(name, tmp.filename) == 0)
-            return -EEXIST;
-    }
-
-    if (entry_off == UINT32_MAX)
-        return -ENOMSG;
-
-    edfs_dir_entry_t tmp;
-    tmp.inumber = inumber;
-    strcpy(tmp.filename, name);
-    ret = 0;
-    ret = edfs_write_inode_data(img, inode, &tmp, sizeof(tmp), entry_off);
-    if (ret < 0)
-        return ret;
-    else if (ret != sizeof(tmp))
-        return -EIO;
-
-    return 0;
-}
-
-static int 
-edfs_remove_dir_entry(edfs_image_t *img, edfs_inode_t *inode, const char *name) 
-{
-    const uint32_t n_entries =
-        EDFS_INODE_N_DIRECT_BLOCKS * img->sb.block_size / sizeof(edfs_dir_entry_t);
-
-    for (uint32_t i = 0; i < n_entries; i++)
-    {
-
-        edfs_dir_entry_t tmp;
-        uint32_t off = i * sizeof(edfs_dir_entry_t);
-        int ret = edfs_read_inode_data(img, inode, &tmp, sizeof(tmp), off);
-        if (ret < 0)
-            return ret;
-        else if (ret == 0)
-            continue;
-
-        if (tmp.inumber == EDFS_BLOCK_INVALID)
-            continue;
-
-        if (strcmp(name, tmp.filename) == 0) {
-            // clear entry and write
-            memset(&tmp, 0, sizeof(tmp));
-            ret = edfs_write_inode_data(img, inode, &tmp, sizeof(tmp), off);
-            if (ret < 0)
-                return ret;
-            else if (ret == 0)
-                return -EIO;
-
-            return 0;
-        }
-    }
-
-    return -ENOENT;
-}
-
-
 static inline edfs_image_t *
 get_edfs_image(void)
 {
   return (edfs_image_t *)fuse_get_context()->private_data;
 }
 
+/* Path of the statistics file, see edfs_stats_file_open(). */
+#define EDFS_STATS_PATH "/.edfs-stats"
 
-/*
- * returns negative on error or the number of entries on success
- * entries must be at least EDFS_MAX_DIR_ENTRIES
-*/
-static int edfs_get_dir_entries(edfs_image_t *img, edfs_inode_t *inode, edfs_dir_entry_t *entries)
-{
-    uint32_t n_entries = EDFS_INODE_N_DIRECT_BLOCKS * img->sb.block_size / sizeof(edfs_dir_entry_t);
-    int count = 0;
-    for (uint32_t i = 0; i < n_entries; i++)
-    {
-        edfs_dir_entry_t tmp;
-        uint32_t off = i * sizeof(edfs_dir_entry_t);
-        int ret = edfs_read_inode_data(img, inode, &tmp, sizeof(tmp), off);
-        if (ret < 0)
-            return ret;
-        else if (ret == 0)
-            continue;
-
-        if (tmp.inumber == EDFS_BLOCK_INVALID)
-            continue;
-
-        entries[count++] = tmp;
-    }
+/* Kernel cache timeouts, in seconds. */
+#define EDFUSE_TIMEOUT_OPTS \
+  "entry_timeout=30,negative_timeout=30,attr_timeout=30"
 
-    return count;
+static inline bool
+edfs_is_stats_path(const char *path)
+{
+  return strcmp(path, EDFS_STATS_PATH) == 0;
 }
 
-/* Searches the file system hierarchy to find the inode for
- * the given path. Returns true if the operation succeeded.
+/* A report is never empty, a @size of 0 asks for the size of a new one
+ * rather than that of an opened snapshot.
  */
-static bool
-edfs_find_inode(edfs_image_t *img,
-                const char *path,
-                edfs_inode_t *inode)
+static int
+edfs_stats_file_getattr(edfs_image_t *img, size_t size, struct stat *stbuf)
 {
-  if (strlen(path) == 0 || path[0] != '/')
-    return false;
-
-  edfs_inode_t current_inode;
-  edfs_read_root_inode(img, &current_inode);
-
-  while (path && (path = strchr(path, '/')))
-    {
-      /* Ignore path separator */
-      while (*path == '/')
-        path++;
-
-      /* Find end of new component */
-      char *end = strchr(path, '/');
-      if (!end)
-        {
-          int len = strnlen(path, PATH_MAX);
-          if (len > 0)
-            end = (char *)&path[len];
-          else
-            {
-              /* We are done: return current entry. */
-              *inode = current_inode;
-              return true;
-            }
-        }
-
-      /* Verify length of component is not larger than maximum allowed
-       * filename size.
-       */
-      int len = end - path;
-      if (len >= EDFS_FILENAME_SIZE)
-        return false;
-
-      /* Within the directory pointed to by parent_inode, find the
-       * inode number for path, len.
-       */
-      edfs_dir_entry_t direntry = { 0, };
-      strncpy(direntry.filename, path, len);
-      direntry.filename[len] = 0;
-
-      if (direntry.filename[0] != 0)
-        {
-          bool found = false;
-
-          const uint32_t n_entries =
-            EDFS_INODE_N_DIRECT_BLOCKS * img->sb.block_size / sizeof(edfs_dir_entry_t);
-          for (uint32_t i = 0; i < n_entries; i++)
-          {
-              edfs_dir_entry_t tmp;
-              uint32_t off = i * sizeof(edfs_dir_entry_t);
-              int ret = edfs_read_inode_data(img, &current_inode, &tmp, sizeof(tmp), off);
-              if (ret < 0) {
-                  return false;
-              }
-              else if (ret == 0)
-                  continue; // this can happen when we try to read from an invalid block
-
-              if (tmp.inumber == 0)
-                  continue; // empty file
-
-              if (strcmp(direntry.filename, tmp.filename) == 0) {
-                  direntry.inumber = tmp.inumber;
-                  found = true;
-                  break; // no need to keep searching
-              }
-          }
-
-          if (found)
-            {
-              /* Found what we were looking for, now get our new inode. */
-              current_inode.inumber = direntry.inumber;
-              edfs_read_inode(img, &current_inode);
-            }
-          else
-            return false;
-        }
-
-      path = end;
-    }
+  if (size == 0)
+    free(edfs_stats_report(img, &size));
 
-  *inode = current_inode;
+  stbuf->st_mode = S_IFREG | 0444;
+  stbuf->st_nlink = 1;
+  stbuf->st_size = size;
 
-  return true;
-}
+  /* Past the last inumber, so it cannot collide with a real inode. */
+  stbuf->st_ino = img->sb.inode_table_n_inodes;
 
-static inline void
-drop_trailing_slashes(char *path_copy)
-{
-  int len = strlen(path_copy);
-  while (len > 0 && path_copy[len-1] == '/')
-    {
-      path_copy[len-1] = 0;
-      len--;
-    }
+  return 0;
 }
 
-/* Return the parent inode, for the containing directory of the inode (file or
- * directory) specified in @path. Returns 0 on success, error code otherwise.
- *
- * (This function is not yet used, but will be useful for your
- * implementation.)
+/* Fill @stbuf with the attributes of inode @inumber, taken from the
+ * attribute cache. At least mode, nlink and size must be filled here,
+ * otherwise the "ls" listings appear busted. We assume all files and
+ * directories have rw permissions for owner and group.
  */
 static int
-edfs_get_parent_inode(edfs_image_t *img,
-                      const char *path,
-                      edfs_inode_t *parent_inode)
+edfuse_fill_stat(edfs_image_t *img, edfs_inumber_t inumber,
+                 struct stat *stbuf)
 {
-  int res;
-  char *path_copy = strdup(path);
-
-  drop_trailing_slashes(path_copy);
-
-  if (strlen(path_copy) == 0)
-    {
-      res = -EINVAL;
-      goto out;
-    }
-
-  /* Extract parent component */
-  char *sep = strrchr(path_copy, '/');
-  if (!sep)
-    {
-      res = -EINVAL;
-      goto out;
-    }
-
-  if (path_copy == sep)
-    {
-      /* The parent is the root directory. */
-      edfs_read_root_inode(img, parent_inode);
-      res = 0;
-      goto out;
-    }
+  edfs_attr_t attr;
+  int ret = edfs_attr_get(img, inumber, &attr);
+  if (ret < 0)
+    return ret;
 
-  /* If not the root directory for certain, start a usual search. */
-  *sep = 0;
-  char *dirname = path_copy;
-
-  if (!edfs_find_inode(img, dirname, parent_inode))
+  memset(stbuf, 0, sizeof(struct stat));
+  if (inumber == img->sb.root_inumber)
     {
-      res = -ENOENT;
-      goto out;
+      stbuf->st_mode = S_IFDIR | 0755;
+      stbuf->st_nlink = 2;
     }
-
-  res = 0;
-
-out:
-  free(path_copy);
-
-  return res;
-}
-
-/* Separates the basename (the actual name of the file) from the path.
- * The return value must be freed.
- *
- * (This function is not yet used, but will be useful for your
- * implementation.)
- */
-static char *
-edfs_get_basename(const char *path)
-{
-  char *res = NULL;
-  char *path_copy = strdup(path);
-
-  drop_trailing_slashes(path_copy);
-
-  if (strlen(path_copy) == 0)
+  else if (attr.type == EDFS_INODE_TYPE_DIRECTORY)
     {
-      res = NULL;
-      goto out;
+      stbuf->st_mode = S_IFDIR | 0770;
+      stbuf->st_nlink = 2;
     }
-
-  /* Find beginning of basename. */
-  char *sep = strrchr(path_copy, '/');
-  if (!sep)
+  else
     {
-      res = NULL;
-      goto out;
+      stbuf->st_mode = S_IFREG | 0660;
+      stbuf->st_nlink = 1;
     }
+  stbuf->st_size = attr.size;
+  stbuf->st_blksize = img->sb.block_size;
+  stbuf->st_blocks = (blkcnt_t)attr.n_blocks * img->sb.block_size / 512;
 
-  res = strdup(sep + 1);
-
-out:
-  free(path_copy);
+  /* Used by the kernel because the file system is mounted with the
+   * 'use_ino' option, see main().
+   */
+  stbuf->st_ino = inumber;
 
-  return res;
+  return 0;
 }
 
 
@@ -378,12 +105,26 @@ out:
  * Implementation of necessary FUSE operations.
  */
 
+/*
+ * Locking: operations that change the directory tree (mkdir, rmdir)
+ * hold the namespace lock exclusively, lookups and directory listings
+ * hold it shared. Access to the data of a file is protected by the
+ * per-inode lock. The namespace lock is always taken first.
+ */
+
+/* Offsets handed to the filler: "." and ".." take positions 0 and 1,
+ * the directory slot at byte offset n * sizeof(edfs_dir_entry_t) takes
+ * position 2 + n. Each entry is passed the position after its own, so
+ * the listing resumes there when the kernel's buffer fills up.
+ */
+#define EDFS_READDIR_FIRST_SLOT 2
+
 static int
-edfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-               off_t offset, struct fuse_file_info *fi)
+edfs_readdir_locked(edfs_image_t *img, const char *path, void *buf,
+                    fuse_fill_dir_t filler, off_t offset)
 {
-    edfs_image_t *img = get_edfs_image();
     edfs_inode_t inode = { 0, };
+    struct stat st;
 
     if (!edfs_find_inode(img, path, &inode))
     return -ENOENT;
@@ -391,97 +132,112 @@ edfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     if (!edfs_disk_inode_is_directory(&inode.inode))
     return -ENOTDIR;
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+    if (offset < 1)
+    {
+        int ret = edfuse_fill_stat(img, inode.inumber, &st);
+        if (ret < 0)
+            return ret;
+        if (filler(buf, ".", &st, 1))
+            return 0;
+    }
+    if (offset < 2 && filler(buf, "..", NULL, 2))
+        return 0;
+
+    edfs_dir_iter_t it;
+    edfs_dir_entry_t *entry;
+    uint32_t off;
+    int ret;
 
-    /* TODO: traverse all valid directory entries of @inode and call
-    * the filler function (as done above) for each entry. The second
-    * argument of the filler function is the filename you want to add.
-    */
+    edfs_dir_iter_init(&it, img, &inode);
+    if (offset > EDFS_READDIR_FIRST_SLOT)
+    {
+        ret = edfs_dir_iter_seek(&it, (offset - EDFS_READDIR_FIRST_SLOT) *
+                                      sizeof(edfs_dir_entry_t));
+        if (ret <= 0)
+            return ret;
+    }
 
-    // TODO eigenlijk dir entries functie gebruiken en dan geen dubbele code etc.
-    uint32_t n_entries = EDFS_INODE_N_DIRECT_BLOCKS * img->sb.block_size / sizeof(edfs_dir_entry_t);
-    for (uint32_t i = 0; i < n_entries; i++)
+    while ((ret = edfs_dir_iter_next(&it, &entry, &off)) > 0)
     {
-        edfs_dir_entry_t tmp;
-        uint32_t off = i * sizeof(edfs_dir_entry_t);
-        int ret = edfs_read_inode_data(img, &inode, &tmp, sizeof(tmp), off);
-        if (ret < 0)
-            return -1; 
-        else if (ret == 0)
+        if (edfs_dir_entry_is_empty(entry))
             continue;
 
-        if (tmp.inumber == EDFS_BLOCK_INVALID)
-            continue;
+        /* The attributes of every entry are taken in this same pass, so
+         * that "ls -l" does not need a path walk per entry for them. An
+         * entry whose inode cannot be read is still listed, without
+         * them, rather than failing the whole listing.
+         */
+        bool have_st = edfuse_fill_stat(img, entry->inumber, &st) >= 0;
 
-        filler(buf, tmp.filename, NULL, 0);
+        off_t next = EDFS_READDIR_FIRST_SLOT +
+            off / sizeof(edfs_dir_entry_t) + 1;
+        if (filler(buf, entry->filename, have_st ? &st : NULL, next))
+            return 0;
     }
 
+    if (ret < 0)
+        return ret;
+
     return 0;
 }
 
 static int
-edfuse_mkdir(const char *path, mode_t mode)
+edfuse_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+               off_t offset, struct fuse_file_info *fi)
 {
-    /* TODO: Fix
-     *
-     * Create a new inode, register in parent directory, write inode to
-     * disk.
-     */
-
     edfs_image_t *img = get_edfs_image();
 
-    char *name = edfs_get_basename(path);
-    if (name == NULL)
-        return -ENOMSG;
+    edfs_namespace_lock(img, false);
+    int ret = edfs_readdir_locked(img, path, buf, filler, offset);
+    edfs_namespace_unlock(img);
 
-    int ret = edfs_check_filename(name);
-    if (ret != 0) {
-        free(name);
-        return ret;
-    }
+    return ret;
+}
 
+/* Creates @path as a new, empty inode of @type. The parent is resolved
+ * once and the new entry is added with edfs_dir_create(), so nothing is
+ * left allocated when the name already exists.
+ */
+static int
+edfs_create_locked(edfs_image_t *img, const char *path,
+                   edfs_inode_type_t type, edfs_inode_t *inode)
+{
+    char name[EDFS_FILENAME_SIZE];
     edfs_inode_t parent_inode;
-    ret = edfs_get_parent_inode(img, path, &parent_inode);
-    if (ret != 0) {
-        free(name);
-        return ret;
-    }
 
-    edfs_inode_t inode;
-    ret = edfs_new_inode(img, &inode, EDFS_INODE_TYPE_DIRECTORY);
-    if (ret != 0) {
-        free(name);
+    int ret = edfs_find_parent(img, path, &parent_inode, name);
+    if (ret != 0)
         return ret;
-    }
 
-    ret = edfs_write_inode(img, &inode);
-    if (ret < 0) {
-        free(name);
-        return ret;
-    }
+    return edfs_dir_create(img, &parent_inode, name, type, inode);
+}
 
-    ret = edfs_add_dir_entry(img, &parent_inode, name, inode.inumber);
-    if (ret != 0) {
-        free(name);
-        return ret;
-    }
+static int
+edfuse_mkdir(const char *path, mode_t mode)
+{
+    edfs_image_t *img = get_edfs_image();
 
-    free(name);
+    if (edfs_is_stats_path(path))
+        return -EEXIST;
 
-    return 0;
+    edfs_inode_t inode;
+    edfs_journal_start(img);
+    edfs_namespace_lock(img, true);
+    int ret = edfs_create_locked(img, path, EDFS_INODE_TYPE_DIRECTORY, &inode);
+    edfs_namespace_unlock(img);
+    edfs_journal_stop(img);
+
+    return ret;
 }
 
 static int
-edfuse_rmdir(const char *path)
+edfs_rmdir_locked(edfs_image_t *img, const char *path)
 {
     /* 
      * Validate @path exists and is a directory; remove directory entry
      * from parent directory; release allocated blocks; release inode.
      */
 
-    edfs_image_t *img = get_edfs_image();
-
     char *name = edfs_get_basename(path);
     if (name == NULL)
         return -ENOMSG;
@@ -499,13 +255,12 @@ edfuse_rmdir(const char *path)
     }
 
     /* check if dirisempty */
-    edfs_dir_entry_t entries[EDFS_MAX_DIR_ENTRIES];
-    ret = edfs_get_dir_entries(img, &inode, entries);
+    ret = edfs_dir_is_empty(img, &inode);
     if (ret < 0) {
         free(name);
         return ret;
     }
-    else if (ret != 0) {
+    else if (ret == 0) {
         free(name);
         return -ENOTEMPTY;
     }
@@ -526,14 +281,11 @@ edfuse_rmdir(const char *path)
 
     /* After this point the the FS is corrupted if any of the following operations fail */
       
-    for (int i = 0; i < EDFS_INODE_N_DIRECT_BLOCKS; i++)
-    {
-        edfs_block_t block = inode.inode.direct[i];
-        if (block == EDFS_BLOCK_INVALID)
-            continue;
+    if (edfs_inode_free_blocks(img, &inode, 0) < 0)
+        return -EIO;
 
-        edfs_bitmap_clear(img, block);
-    }
+    /* The inumber may be reused, drop whatever was cached below it. */
+    edfs_dcache_forget_dir(img, inode.inumber);
 
     /* set inode to free state */
     if (edfs_clear_inode(img, &inode) <= 0)
@@ -542,149 +294,885 @@ edfuse_rmdir(const char *path)
     return 0;
 }
 
+static int
+edfuse_rmdir(const char *path)
+{
+    edfs_image_t *img = get_edfs_image();
+
+    if (edfs_is_stats_path(path))
+        return -ENOTDIR;
+
+    edfs_journal_start(img);
+    edfs_namespace_lock(img, true);
+    int ret = edfs_rmdir_locked(img, path);
+    edfs_namespace_unlock(img);
+    edfs_journal_stop(img);
+
+    return ret;
+}
+
 
-/* Get attributes of @path, fill @stbuf. At least mode, nlink and
- * size must be filled here, otherwise the "ls" listings appear busted.
- * We assume all files and directories have rw permissions for owner and
- * group.
- */
+/* Get attributes of @path, fill @stbuf. */
 static int
 edfuse_getattr(const char *path, struct stat *stbuf)
 {
-  int res = 0;
   edfs_image_t *img = get_edfs_image();
 
-
-  memset(stbuf, 0, sizeof(struct stat));
-  if (strcmp(path, "/") == 0)
+  if (edfs_is_stats_path(path))
     {
-      stbuf->st_mode = S_IFDIR | 0755;
-      stbuf->st_nlink = 2;
-      return res;
+      memset(stbuf, 0, sizeof(struct stat));
+      return edfs_stats_file_getattr(img, 0, stbuf);
     }
 
   edfs_inode_t inode;
-  if (!edfs_find_inode(img, path, &inode)) {
-    res = -ENOENT;
-  }
-  else
-    {
-      if (edfs_disk_inode_is_directory(&inode.inode))
-        {
-          stbuf->st_mode = S_IFDIR | 0770;
-          stbuf->st_nlink = 2;
-        }
-      else
-        {
-          stbuf->st_mode = S_IFREG | 0660;
-          stbuf->st_nlink = 1;
-        }
-      stbuf->st_size = inode.inode.size;
+  edfs_namespace_lock(img, false);
+  bool found = edfs_find_inode(img, path, &inode);
+  edfs_namespace_unlock(img);
 
-      /* Note that this setting is ignored, unless the FUSE file system
-       * is mounted with the 'use_ino' option.
-       */
-      stbuf->st_ino = inode.inumber;
-    }
+  if (!found)
+    return -ENOENT;
 
-  return res;
+  return edfuse_fill_stat(img, inode.inumber, stbuf);
 }
 
-/* Open file at @path. Verify it exists by finding the inode and
- * verify the found inode is not a directory. We do not maintain
- * state of opened files.
+/* State kept for every opened file; a pointer to it is stored in
+ * fi->fh so that read and write do not need to resolve the path again.
  */
-static int
-edfuse_open(const char *path, struct fuse_file_info *fi)
+typedef struct
 {
-  edfs_image_t *img = get_edfs_image();
+  /* Only the inumber, which does not change while the file is open;
+   * the inode itself is read under its lock when needed.
+   */
+  edfs_inumber_t inumber;
+  edfs_prealloc_t prealloc;
 
-  edfs_inode_t inode;
-  if (!edfs_find_inode(img, path, &inode))
-    return -ENOENT;
+  /* Reads on one handle may run in parallel, ra_lock protects ra. */
+  pthread_mutex_t ra_lock;
+  edfs_readahead_t ra;
 
-  /* Open may only be called on files. */
-  if (edfs_disk_inode_is_directory(&inode.inode))
-    return -EISDIR;
+  /* Set when data is written through the handle, see edfuse_flush(). */
+  bool written;
 
-  return 0;
+  /* For the statistics file: the report as it was when opened. */
+  char *stats;
+  size_t stats_size;
+} edfs_file_t;
+
+static inline edfs_file_t *
+get_edfs_file(struct fuse_file_info *fi)
+{
+  return fi ? (edfs_file_t *)(uintptr_t)fi->fh : NULL;
 }
 
+/* Allocates the handle for an opened file and stores it in @fi. */
 static int
-edfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+edfs_file_attach(struct fuse_file_info *fi, const edfs_inode_t *inode)
 {
-  /* TODO: implement
-   *
-   * Create a new inode, attempt to register in parent directory,
-   * write inode to disk.
-   */
-  return -ENOSYS;
+  edfs_file_t *file = calloc(1, sizeof(edfs_file_t));
+  if (!file)
+    return -ENOMEM;
+
+  file->inumber = inode->inumber;
+  pthread_mutex_init(&file->ra_lock, NULL);
+  fi->fh = (uintptr_t)file;
+
+  return 0;
 }
 
-/* Since we don't maintain link count, we'll treat unlink as a file
- * remove operation.
+/* Returns the inode of an opened file from its handle, or resolves
+ * @path if there is no handle. Only the inumber is set from a handle,
+ * the caller reads the inode once it holds the inode lock.
  */
-static int
-edfuse_unlink(const char *path)
+static bool
+edfs_file_get_inode(edfs_image_t *img, const char *path, edfs_file_t *file,
+                    edfs_inode_t *inode)
 {
-  /* TODO: implement
-   *
-   * Validate @path exists and is not a directory; remove directory entry
-   * from parent directory; release allocated blocks; release inode.
-   */
-  return -ENOSYS;
+  if (file)
+    {
+      *inode = (edfs_inode_t){ .inumber = file->inumber };
+      return true;
+    }
+
+  edfs_namespace_lock(img, false);
+  bool found = edfs_find_inode(img, path, inode);
+  edfs_namespace_unlock(img);
+
+  return found;
 }
 
+
+/*
+ * Statistics file
+ *
+ * The root directory has a virtual, read-only file with a report of
+ * the statistics gathered since mount (see edfs-stats.c). It is not
+ * listed by readdir. Each open takes a snapshot of the report, which
+ * reads are served from.
+ */
+
 static int
-edfuse_read(const char *path, char *buf, size_t size, off_t offset,
-            struct fuse_file_info *fi)
+edfs_stats_file_open(edfs_image_t *img, struct fuse_file_info *fi)
 {
-    edfs_image_t *img = get_edfs_image();
+  if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    return -EACCES;
+
+  edfs_file_t *file = calloc(1, sizeof(edfs_file_t));
+  if (!file)
+    return -ENOMEM;
+
+  file->stats = edfs_stats_report(img, &file->stats_size);
+  if (!file->stats)
+    {
+      free(file);
+      return -ENOMEM;
+    }
+
+  pthread_mutex_init(&file->ra_lock, NULL);
+  fi->fh = (uintptr_t)file;
+
+  /* The size reported by getattr is outdated by the time of the read. */
+  fi->direct_io = 1;
+
+  return 0;
+}
+
+static int
+edfs_stats_file_read(edfs_file_t *file, char *buf, size_t size, off_t offset)
+{
+  if (offset < 0)
+    return -EINVAL;
+  else if ((size_t)offset >= file->stats_size)
+    return 0;
+
+  if (size > file->stats_size - offset)
+    size = file->stats_size - offset;
+  memcpy(buf, file->stats + offset, size);
+
+  return size;
+}
+
+/* Open file at @path. Verify it exists by finding the inode and
+ * verify the found inode is not a directory. The resolved inode is
+ * kept in a handle until the file is released.
+ */
+static int
+edfuse_open(const char *path, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  if (edfs_is_stats_path(path))
+    return edfs_stats_file_open(img, fi);
+
+  edfs_inode_t inode;
+  edfs_namespace_lock(img, false);
+  bool found = edfs_find_inode(img, path, &inode);
+  edfs_namespace_unlock(img);
+
+  if (!found)
+    return -ENOENT;
+
+  /* Open may only be called on files. */
+  if (edfs_disk_inode_is_directory(&inode.inode))
+    return -EISDIR;
+
+  return edfs_file_attach(fi, &inode);
+}
+
+static int
+edfuse_release(const char *path, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+  edfs_file_t *file = get_edfs_file(fi);
+
+  /* The window is only reserved in memory, no transaction is needed. */
+  if (file && file->prealloc.n_blocks > 0)
+    {
+      edfs_inode_lock(img, file->inumber, true);
+      edfs_prealloc_release(img, &file->prealloc);
+      edfs_inode_unlock(img, file->inumber);
+    }
+
+  if (file)
+    {
+      pthread_mutex_destroy(&file->ra_lock);
+      free(file->stats);
+    }
+
+  free(file);
+  fi->fh = 0;
+
+  return 0;
+}
+
+/* Get attributes of an opened file, without resolving its path. */
+static int
+edfuse_fgetattr(const char *path, struct stat *stbuf,
+                struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+  edfs_file_t *file = get_edfs_file(fi);
+
+  if (!file)
+    return edfuse_getattr(path, stbuf);
+  else if (file->stats)
+    {
+      memset(stbuf, 0, sizeof(struct stat));
+      return edfs_stats_file_getattr(img, file->stats_size, stbuf);
+    }
+
+  return edfuse_fill_stat(img, file->inumber, stbuf);
+}
+
+/* Create the file at @path and open it. */
+static int
+edfuse_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  if (edfs_is_stats_path(path))
+    return -EEXIST;
+
+  edfs_inode_t inode;
+  edfs_journal_start(img);
+  edfs_namespace_lock(img, true);
+  int ret = edfs_create_locked(img, path, EDFS_INODE_TYPE_FILE, &inode);
+  edfs_namespace_unlock(img);
+  edfs_journal_stop(img);
+
+  if (ret < 0)
+    return ret;
+
+  return edfs_file_attach(fi, &inode);
+}
+
+/* Since we don't maintain link count, we'll treat unlink as a file
+ * remove operation.
+ */
+static int
+edfs_unlink_locked(edfs_image_t *img, const char *path)
+{
+    /*
+     * Validate @path exists and is not a directory; remove directory entry
+     * from parent directory; release allocated blocks; release inode.
+     */
+
+    char *name = edfs_get_basename(path);
+    if (name == NULL)
+        return -ENOMSG;
+
+    int ret = edfs_check_filename(name);
+    if (ret != 0) {
+        free(name);
+        return ret;
+    }
 
     edfs_inode_t inode;
-    if (!edfs_find_inode(img, path, &inode))
+    if (!edfs_find_inode(img, path, &inode)) {
+        free(name);
         return -ENOENT;
+    }
+    else if (edfs_disk_inode_is_directory(&inode.inode)) {
+        free(name);
+        return -EISDIR;
+    }
 
-    if (inode.inode.size <= offset)
-        return -EINVAL;
+    edfs_inode_t parent_inode;
+    if (edfs_get_parent_inode(img, path, &parent_inode) != 0) {
+        free(name);
+        return -EIO;
+    }
+
+    if (edfs_remove_dir_entry(img, &parent_inode, name) != 0) {
+        free(name);
+        return -EIO;
+    }
+
+    free(name);
+
+    /* Wait for readers and writers of the file to finish. */
+    edfs_inode_lock(img, inode.inumber, true);
+
+    ret = edfs_read_inode(img, &inode);
+    if (ret > 0)
+        ret = edfs_inode_free_blocks(img, &inode, 0);
+    if (ret >= 0 && edfs_clear_inode(img, &inode) <= 0)
+        ret = -EIO;
+
+    edfs_inode_unlock(img, inode.inumber);
+
+    return ret < 0 ? -EIO : 0;
+}
+
+static int
+edfuse_unlink(const char *path)
+{
+    edfs_image_t *img = get_edfs_image();
+
+    if (edfs_is_stats_path(path))
+        return -EACCES;
+
+    edfs_journal_start(img);
+    edfs_namespace_lock(img, true);
+    int ret = edfs_unlink_locked(img, path);
+    edfs_namespace_unlock(img);
+    edfs_journal_stop(img);
+
+    return ret;
+}
 
-    if (inode.inode.type == EDFS_INODE_TYPE_DIRECTORY)
+static int
+edfs_read_locked(edfs_image_t *img, edfs_inode_t *inode, char *buf,
+                 size_t size, off_t offset)
+{
+    if (inode->inode.size <= offset)
+        return 0; /* end of file */
+
+    if (inode->inode.type == EDFS_INODE_TYPE_DIRECTORY)
         return -EISDIR;
-    else if (inode.inode.type != EDFS_INODE_TYPE_FILE)
+    else if (inode->inode.type != EDFS_INODE_TYPE_FILE)
         return -EIO; // can happen when fs is corrupted
 
     size_t bytes_to_read = size;
-    if (inode.inode.size - offset < size)
-        bytes_to_read = inode.inode.size - offset;
+    if ((size_t)(inode->inode.size - offset) < size)
+        bytes_to_read = inode->inode.size - offset;
 
     // note: because we check the size of bytes_to_read the value always
     // fits into a uint32_t hence the cast is valid
-    return edfs_read_inode_data(img, &inode, buf, (uint32_t)bytes_to_read, offset);
+    return edfs_read_inode_data(img, inode, buf, (uint32_t)bytes_to_read, offset);
 }
 
+static int
+edfuse_read(const char *path, char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi)
+{
+    edfs_image_t *img = get_edfs_image();
+    edfs_file_t *file = get_edfs_file(fi);
+
+    if (file && file->stats)
+        return edfs_stats_file_read(file, buf, size, offset);
+
+    edfs_inode_t inode;
+    if (!edfs_file_get_inode(img, path, file, &inode))
+        return -ENOENT;
+
+    if (offset < 0)
+        return -EINVAL;
+
+    edfs_inode_lock(img, inode.inumber, false);
+
+    /* The handle may be stale if the file was written to since. */
+    int ret = edfs_read_inode(img, &inode);
+    if (ret > 0)
+        ret = edfs_read_locked(img, &inode, buf, size, offset);
+
+    if (ret > 0 && file)
+    {
+        pthread_mutex_lock(&file->ra_lock);
+        edfs_readahead(img, &inode, &file->ra, (uint32_t)offset, ret);
+        pthread_mutex_unlock(&file->ra_lock);
+    }
+
+    edfs_inode_unlock(img, inode.inumber);
+
+    return ret;
+}
+
+/* Number of blocks resolved at a time by edfs_read_buf_locked(). */
+#define EDFS_READ_BUF_BATCH 64
+
+/* Extent hold of each thread serving requests, see edfuse_read_buf(). */
+static pthread_key_t edfuse_hold_key;
+
+static void
+edfuse_hold_destroy(void *hold)
+{
+    edfs_extent_hold_free(hold);
+}
+
+/* Returns the extent hold of the calling thread, NULL if there is no
+ * memory for one.
+ */
+static edfs_extent_hold_t *
+edfuse_get_hold(edfs_image_t *img)
+{
+    edfs_extent_hold_t *hold = pthread_getspecific(edfuse_hold_key);
+    if (!hold)
+    {
+        hold = edfs_extent_hold_new(img);
+        if (hold && pthread_setspecific(edfuse_hold_key, hold) != 0)
+        {
+            edfs_extent_hold_free(hold);
+            hold = NULL;
+        }
+    }
+
+    return hold;
+}
+
+/* libfuse sends the reply to a request before the thread that served
+ * it takes the next one, so by then its extents have been read.
+ */
+static void
+edfuse_clear_hold(void)
+{
+    edfs_extent_hold_t *hold = pthread_getspecific(edfuse_hold_key);
+    if (hold)
+        edfs_extent_hold_clear(hold);
+}
+
+/* Describes the data of @inode in [offset, offset + size) as a buffer
+ * vector for splicing. With @extents, blocks that are only on the image
+ * become fd extents, merged where they are physically contiguous. Holes
+ * and blocks that are cached, and may be newer than the image, are
+ * copied into memory buffers, which libfuse frees along with the vector.
+ * Returns the number of bytes described; *has_fd tells whether any of
+ * them is an extent.
+ */
+static int
+edfs_read_buf_locked(edfs_image_t *img, edfs_inode_t *inode,
+                     struct fuse_bufvec **bufp, size_t size, off_t offset,
+                     bool extents, bool *has_fd)
+{
+    const uint16_t BLK_SIZE = img->sb.block_size;
+
+    if (inode->inode.type == EDFS_INODE_TYPE_DIRECTORY)
+        return -EISDIR;
+    else if (inode->inode.type != EDFS_INODE_TYPE_FILE)
+        return -EIO;
+
+    uint32_t off = (uint32_t)offset;
+    uint32_t end = off;
+    if (offset < inode->inode.size)
+        end = inode->inode.size - off < size ? inode->inode.size : off + size;
+
+    uint32_t n_blocks = end > off ? (end - 1) / BLK_SIZE - off / BLK_SIZE + 1 : 0;
+
+    struct fuse_bufvec *bufv = calloc(1, sizeof(struct fuse_bufvec) +
+                                      n_blocks * sizeof(struct fuse_buf));
+    if (!bufv)
+        return -ENOMEM;
+
+    /* First the extents; a memory buffer temporarily keeps its file
+     * offset in pos.
+     */
+    edfs_block_t blocks[EDFS_READ_BUF_BATCH];
+    int ret = 0;
+
+    for (uint32_t id = off / BLK_SIZE; id * BLK_SIZE < end && ret >= 0; )
+    {
+        uint32_t n = (end - 1) / BLK_SIZE - id + 1;
+        if (n > EDFS_READ_BUF_BATCH)
+            n = EDFS_READ_BUF_BATCH;
+
+        ret = edfs_inode_map_blocks(img, inode, id, n, blocks);
+
+        for (uint32_t i = 0; i < n && ret >= 0; i++, id++)
+        {
+            uint32_t lo = id * BLK_SIZE > off ? id * BLK_SIZE : off;
+            uint32_t hi = (id + 1) * BLK_SIZE < end ? (id + 1) * BLK_SIZE : end;
+
+            bool on_image = extents && blocks[i] != EDFS_BLOCK_INVALID &&
+                !edfs_cache_contains(img, blocks[i]);
+            off_t pos = on_image ?
+                edfs_get_block_offset(&img->sb, blocks[i]) + lo % BLK_SIZE : lo;
+
+            struct fuse_buf *prev = bufv->count > 0 ?
+                &bufv->buf[bufv->count - 1] : NULL;
+
+            if (prev && !!(prev->flags & FUSE_BUF_IS_FD) == on_image &&
+                prev->pos + (off_t)prev->size == pos)
+            {
+                prev->size += hi - lo;
+                continue;
+            }
+
+            struct fuse_buf *buf = &bufv->buf[bufv->count++];
+            buf->size = hi - lo;
+            buf->pos = pos;
+            if (on_image)
+            {
+                buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                buf->fd = img->fd;
+                *has_fd = true;
+            }
+            else
+                buf->fd = -1;
+        }
+    }
+
+    /* Then fill the memory buffers. */
+    for (size_t i = 0; i < bufv->count && ret >= 0; i++)
+    {
+        struct fuse_buf *buf = &bufv->buf[i];
+        if (buf->flags & FUSE_BUF_IS_FD)
+            continue;
+
+        buf->mem = malloc(buf->size);
+        if (!buf->mem)
+            ret = -ENOMEM;
+        else
+            ret = edfs_read_inode_data(img, inode, buf->mem, buf->size,
+                                       (uint32_t)buf->pos);
+        buf->pos = 0;
+    }
+
+    if (ret < 0)
+    {
+        for (size_t i = 0; i < bufv->count; i++)
+            free(bufv->buf[i].mem);
+        free(bufv);
+        return ret;
+    }
+
+    *bufp = bufv;
+
+    return end - off;
+}
+
+/* Like edfuse_read(), but lets libfuse splice the data straight from
+ * the image file where possible. libfuse does so after the inode lock
+ * has been dropped, so the thread sets its extent hold on the inode:
+ * blocks the file is truncated or unlinked by in the meantime are not
+ * reallocated to another file before the reply has been sent. Without
+ * a hold, all data is copied.
+ */
+static int
+edfuse_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+                off_t offset, struct fuse_file_info *fi)
+{
+    edfs_image_t *img = get_edfs_image();
+    edfs_file_t *file = get_edfs_file(fi);
+
+    if (file && file->stats)
+    {
+        struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+        if (!bufv)
+            return -ENOMEM;
+
+        *bufv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(size);
+        bufv->buf[0].mem = malloc(size);
+        int ret = bufv->buf[0].mem ?
+            edfs_stats_file_read(file, bufv->buf[0].mem, size, offset) : -ENOMEM;
+        if (ret < 0)
+        {
+            free(bufv->buf[0].mem);
+            free(bufv);
+            return ret;
+        }
+
+        bufv->buf[0].size = ret;
+        *bufp = bufv;
+        return 0;
+    }
+
+    edfs_inode_t inode;
+    if (!edfs_file_get_inode(img, path, file, &inode))
+        return -ENOENT;
+
+    if (offset < 0)
+        return -EINVAL;
+
+    edfs_extent_hold_t *hold = edfuse_get_hold(img);
+    bool has_fd = false;
+
+    edfs_inode_lock(img, inode.inumber, false);
+
+    int ret = edfs_read_inode(img, &inode);
+    if (ret > 0)
+        ret = edfs_read_buf_locked(img, &inode, bufp, size, offset,
+                                   hold != NULL, &has_fd);
+    if (ret > 0 && has_fd)
+        edfs_extent_hold_set(hold, inode.inumber);
+
+    if (ret > 0 && file)
+    {
+        pthread_mutex_lock(&file->ra_lock);
+        edfs_readahead(img, &inode, &file->ra, (uint32_t)offset, ret);
+        pthread_mutex_unlock(&file->ra_lock);
+    }
+
+    edfs_inode_unlock(img, inode.inumber);
+
+    return ret < 0 ? ret : 0;
+}
+
+/* Write @size bytes of data from @buf to @path starting at @offset.
+ * Blocks are allocated as needed; a hole left by writing beyond the end
+ * of the file is not allocated and reads back as zeroes.
+ */
 static int
 edfuse_write(const char *path, const char *buf, size_t size, off_t offset,
              struct fuse_file_info *fi)
 {
-  /* TODO: implement
-   *
-   * Write @size bytes of data from @buf to @path starting at @offset.
-   * Allocate new blocks as necessary. You may have to fill holes! Update
-   * the file size if necessary.
-   */
-  return -ENOSYS;
+    edfs_image_t *img = get_edfs_image();
+    edfs_file_t *file = get_edfs_file(fi);
+
+    if (file && file->stats)
+        return -EBADF;
+
+    edfs_inode_t inode;
+    if (!edfs_file_get_inode(img, path, file, &inode))
+        return -ENOENT;
+
+    if (offset < 0)
+        return -EINVAL;
+    else if (offset + size > UINT32_MAX)
+        return -EFBIG;
+
+    edfs_journal_start(img);
+    edfs_inode_lock(img, inode.inumber, true);
+
+    int ret = edfs_read_inode(img, &inode);
+    if (ret > 0)
+    {
+        if (inode.inode.type == EDFS_INODE_TYPE_DIRECTORY)
+            ret = -EISDIR;
+        else if (inode.inode.type != EDFS_INODE_TYPE_FILE)
+            ret = -EIO;
+        else
+            ret = edfs_write_inode_data(img, &inode, buf,
+                                        (uint32_t)size, (uint32_t)offset,
+                                        file ? &file->prealloc : NULL);
+    }
+
+    if (file && ret > 0)
+        __atomic_store_n(&file->written, true, __ATOMIC_RELAXED);
+
+    edfs_inode_unlock(img, inode.inumber);
+    edfs_journal_stop(img);
+
+    return ret;
+}
+
+/* Like edfuse_write(), for data handed over as a buffer vector. A
+ * single memory buffer is written in place; data in a pipe or spread
+ * over several buffers is gathered into one buffer first.
+ */
+static int
+edfuse_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+                 struct fuse_file_info *fi)
+{
+    struct fuse_buf *first = &buf->buf[buf->idx];
+
+    if (buf->count - buf->idx == 1 && !(first->flags & FUSE_BUF_IS_FD))
+        return edfuse_write(path, (const char *)first->mem + buf->off,
+                            first->size - buf->off, offset, fi);
+
+    size_t size = fuse_buf_size(buf);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+
+    dst.buf[0].mem = malloc(size);
+    if (!dst.buf[0].mem)
+        return -ENOMEM;
+
+    ssize_t n = fuse_buf_copy(&dst, buf, 0);
+    int ret = n < 0 ? (int)n : edfuse_write(path, dst.buf[0].mem, n, offset, fi);
+
+    free(dst.buf[0].mem);
+
+    return ret;
+}
+
+/* Allocate the blocks backing [offset, offset + length) of the file,
+ * extending it if needed. Only the default mode is supported.
+ */
+static int
+edfuse_fallocate(const char *path, int mode, off_t offset, off_t length,
+                 struct fuse_file_info *fi)
+{
+    edfs_image_t *img = get_edfs_image();
+    edfs_file_t *file = get_edfs_file(fi);
+
+    if (file && file->stats)
+        return -EBADF;
+    else if (mode != 0)
+        return -EOPNOTSUPP;
+    else if (offset < 0 || length <= 0)
+        return -EINVAL;
+    else if (offset + length > UINT32_MAX)
+        return -EFBIG;
+
+    edfs_inode_t inode;
+    if (!edfs_file_get_inode(img, path, file, &inode))
+        return -ENOENT;
+
+    edfs_journal_start(img);
+    edfs_inode_lock(img, inode.inumber, true);
+
+    int ret = edfs_read_inode(img, &inode);
+    if (ret > 0)
+    {
+        if (inode.inode.type == EDFS_INODE_TYPE_DIRECTORY)
+            ret = -EISDIR;
+        else if (inode.inode.type != EDFS_INODE_TYPE_FILE)
+            ret = -EIO;
+        else
+            ret = edfs_allocate_inode_data(img, &inode, (uint32_t)length,
+                                           (uint32_t)offset,
+                                           file ? &file->prealloc : NULL);
+    }
+
+    edfs_inode_unlock(img, inode.inumber);
+    edfs_journal_stop(img);
+
+    if (ret >= 0 && ret < length)
+        return -ENOSPC;
+
+    return ret < 0 ? ret : 0;
 }
 
 
+/* The size of @path is set to @offset. Superfluous blocks are released,
+ * growing the file leaves a hole.
+ */
+static int
+edfs_truncate_file(edfs_image_t *img, const char *path, off_t offset,
+                   edfs_file_t *file)
+{
+    if (edfs_is_stats_path(path) || (file && file->stats))
+        return -EACCES;
+    else if (offset < 0)
+        return -EINVAL;
+    else if (offset > UINT32_MAX)
+        return -EFBIG;
+
+    edfs_inode_t inode;
+    if (!edfs_file_get_inode(img, path, file, &inode))
+        return -ENOENT;
+
+    edfs_journal_start(img);
+    edfs_inode_lock(img, inode.inumber, true);
+
+    /* Blocks reserved for appends past the new end are returned. */
+    if (file)
+        edfs_prealloc_release(img, &file->prealloc);
+
+    int ret = edfs_read_inode(img, &inode);
+    if (ret > 0)
+    {
+        if (inode.inode.type == EDFS_INODE_TYPE_DIRECTORY)
+            ret = -EISDIR;
+        else if (inode.inode.type != EDFS_INODE_TYPE_FILE)
+            ret = -EIO;
+        else
+            ret = edfs_truncate_inode_data(img, &inode, (uint32_t)offset);
+    }
+
+    edfs_inode_unlock(img, inode.inumber);
+    edfs_journal_stop(img);
+
+    return ret < 0 ? ret : 0;
+}
+
 static int
 edfuse_truncate(const char *path, off_t offset)
 {
-  /* TODO: implement
-   *
-   * The size of @path must be set to be @offset. Release now superfluous
-   * blocks or allocate new blocks that are necessary to cover offset.
-   */
-  return -ENOSYS;
+    return edfs_truncate_file(get_edfs_image(), path, offset, NULL);
+}
+
+static int
+edfuse_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+    return edfs_truncate_file(get_edfs_image(), path, offset,
+                              get_edfs_file(fi));
+}
+
+
+/* Called on every close() of a handle. If data was written through it,
+ * the dirty blocks in the cache are written back to the image, without
+ * waiting for the writeback thread; fsync() also commits them to disk.
+ */
+static int
+edfuse_flush(const char *path, struct fuse_file_info *fi)
+{
+  edfs_file_t *file = get_edfs_file(fi);
+
+  if (!file || !__atomic_exchange_n(&file->written, false, __ATOMIC_RELAXED))
+    return 0;
+
+  return edfs_cache_flush(get_edfs_image());
+}
+
+/* Write back everything held in the block cache and commit it to disk. */
+static int
+edfuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  return edfs_image_sync(img, datasync != 0);
+}
+
+/* SIGUSR1 is blocked in all threads but this one, which writes the
+ * statistics report to stderr whenever the signal arrives.
+ */
+static pthread_t edfs_stats_thread;
+static bool edfs_stats_thread_started = false;
+
+static void *
+edfs_stats_thread_main(void *arg)
+{
+  edfs_image_t *img = (edfs_image_t *)arg;
+
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+
+  for (;;)
+    {
+      int sig;
+      if (sigwait(&set, &sig) != 0)
+        continue;
+
+      /* Only the wait may be cancelled, not a half-written report. */
+      pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+      size_t size;
+      char *report = edfs_stats_report(img, &size);
+      if (report)
+        {
+          fwrite(report, 1, size, stderr);
+          fflush(stderr);
+          free(report);
+        }
+
+      pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+  return NULL;
+}
+
+/* Called once the file system is mounted, and after FUSE has detached
+ * from the terminal, so that the thread started here survives.
+ */
+static void *
+edfuse_init(struct fuse_conn_info *conn)
+{
+  edfs_image_t *img = get_edfs_image();
+
+  if (pthread_create(&edfs_stats_thread, NULL, edfs_stats_thread_main, img) == 0)
+    edfs_stats_thread_started = true;
+
+  /* Without it, dirty blocks are only written back on eviction. */
+  if (!edfs_cache_writeback_start(img))
+    fprintf(stderr, "warning: could not start the writeback thread.\n");
+
+  return img;
+}
+
+static void
+edfuse_destroy(void *private_data)
+{
+  edfs_image_t *img = (edfs_image_t *)private_data;
+
+  if (edfs_stats_thread_started)
+    {
+      pthread_cancel(edfs_stats_thread);
+      pthread_join(edfs_stats_thread, NULL);
+      edfs_stats_thread_started = false;
+    }
+
+  edfs_cache_writeback_stop(img);
+  edfs_image_sync(img, false);
 }
 
 
@@ -692,23 +1180,120 @@ edfuse_truncate(const char *path, off_t offset)
  * FUSE setup
  */
 
+/* Defines edfuse_timed_<name>(), which calls edfuse_<name>() and records
+ * its latency as operation @op. Any request also tells that the reply
+ * to the previous one of the thread has been sent.
+ */
+#define EDFUSE_TIMED(name, op, params, args)                    \
+  static int                                                    \
+  edfuse_timed_##name params                                    \
+  {                                                             \
+    edfuse_clear_hold();                                        \
+    uint64_t start = edfs_stats_now();                          \
+    int ret = edfuse_##name args;                               \
+    edfs_stats_op(get_edfs_image(), op, start);                 \
+    return ret;                                                 \
+  }
+
+EDFUSE_TIMED(readdir, EDFS_OP_READDIR,
+             (const char *path, void *buf, fuse_fill_dir_t filler,
+              off_t offset, struct fuse_file_info *fi),
+             (path, buf, filler, offset, fi))
+EDFUSE_TIMED(mkdir, EDFS_OP_MKDIR,
+             (const char *path, mode_t mode), (path, mode))
+EDFUSE_TIMED(rmdir, EDFS_OP_RMDIR, (const char *path), (path))
+EDFUSE_TIMED(getattr, EDFS_OP_GETATTR,
+             (const char *path, struct stat *stbuf), (path, stbuf))
+EDFUSE_TIMED(fgetattr, EDFS_OP_GETATTR,
+             (const char *path, struct stat *stbuf, struct fuse_file_info *fi),
+             (path, stbuf, fi))
+EDFUSE_TIMED(open, EDFS_OP_OPEN,
+             (const char *path, struct fuse_file_info *fi), (path, fi))
+EDFUSE_TIMED(release, EDFS_OP_RELEASE,
+             (const char *path, struct fuse_file_info *fi), (path, fi))
+EDFUSE_TIMED(create, EDFS_OP_CREATE,
+             (const char *path, mode_t mode, struct fuse_file_info *fi),
+             (path, mode, fi))
+EDFUSE_TIMED(unlink, EDFS_OP_UNLINK, (const char *path), (path))
+EDFUSE_TIMED(read, EDFS_OP_READ,
+             (const char *path, char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi),
+             (path, buf, size, offset, fi))
+EDFUSE_TIMED(read_buf, EDFS_OP_READ,
+             (const char *path, struct fuse_bufvec **bufp, size_t size,
+              off_t offset, struct fuse_file_info *fi),
+             (path, bufp, size, offset, fi))
+EDFUSE_TIMED(write, EDFS_OP_WRITE,
+             (const char *path, const char *buf, size_t size, off_t offset,
+              struct fuse_file_info *fi),
+             (path, buf, size, offset, fi))
+EDFUSE_TIMED(write_buf, EDFS_OP_WRITE,
+             (const char *path, struct fuse_bufvec *buf, off_t offset,
+              struct fuse_file_info *fi),
+             (path, buf, offset, fi))
+EDFUSE_TIMED(fallocate, EDFS_OP_FALLOCATE,
+             (const char *path, int mode, off_t offset, off_t length,
+              struct fuse_file_info *fi),
+             (path, mode, offset, length, fi))
+EDFUSE_TIMED(truncate, EDFS_OP_TRUNCATE,
+             (const char *path, off_t offset), (path, offset))
+EDFUSE_TIMED(ftruncate, EDFS_OP_TRUNCATE,
+             (const char *path, off_t offset, struct fuse_file_info *fi),
+             (path, offset, fi))
+EDFUSE_TIMED(flush, EDFS_OP_FLUSH,
+             (const char *path, struct fuse_file_info *fi), (path, fi))
+EDFUSE_TIMED(fsync, EDFS_OP_FSYNC,
+             (const char *path, int datasync, struct fuse_file_info *fi),
+             (path, datasync, fi))
+
 static struct fuse_operations edfs_oper =
 {
-  .readdir   = edfuse_readdir,
-  .mkdir     = edfuse_mkdir,
-  .rmdir     = edfuse_rmdir,
-  .getattr   = edfuse_getattr,
-  .open      = edfuse_open,
-  .create    = edfuse_create,
-  .unlink    = edfuse_unlink,
-  .read      = edfuse_read,
-  .write     = edfuse_write,
-  .truncate  = edfuse_truncate,
+  .readdir   = edfuse_timed_readdir,
+  .mkdir     = edfuse_timed_mkdir,
+  .rmdir     = edfuse_timed_rmdir,
+  .getattr   = edfuse_timed_getattr,
+  .fgetattr  = edfuse_timed_fgetattr,
+  .open      = edfuse_timed_open,
+  .release   = edfuse_timed_release,
+  .create    = edfuse_timed_create,
+  .unlink    = edfuse_timed_unlink,
+  .read      = edfuse_timed_read,
+  .read_buf  = edfuse_timed_read_buf,
+  .write     = edfuse_timed_write,
+  .write_buf = edfuse_timed_write_buf,
+  .fallocate = edfuse_timed_fallocate,
+  .truncate  = edfuse_timed_truncate,
+  .ftruncate = edfuse_timed_ftruncate,
+  .flush     = edfuse_timed_flush,
+  .fsync     = edfuse_timed_fsync,
+  .init      = edfuse_init,
+  .destroy   = edfuse_destroy,
 };
 
 int
 main(int argc, char *argv[])
 {
+  /* Our own options are removed before the arguments are passed on
+   * to FUSE.
+   */
+  edfs_io_mode_t io_mode = EDFS_IO_PREAD;
+  bool journal = false;
+  for (int i = 1; i < argc; ++i)
+    {
+      if (strcmp(argv[i], "--mmap") == 0)
+        io_mode = EDFS_IO_MMAP;
+      else if (strcmp(argv[i], "--io-uring") == 0)
+        io_mode = EDFS_IO_URING;
+      else if (strcmp(argv[i], "--journal") == 0)
+        journal = true;
+      else
+        continue;
+
+      memmove(&argv[i], &argv[i + 1], (argc - i) * sizeof(char *));
+      argc--;
+      i--;
+    }
+
   /* Count number of arguments without hyphens; excluding execname */
   int count = 0;
   for (int i = 1; i < argc; ++i)
@@ -731,12 +1316,55 @@ main(int argc, char *argv[])
   argc--;
 
   /* Try to open the file system */
-  edfs_image_t *img = edfs_image_open(filename, true);
+  edfs_image_t *img = edfs_image_open(filename, true, io_mode);
   if (!img)
     return -1;
 
+  /* --journal adds a metadata journal to an image that has none. */
+  if (journal && img->sb.journal_n_blocks == 0)
+    {
+      int ret = edfs_journal_create(img);
+      if (ret < 0)
+        {
+          fprintf(stderr, "error: file '%s': could not create journal: %s\n",
+                  filename, strerror(-ret));
+          edfs_image_close(img);
+          return -1;
+        }
+    }
+
+  /* Ask for writes of up to 128 KiB per call by default. The image is
+   * only changed through this mount, so the kernel may cache names,
+   * negative lookups and attributes for long, and identifies files by
+   * their inumbers. Options given on the command line come later and
+   * take precedence.
+   */
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  fuse_opt_insert_arg(&args, 1, "-obig_writes,max_write=131072,use_ino,"
+                      EDFUSE_TIMEOUT_OPTS);
+
+  /* Threads started by FUSE inherit the mask, leaving SIGUSR1 to the
+   * statistics thread started in edfuse_init().
+   */
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  if (pthread_key_create(&edfuse_hold_key, edfuse_hold_destroy) != 0)
+    {
+      fprintf(stderr, "error: could not create thread key.\n");
+      edfs_image_close(img);
+      return -1;
+    }
+
   /* Start fuse main loop */
-  int ret = fuse_main(argc, argv, &edfs_oper, img);
+  int ret = fuse_main(args.argc, args.argv, &edfs_oper, img);
+  fuse_opt_free_args(&args);
+
+  /* The loop may have run on this thread. */
+  edfs_extent_hold_free(pthread_getspecific(edfuse_hold_key));
+  pthread_key_delete(edfuse_hold_key);
   edfs_image_close(img);
 
   return ret;